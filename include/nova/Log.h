@@ -1,10 +1,23 @@
 #ifndef __NOVA_LOG_H
 #define __NOVA_LOG_H
 
+#include <stddef.h>
 #include <string>
 
 namespace nova {
 
+    /** How the background thread started by Log::start_async works. */
+    struct LogConfig {
+        LogConfig();
+
+        /** Messages are appended here instead of going to syslog if set. */
+        std::string file;
+
+        /** How many messages each thread may have waiting to be written
+         *  before any more are dropped. Rounded up to a power of two. */
+        size_t queue_size;
+    };
+
     class Log {
 
         public:
@@ -14,9 +27,28 @@ namespace nova {
             void error(const std::string & msg);
             void error2(const char* format, ... );
 
+            /** Messages dropped because their thread's queue was full. */
+            static unsigned long get_dropped_count();
+
+            /** From now on logging only copies the format and arguments
+             *  into a queue for the calling thread, and a background thread
+             *  formats and writes them, so a slow syslog can't hold anyone
+             *  up. Strings given to %s are copied too, so they needn't
+             *  outlive the call, but the format itself must. */
+            static void start_async(const LogConfig & config = LogConfig());
+
+            /** Has the background thread close and open the log file
+             *  again, so it can be rotated. Does nothing unless start_async
+             *  was given a file. */
+            static void reopen_file();
+
+            /** Writes out everything queued and goes back to writing on
+             *  the calling thread. Messages logged while this runs may be
+             *  lost. */
+            static void stop_async();
+
     };
 
 }
 
 #endif
-
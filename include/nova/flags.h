@@ -97,8 +97,34 @@ class FlagValues {
 
         const char * guest_ethernet_device() const;
 
+        /** Seconds callers wait for a reply before giving up, zero, the
+         *  default, for forever. Calls older than this aren't run. */
+        double guest_message_time_budget() const;
+
+        /** Comma separated method=seconds pairs overriding
+         *  guest_message_time_budget. */
+        const char * guest_method_time_budgets() const;
+
+        /** Comma separated methods the dispatcher runs ahead of the
+         *  rest. */
+        const char * guest_priority_methods() const;
+
+        size_t guest_worker_count() const;
+
         boost::optional<const char *> host() const;
 
+        /** Hands messages to a background thread to be written instead of
+         *  writing them on the thread logging. */
+        bool log_async() const;
+
+        /** If set, asynchronous logging appends here instead of going to
+         *  syslog. */
+        const char * log_file() const;
+
+        /** Messages each thread may have waiting when logging
+         *  asynchronously before more are dropped. */
+        size_t log_queue_size() const;
+
         const char * node_availability_zone() const;
 
         const char * nova_sql_database() const;
@@ -115,16 +141,49 @@ class FlagValues {
 
         size_t rabbit_client_memory() const;
 
+        /** Replies at least this many bytes long are deflated. Zero, the
+         *  default, leaves them alone. */
+        size_t rabbit_compression_threshold() const;
+
+        /** Seconds between AMQP heartbeats, zero to turn them off. */
+        int rabbit_heartbeat() const;
+
         const char * rabbit_host() const;
 
+        /** If true, also take messages broadcast to every guest on the
+         *  "guest_fanout" exchange. Off unless asked for. */
+        bool rabbit_listen_to_fanout() const;
+
+        /** If true, also take messages from "<topic>.priority" and run
+         *  them ahead of the rest. */
+        bool rabbit_listen_to_priority() const;
+
+        bool rabbit_listen_to_topic() const;
+
+        /** Ceiling on the wait between reconnect attempts, which starts
+         *  at rabbit_reconnect_wait_time and doubles after each failure. */
+        unsigned long rabbit_max_reconnect_wait_time() const;
+
         const char * rabbit_password() const;
 
         const int rabbit_port() const;
 
+        unsigned short rabbit_prefetch_count() const;
+
+        bool rabbit_publisher_confirms() const;
+
         unsigned long rabbit_reconnect_wait_time() const;
 
         const char * rabbit_userid() const;
 
+        /** File the recent replies are kept in, so they aren't lost on
+         *  restart. Empty, the default, keeps them in memory only. */
+        const char * reply_cache_path() const;
+
+        /** How many recent replies are remembered to answer redelivered
+         *  messages without running them again. */
+        size_t reply_cache_size() const;
+
         unsigned long report_interval() const;
 
     private:
@@ -14,11 +14,13 @@ namespace nova { namespace guest {
             enum Code {
                 CONFIG_FILE_PARSE_ERROR,
                 COULD_NOT_CONVERT_ADDRESS,
+                COULD_NOT_CREATE_PIPE,
                 COULD_NOT_GET_DEVICE,
                 COULD_NOT_GET_INTERFACES,
                 ERROR_GRABBING_HOST_NAME,
                 GENERAL,
                 MALFORMED_INPUT,
+                MESSAGE_EXPIRED,
                 NO_SUCH_METHOD
             };
 
@@ -26,7 +28,7 @@ namespace nova { namespace guest {
 
             virtual ~GuestException() throw();
 
-            virtual const char * what() throw();
+            virtual const char * what() const throw();
 
         private:
             Code code;
@@ -0,0 +1,158 @@
+#ifndef __NOVA_GUEST_DISPATCHER_H
+#define __NOVA_GUEST_DISPATCHER_H
+
+#include <deque>
+#include <boost/function.hpp>
+#include "nova/guest/guest.h"
+#include "nova/Log.h"
+#include <map>
+#include <boost/noncopyable.hpp>
+#include <set>
+#include <string>
+#include <boost/thread.hpp>
+#include <vector>
+
+
+namespace nova { namespace guest {
+
+    /** Runs messages through the message handlers on a pool of worker
+     *  threads so a long running method doesn't hold up everything queued
+     *  behind it.
+     *  Nothing here touches the message transport. Results are collected
+     *  with take_completions by whichever thread owns the transport, which
+     *  can wait on get_completion_fd to know when there are some.
+     *  High priority messages are always started ahead of the rest, so
+     *  quick probes aren't stuck behind a pile of slow requests. */
+    class Dispatcher : boost::noncopyable {
+
+        public:
+            enum ConcurrencyClass {
+                /* Runs one at a time, in the order received, alongside any
+                 * number of SHARED methods. */
+                EXCLUSIVE,
+                /* Runs as soon as there's a free worker. */
+                SHARED
+            };
+
+            struct Completion {
+                GuestInput input;
+                GuestOutput output;
+            };
+
+            typedef boost::function<void()> Task;
+
+            Dispatcher(const std::vector<MessageHandlerPtr> & handlers,
+                       size_t worker_count);
+
+            /** Stops the workers. Messages which haven't started are
+             *  abandoned; they were never acknowledged so the broker will
+             *  deliver them again. Tasks which haven't started are
+             *  dropped. */
+            ~Dispatcher();
+
+            /** Queues a message to be handled by a worker. If its deadline
+             *  has passed by the time a worker gets to it, it fails
+             *  without being run. */
+            void dispatch(const GuestInput & input);
+
+            /** Methods not given a class are EXCLUSIVE. */
+            ConcurrencyClass get_concurrency_class(
+                const std::string & method_name) const;
+
+            /** Becomes readable when there are completions to take. */
+            inline int get_completion_fd() const {
+                return wake_pipe[0];
+            }
+
+            /** The number of messages dispatched but not yet taken back with
+             *  take_completions. */
+            size_t get_outstanding_count() const;
+
+            /** True if the message came in on a priority queue or calls a
+             *  method set as high priority. */
+            bool is_high_priority(const GuestInput & input) const;
+
+            /** Should be called before anything is dispatched. */
+            void set_concurrency_class(const char * method_name,
+                                       ConcurrencyClass value);
+
+            /** Makes every message for this method high priority. Should
+             *  be called before anything is dispatched. */
+            void set_high_priority(const char * method_name);
+
+            /** For methods which only read. A message dispatched while one
+             *  with the same method and args is waiting or running isn't
+             *  run itself; it completes with a copy of the other's output.
+             *  Should be called before anything is dispatched. */
+            void set_single_flight(const char * method_name);
+
+            /** Runs something other than a message on a worker, as if it
+             *  were a SHARED method. Nothing is added to the completions,
+             *  and anything it throws is logged. */
+            void post(Task task);
+
+            /** Appends any finished messages to completed without waiting. */
+            void take_completions(std::vector<Completion> & completed);
+
+        private:
+            /** A message or a task, whichever is set. */
+            struct Job {
+                // Set if the message may be shared with duplicates.
+                std::string flight_key;
+                GuestInput input;
+                Task task;
+            };
+
+            std::map<std::string, ConcurrencyClass> classes;
+
+            std::vector<Completion> completions;
+
+            bool exclusive_running;
+
+            /** Duplicates of each single flight message waiting or running,
+             *  by flight key, which complete along with it. */
+            std::map<std::string, std::vector<GuestInput> > flights;
+
+            std::vector<MessageHandlerPtr> handlers;
+
+            Log log;
+
+            mutable boost::mutex mutex;
+
+            /** Finds the next message allowed to run and removes it from
+             *  priority_pending or pending. Must be called with mutex
+             *  held. */
+            bool next_runnable(Job & job, bool & exclusive);
+
+            /** Looks for a runnable job in one of the queues. passed_exclusive
+             *  carries over from the queues looked at before it. */
+            bool next_runnable_in(std::deque<Job> & jobs, Job & job,
+                                  bool & exclusive, bool & passed_exclusive);
+
+            size_t outstanding;
+
+            std::deque<Job> pending;
+
+            std::set<std::string> priority_methods;
+
+            std::deque<Job> priority_pending;
+
+            GuestOutput run(const GuestInput & input);
+
+            std::set<std::string> single_flight_methods;
+
+            bool stopping;
+
+            boost::thread_group workers;
+
+            boost::condition_variable work_available;
+
+            void worker_loop();
+
+            int wake_pipe[2];
+
+    };
+
+} }
+
+#endif
@@ -5,13 +5,48 @@
 #include <nova/json.h>
 #include <boost/optional.hpp>
 #include <boost/smart_ptr.hpp>
+#include <string>
 
 
 namespace nova { namespace guest {
 
     struct GuestInput {
-        nova::JsonObjectPtr args;
+        GuestInput()
+        : connection_generation(0), deadline(), delivery_tag(-1),
+          high_priority(false) {
+        }
+
+        /** Set by the receiver to the text of the arguments, which is
+         *  always a JSON object. Handlers read it into a
+         *  nova::json::Document or through parse_args. */
+        std::string args_text;
+
+        /** Set by the receiver. Identifies the connection the message
+         *  arrived on, since delivery tags mean nothing on any other. */
+        unsigned long connection_generation;
+
+        /** Set by the receiver if the sender will have given up on a
+         *  reply by this time, in seconds since the epoch. */
+        boost::optional<double> deadline;
+
+        /** Set by the receiver so the message can be acknowledged once
+         *  it's finished, even if others were finished in the meantime. */
+        int delivery_tag;
+
+        /** Set by the receiver if the message came in on the priority
+         *  queue. */
+        bool high_priority;
+
         std::string method_name;
+
+        /** Set by the receiver if the sender wants a reply. */
+        boost::optional<std::string> msg_id;
+
+        /** Parses args_text into a new JsonObject each time. */
+        nova::JsonObjectPtr parse_args() const {
+            return nova::JsonObjectPtr(new nova::JsonObject(
+                args_text.empty() ? "{}" : args_text.c_str()));
+        }
     };
 
     struct GuestOutput {
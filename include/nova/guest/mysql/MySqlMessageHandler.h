@@ -2,6 +2,7 @@
 #define __NOVA_GUEST_MYSQL_MYSQLMESSAGEHANDLER_H
 
 #include "nova/guest/guest.h"
+#include "nova/json/dom.h"
 #include <map>
 #include "nova/guest/mysql/MySqlAdmin.h"
 #include "nova/guest/mysql/MySqlNovaUpdater.h"
@@ -26,7 +27,7 @@ namespace nova { namespace guest { namespace mysql {
             virtual JsonDataPtr handle_message(const GuestInput & input);
 
             typedef nova::JsonDataPtr (* MethodPtr)(
-                const MySqlMessageHandler *, nova::JsonObjectPtr);
+                const MySqlMessageHandler *, nova::json::Value);
 
             typedef std::map<std::string, MethodPtr> MethodMap;
 
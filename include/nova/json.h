@@ -3,7 +3,9 @@
 
 #include <boost/optional.hpp>
 #include <boost/shared_ptr.hpp>
+#include <map>
 #include <string>
+#include <vector>
 
 
 struct json_object;
@@ -43,6 +45,8 @@ namespace nova {
 
     class JsonData;
 
+    class JsonMember;
+
     class JsonObject;
 
     typedef boost::shared_ptr<JsonData> JsonDataPtr;
@@ -53,6 +57,7 @@ namespace nova {
 
 
     class JsonData {
+        friend class JsonMember;
 
         public:
             JsonData(json_object * obj);
@@ -65,6 +70,11 @@ namespace nova {
 
             static JsonDataPtr from_null();
 
+            /** Holds JSON which was already written out, to be sent exactly
+             *  as given. The text isn't checked, and nothing but to_string
+             *  and to_canonical_string work on the result. */
+            static JsonDataPtr from_raw(const std::string & text);
+
             static JsonDataPtr from_string(const char * text);
 
             // Escapes string. Adds quotes to beginning and end.
@@ -76,6 +86,10 @@ namespace nova {
 
             const char * to_string() const;
 
+            /** Like to_string, but with the keys of every object sorted and
+             *  no spaces, so equal values always give the same text. */
+            std::string to_canonical_string() const;
+
         protected:
             struct Root {
                 int reference_count;
@@ -100,6 +114,9 @@ namespace nova {
             Root * root;
 
         private:
+            // Set instead of object by from_raw.
+            boost::optional<std::string> raw;
+
             JsonData(json_object * obj, int type);
 
             // Validates that obj is not null, is of the given type. If not it
@@ -112,6 +129,7 @@ namespace nova {
 
 
     class JsonArray : public JsonData {
+        friend class JsonMember;
         friend class JsonObject;
 
         public:
@@ -153,10 +171,15 @@ namespace nova {
      * exceptions if values aren't found. */
     class JsonObject : public JsonData {
         friend class JsonArray;
+        friend class JsonMember;
 
         public:
             JsonObject(const char * json_text);
 
+            /** Parses the first length bytes of json_text, which does not
+             *  need to be null terminated. */
+            JsonObject(const char * json_text, size_t length);
+
             JsonObject(json_object * obj);
 
             virtual ~JsonObject();
@@ -179,6 +202,18 @@ namespace nova {
             const char * get_string_or_default(const char * key,
                                                const char * default_value) const;
 
+            // The try_get functions return false instead of throwing when
+            // the key is missing, null or of another type, and leave value
+            // alone.
+
+            bool try_get_array(const char * key, JsonArrayPtr & value) const;
+
+            bool try_get_int(const char * key, int & value) const;
+
+            bool try_get_object(const char * key, JsonObjectPtr & value) const;
+
+            bool try_get_string(const char * key, std::string & value) const;
+
         protected:
 
             JsonObject(json_object * obj, Root * root);
@@ -189,6 +224,106 @@ namespace nova {
 
     };
 
+
+    /* One value inside an object or array, good only as long as the
+     * JsonData it came from. The as functions return false instead of
+     * throwing if the value is null or of another type, and leave the
+     * argument alone. */
+    class JsonMember {
+        friend class JsonObject;
+
+        public:
+            bool as(bool & value) const;
+
+            bool as(int & value) const;
+
+            bool as(std::string & value) const;
+
+            bool as(boost::optional<std::string> & value) const;
+
+            bool as(JsonArrayPtr & value) const;
+
+            bool as(JsonObjectPtr & value) const;
+
+            bool is_null() const;
+
+        private:
+            JsonMember(json_object * value, JsonData::Root * root);
+
+            JsonData::Root * root;
+            json_object * value;
+    };
+
+
+    /* Writes JSON text straight into a buffer, escaping strings as it
+     * goes, without building json-c objects along the way. Commas are
+     * added as needed. Clearing it keeps the buffer's memory, so one
+     * writer can be reused for many documents.
+     *
+     *     writer.begin_object();
+     *     writer.key("_name");
+     *     writer.value(name);
+     *     writer.end_object();
+     */
+    class JsonWriter {
+
+        public:
+            JsonWriter();
+
+            void begin_array();
+
+            void begin_object();
+
+            /** Starts over, keeping the memory already allocated. */
+            void clear();
+
+            void end_array();
+
+            void end_object();
+
+            /** Names the next value written. Only valid in an object. */
+            void key(const char * name);
+
+            void null_value();
+
+            /** What has been written so far. */
+            inline const std::string & str() const {
+                return buffer;
+            }
+
+            /** Hands over a copy of what was written, without parsing
+             *  it. */
+            JsonDataPtr to_json_data() const;
+
+            void value(bool value);
+
+            void value(int value);
+
+            void value(const char * value);
+
+            void value(const std::string & value);
+
+            /** Writes null if there's no value. */
+            void value(const boost::optional<std::string> & value);
+
+            /** Appends text to out as a JSON string, quotes included. */
+            static void write_string(std::string & out, const char * text,
+                                     size_t length);
+
+        private:
+            /* Adds a comma if something came before in the same array or
+             * object. */
+            void before_value();
+
+            std::string buffer;
+
+            // For each array or object being written, whether anything has
+            // been put in it yet.
+            std::vector<bool> has_items;
+
+            bool key_written;
+    };
+
 } // end namespace
 
 
@@ -0,0 +1,196 @@
+#ifndef __NOVA_JSON_DOM_H
+#define __NOVA_JSON_DOM_H
+
+#include <boost/intrusive_ptr.hpp>
+#include <boost/noncopyable.hpp>
+#include "nova/json.h"
+#include <stddef.h>
+#include <string>
+
+namespace nova { namespace json {
+
+    /* Hands out memory by bumping a pointer through large chunks. Nothing
+     * is freed on its own; it all goes at once when the arena does. */
+    class Arena : boost::noncopyable {
+
+        public:
+            explicit Arena(size_t first_chunk_size = 4096);
+
+            ~Arena();
+
+            /** Returns size bytes aligned for any value a Node holds. */
+            void * allocate(size_t size);
+
+            /** Bytes handed out so far. */
+            inline size_t get_bytes_used() const {
+                return bytes_used;
+            }
+
+            /** How many times the arena has called malloc. */
+            inline size_t get_chunk_count() const {
+                return chunk_count;
+            }
+
+        private:
+            struct Chunk {
+                Chunk * previous;
+                size_t size;
+            };
+
+            void add_chunk(size_t at_least);
+
+            size_t bytes_used;
+            size_t chunk_count;
+            Chunk * chunks;
+            char * cursor;
+            char * end;
+            size_t next_chunk_size;
+    };
+
+
+    enum Type {
+        ARRAY,
+        BOOLEAN,
+        DOUBLE,
+        INTEGER,
+        NULL_VALUE,
+        OBJECT,
+        STRING
+    };
+
+    struct Member;
+
+    /* How a value is laid out in the arena. Arrays and objects point at
+     * their items or members, which sit next to each other. */
+    struct Node {
+        Type type;
+
+        // Bytes in a string (not counting the ending zero), items in an
+        // array or members in an object.
+        size_t length;
+
+        union {
+            bool boolean;
+            double number;
+            long long integer;
+            const Node * items;
+            const Member * members;
+            const char * string;
+        } data;
+    };
+
+    struct Member {
+        const char * key;
+        size_t key_length;
+        Node value;
+    };
+
+
+    /* A handle to a value in a Document. It's only a pointer, so it's
+     * cheap to copy, but it is only good while the Document is alive.
+     * A handle to nothing, as find returns for a missing key, says it is
+     * missing and null. Getters throw JsonException as JsonObject's do. */
+    class Value {
+
+        public:
+            Value();
+
+            explicit Value(const Node * node);
+
+            /** The index-th item of an array. */
+            Value at(size_t index) const;
+
+            /** The member with the given key, or a missing value. */
+            Value find(const char * key) const;
+
+            /** Like find, but throws KEY_ERROR if there isn't one. */
+            Value get(const char * key) const;
+
+            bool get_bool() const;
+
+            /** Integers are turned into doubles as well. */
+            double get_double() const;
+
+            int get_int() const;
+
+            /** Strings end in a zero, but may also hold them. */
+            const char * get_string() const;
+
+            Type get_type() const;
+
+            bool is_missing() const {
+                return node == 0;
+            }
+
+            /** True for null and missing values. */
+            bool is_null() const;
+
+            /** Key of the index-th member of an object. */
+            const char * key_at(size_t index) const;
+
+            /** Items in an array, members in an object or bytes in a
+             *  string. */
+            size_t size() const;
+
+            /** Value of the index-th member of an object. */
+            Value value_at(size_t index) const;
+
+        private:
+            const Node * node;
+    };
+
+
+    class Document;
+
+    typedef boost::intrusive_ptr<Document> DocumentPtr;
+
+    /* A parsed message held entirely in one arena, freed all at once along
+     * with the Document. DocumentPtr counts references without atomic
+     * instructions, so a Document and its pointers must stay on one
+     * thread at a time, as a message being handled does. */
+    class Document : boost::noncopyable {
+
+        public:
+            ~Document();
+
+            const Arena & get_arena() const {
+                return arena;
+            }
+
+            /** Parses length bytes of text, which needn't end in a zero.
+             *  Throws CTOR_ARGUMENT_IS_NOT_JSON_STRING if it isn't JSON. */
+            static DocumentPtr parse(const char * text, size_t length);
+
+            static DocumentPtr parse(const std::string & text) {
+                return parse(text.c_str(), text.size());
+            }
+
+            Value root() const {
+                return Value(root_node);
+            }
+
+        private:
+            Document(size_t text_length);
+
+            friend void intrusive_ptr_add_ref(Document * document);
+
+            friend void intrusive_ptr_release(Document * document);
+
+            Arena arena;
+            size_t reference_count;
+            const Node * root_node;
+    };
+
+    inline void intrusive_ptr_add_ref(Document * document) {
+        document->reference_count ++;
+    }
+
+    inline void intrusive_ptr_release(Document * document) {
+        if (-- document->reference_count == 0) {
+            delete document;
+        }
+    }
+
+} } // end namespace
+
+#endif
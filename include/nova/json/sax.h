@@ -0,0 +1,139 @@
+#ifndef __NOVA_JSON_SAX_H
+#define __NOVA_JSON_SAX_H
+
+#include "nova/json.h"
+#include <stddef.h>
+#include <string>
+#include <string.h>
+
+namespace nova { namespace json {
+
+    /* Some bytes belonging to someone else, which are not followed by a
+     * zero. */
+    struct StringView {
+        const char * data;
+        size_t length;
+
+        StringView() : data(0), length(0) {
+        }
+
+        StringView(const char * data, size_t length)
+        :   data(data), length(length)
+        {
+        }
+
+        inline bool operator==(const char * text) const {
+            return strncmp(data, text, length) == 0 && text[length] == '\0';
+        }
+
+        inline bool operator!=(const char * text) const {
+            return !(*this == text);
+        }
+
+        inline bool starts_with(const char * prefix) const {
+            const size_t prefix_length = strlen(prefix);
+            return length >= prefix_length
+                   && memcmp(data, prefix, prefix_length) == 0;
+        }
+
+        inline std::string str() const {
+            return std::string(data, length);
+        }
+    };
+
+
+    /* Told by SaxParser about each thing it reads, in order. Every call
+     * returns whether to go on; returning false stops the parser. The
+     * defaults ignore everything.
+     *
+     * Views passed in are only good until the call returns. Strings
+     * without escapes point into the text being parsed; the others are
+     * unescaped into the parser's own buffer. */
+    class SaxHandler {
+
+        public:
+            enum KeyAction {
+                /* Reports the key's value like any other. */
+                READ,
+                /* Passes the value's text to raw_value without reading
+                 * what's inside. */
+                RAW,
+                /* Passes over the value without reporting anything. */
+                SKIP,
+                /* Stops the parser. */
+                STOP
+            };
+
+            virtual ~SaxHandler();
+
+            virtual bool begin_array();
+
+            virtual bool begin_object();
+
+            virtual bool bool_value(bool value);
+
+            virtual bool double_value(double value);
+
+            virtual bool end_array();
+
+            virtual bool end_object();
+
+            /** Numbers without a fraction or exponent which fit. */
+            virtual bool int_value(long long value);
+
+            /** Says what to do with the value which follows. */
+            virtual KeyAction key(const StringView & name);
+
+            virtual bool null_value();
+
+            /** The text of a value whose key asked for RAW. Raw and skipped
+             *  values are only checked for matching brackets and quotes. */
+            virtual bool raw_value(const StringView & text);
+
+            virtual bool string_value(const StringView & value);
+    };
+
+
+    /* Reads JSON text in place, reporting what it finds to a SaxHandler
+     * instead of building anything. A parser can be reused, which keeps
+     * the buffer it unescapes strings into. */
+    class SaxParser {
+
+        public:
+            SaxParser();
+
+            /** Reads length bytes of text, which needn't end in a zero.
+             *  Strings may be in single quotes, which json-c also
+             *  accepts and Nova's senders use. Returns false if the handler stopped it early. Throws
+             *  CTOR_ARGUMENT_IS_NOT_JSON_STRING if the text isn't JSON. */
+            bool parse(const char * text, size_t length, SaxHandler & handler);
+
+        private:
+            bool parse_array(SaxHandler & handler, int depth);
+
+            bool parse_number(SaxHandler & handler);
+
+            bool parse_object(SaxHandler & handler, int depth);
+
+            /* Reads a string in double or single quotes, as json-c does,
+             * leaving position just past the closing quote. */
+            StringView parse_string();
+
+            bool parse_value(SaxHandler & handler, int depth);
+
+            void skip_space();
+
+            /* Moves past the next value, only checking that brackets and
+             * quotes match. */
+            void skip_value();
+
+            const char * end;
+            const char * position;
+
+            // Holds strings which had escapes, reused from one to the next.
+            std::string unescaped;
+    };
+
+} } // end namespace
+
+#endif
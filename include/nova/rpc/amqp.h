@@ -9,7 +9,10 @@ extern "C" {
     #include <amqp_framing.h>
 }
 #include "nova/Log.h"
+#include <deque>
 #include <memory>
+#include <set>
+#include <string>
 #include <vector>
 
 namespace nova { namespace rpc {
@@ -21,18 +24,24 @@ namespace nova { namespace rpc {
             enum Code {
                 BODY_EXPECTED,
                 BODY_LARGER,
+                CHANNEL_CLOSED_BY_BROKER,
                 CLOSE_CHANNEL_FAILED,
                 CLOSE_CONNECTION_FAILED,
+                CONFIRM_SELECT_FAILED,
                 CONSUME,
                 DESTROY_CONNECTION,
                 BIND_QUEUE_FAILURE,
                 CONNECTION_FAILED,
                 DECLARE_QUEUE_FAILURE,
                 EXCHANGE_DECLARE_FAIL,
+                FRAME_WAIT_TIMED_OUT,
                 HEADER_EXPECTED,
                 LOGIN_FAILED,
+                NO_FREE_CHANNELS,
                 OPEN_CHANNEL_FAILED,
                 PUBLISH_FAILURE,
+                PUBLISH_NOT_CONFIRMED,
+                SET_QOS_FAILED,
                 WAIT_FRAME_FAILED
             };
 
@@ -58,60 +67,150 @@ namespace nova { namespace rpc {
         friend void intrusive_ptr_release(AmqpChannel * ref);
 
         public:
-            /** Attempts to declare the exchange. Does nothing if it fails. */
-            void attempt_declare_exchange(const char * exchange_name,
+            /** Declares the exchange unless it already exists. Returns true
+             *  if it did. */
+            bool attempt_declare_exchange(const char * exchange_name,
                                           const char * type);
 
-            /** Attempts to declare a queue. Does nothing if it fails. */
-            void attempt_declare_queue(const char * queue_name,
+            /** Declares a queue unless it already exists. Returns true if it
+             *  did. */
+            bool attempt_declare_queue(const char * queue_name,
                                        bool exclusive=false,
                                        bool auto_delete=false);
 
+            /** If heartbeat is above zero it is the number of seconds
+             *  between heartbeats asked of the broker, which makes frame
+             *  waits give up with FRAME_WAIT_TIMED_OUT if nothing at all is
+             *  heard for two of them. Zero turns heartbeats off. */
             static AmqpConnectionPtr create(const char * host_name, const int port,
                                             const char * user_name,
                                             const char * password,
-                                            size_t client_memory);
+                                            size_t client_memory,
+                                            int heartbeat=0);
 
             AmqpChannelPtr new_channel();
 
+            /** Hands out an open channel for publishing, reusing a pooled one
+             *  if possible to avoid the channel open / close round trips. */
+            AmqpChannelPtr acquire_channel();
+
+            /** Returns a channel from acquire_channel to the pool. Only do
+             *  this if it was used successfully; if anything failed, let the
+             *  pointer die instead so the channel is closed. */
+            void release_channel(AmqpChannelPtr channel);
+
+            /** Shuts the socket down, so anything blocked writing to or
+             *  reading from the broker returns with an error, and closing
+             *  no longer waits on the broker. Use it to give up on a broker
+             *  that has stopped answering. */
+            void abandon();
+
             void close();
 
             inline amqp_connection_state_t get_connection() {
                 return connection;
             }
 
+            /** For waiting on the socket with select and friends. */
+            inline int get_socket_fd() const {
+                return sockfd;
+            }
+
+            inline int get_heartbeat() const {
+                return heartbeat;
+            }
+
+            /** Sends a heartbeat if half an interval has passed since the
+             *  last one, and throws FRAME_WAIT_TIMED_OUT if the broker has
+             *  been silent for two. Frame waits do this on their own, but
+             *  while nobody is waiting on the connection it has to be called
+             *  at least every half interval. */
+            void service_heartbeat();
+
+            /** The number of channels opened over this connection's life. */
+            inline unsigned long get_channels_opened() const {
+                return channels_opened;
+            }
+
+            /** The number of times acquire_channel reused a pooled channel. */
+            inline unsigned long get_channels_reused() const {
+                return channels_reused;
+            }
+
         protected:
             AmqpConnection(const char * host_name, const int port,
                            const char * user_name, const char * password,
-                           size_t client_memory);
+                           size_t client_memory, int heartbeat);
 
             ~AmqpConnection();
 
             static void check_references(AmqpConnection * connection);
 
+            /** Answers a channel.close sent by the broker with close-ok,
+             *  which finishes closing the channel on both ends so its number
+             *  can be handed out again. */
+            void confirm_channel_close(int channel_number);
+
+            /** Deals with a frame read while waiting on something else by
+             *  handing it to the channel it belongs to. Deliveries are read
+             *  in full and buffered in their channel; acks and nacks for
+             *  publisher confirms are recorded. */
+            void dispatch_frame(const amqp_frame_t & frame);
+
+            /** Returns the open channel with the given number, or null. */
+            AmqpChannel * find_channel(int channel_number);
+
             /* When certain operations such as declaring an exchange or queue
-             * fail, the channel seems to be bad and attempts to use it again
-             * result in the program hanging. This occurs even if the channel
-             * is closed and re-opened. This is a kludge but for now the
-             * solution is to mark those channels as bad. This means a program
-             * could eventually run out of channels; however, this will only
-             * happen if the exceptions are caught everywhere and execution
-             * proceeds. Right now the
-             * only exceptions worth catching are the ones from the declare
-             * methods- if a program only catches a few throughout its lifetime,
-             * this is workable. */
+             * fail the broker closes the channel, and attempts to use it again
+             * hang. If the broker's close was not answered (see
+             * confirm_channel_close) the channel is marked as bad. Its number
+             * is kept out of circulation until the broker confirms our own
+             * channel.close when the channel is removed. */
             void mark_channel_as_bad(AmqpChannel * channel);
 
-            int new_channel_number() const;
+            /** Called when the broker closes one of our channels on its own,
+             *  which happens for example when publishing to an exchange that
+             *  does not exist. Keeps the channel from being reused. */
+            void on_channel_closed_by_broker(int channel_number);
+
+            /** Returns a free channel number in constant time. Throws if all
+             *  of them are taken. */
+            int new_channel_number();
+
+            /** Puts a number back in the pool used by new_channel_number. */
+            void release_channel_number(int number);
 
             /** Closes and deletes channel. */
             void remove_channel(AmqpChannel * channel);
 
+            /** Reads the next frame, servicing heartbeats while the socket
+             *  is quiet. Heartbeat frames from the broker are swallowed
+             *  unless return_heartbeats is true, which lets a caller that
+             *  only woke because the socket was readable get back to its
+             *  event loop. Throws WAIT_FRAME_FAILED if the read fails and
+             *  FRAME_WAIT_TIMED_OUT if the broker stops answering. */
+            void wait_frame(amqp_frame_t & frame,
+                            bool return_heartbeats=false);
+
         private:
-            std::vector<int> bad_channels;
+            // Set once the socket can't be trusted, so closing doesn't wait
+            // on replies that will never come.
+            bool broker_lost;
+            std::vector<AmqpChannelPtr> channel_pool;
             std::vector<AmqpChannel *> channels;
+            unsigned long channels_opened;
+            unsigned long channels_reused;
+            // The largest frame asked for at login.
+            size_t client_memory;
             amqp_connection_state_t connection;
+            std::vector<int> free_channel_numbers;
+            int heartbeat;
+            // Monotonic times in seconds.
+            double last_heartbeat_sent;
+            double last_received;
             Log log;
+            // All numbers from here on up have never been handed out.
+            int next_channel_number;
             int reference_count;
             int sockfd;
     };
@@ -119,14 +218,46 @@ namespace nova { namespace rpc {
 
     struct AmqpQueueMessage {
         AmqpQueueMessage();
+
+        /** The message body. If the channel has zero copy turned on and the
+         *  body arrived in a single frame this points straight into
+         *  librabbitmq's frame buffer, and is only good until the channel
+         *  is asked for another message. Otherwise it is held in "message".*/
+        inline const char * body() const {
+            return body_bytes != 0 ? body_bytes : message.data();
+        }
+
+        inline size_t body_length() const {
+            return body_bytes != 0 ? body_bytes_length : message.size();
+        }
+
+        const char * body_bytes;
+        size_t body_bytes_length;
+        /** Says which consumer, and so which queue, this came from. */
+        std::string consumer_tag;
+        /** As sent. Bodies which were deflated arrive already inflated;
+         *  if that fails this is left as "deflate" along with the body. */
+        std::string content_encoding;
         std::string content_type;
         int delivery_tag;
         std::string exchange;
+        /** Milliseconds the message lives after timestamp, as sent. */
+        std::string expiration;
         std::string message;
         std::string routing_key;
+        /** Seconds since the epoch when it was sent, or zero if not
+         *  given. */
+        uint64_t timestamp;
+        /** False if the body, once inflated, isn't well formed UTF-8. */
+        bool valid_utf8;
     };
 
-    typedef boost::shared_ptr<AmqpQueueMessage> AmqpQueueMessagePtr;
+    /** A message waiting to be published by AmqpChannel::flush. */
+    struct AmqpOutgoingMessage {
+        std::string body;
+        std::string exchange;
+        std::string routing_key;
+    };
 
     /** Manages a channel to amqp. */
     class AmqpChannel {
@@ -138,27 +269,96 @@ namespace nova { namespace rpc {
 
             void ack_message(int delivery_tag);
 
+            /** With nowait, methods such as this one are sent without
+             *  waiting for a reply. If they fail the broker closes the
+             *  channel, which shows up the next time the channel waits on
+             *  something. */
             void bind_queue_to_exchange(const char * queue_name,
                                             const char * exchange_name,
-                                            const char * routing_key);
+                                            const char * routing_key,
+                                            bool nowait=false);
 
             void close();
 
+            /** Starts a long-lived consumer on the given queue. The broker
+             *  pushes up to prefetch_count unacknowledged messages ahead of
+             *  time (zero means no limit) which get_message then hands out
+             *  from a local buffer. Does nothing if already consuming the
+             *  queue. A channel may consume several queues; get_message
+             *  returns deliveries from all of them, in the order they
+             *  arrive, tagged with the queue name as the consumer tag. */
+            void consume(const char * queue_name,
+                         unsigned short prefetch_count=0);
+
             // Types are 'direct', 'topic'.
             void declare_exchange(const char * exchange_name,
-                                  const char * type, bool passive=false);
+                                  const char * type, bool passive=false,
+                                  bool nowait=false);
+
+            /** An exclusive queue can only be used by this connection, and
+             *  an auto delete queue goes away when the last consumer
+             *  does. */
+            void declare_queue(const char * queue_name, bool passive=false,
+                               bool exclusive=false, bool auto_delete=false,
+                               bool nowait=false);
 
-            void declare_queue(const char * queue_name, bool passive=false);
+            /** Puts the channel in confirm mode. From then on the broker
+             *  acknowledges every published message once it has taken
+             *  responsibility for it; see wait_for_confirms. */
+            void enable_confirms();
+
+            /** Writes every message added with queue_message to the socket
+             *  in one go. */
+            void flush();
 
             inline int get_channel_number() const {
                 return channel_number;
             }
 
+            /** True if deliveries or frames have already been read off the
+             *  socket, in which case get_message won't wait on it. Check
+             *  this before waiting for the socket to become readable. */
+            bool has_buffered_data();
+
+            /** Returns the next delivery from any queue the channel
+             *  consumes, blocking until one arrives. Starts consuming
+             *  queue_name first if it isn't already.
+             *  Any further deliveries already received are buffered so the
+             *  next call can return without waiting on the broker. */
             AmqpQueueMessagePtr get_message(const char * queue_name);
 
+            /** Bodies this long or longer are deflated when published.
+             *  Zero, the default, turns compression off. Only use this if
+             *  every consumer can inflate them. */
+            inline void set_compression_threshold(size_t bytes) {
+                compression_threshold = bytes;
+            }
+
+            /** If turned on, small message bodies returned by get_message
+             *  are not copied out of librabbitmq's buffers. See
+             *  AmqpQueueMessage::body. */
+            inline void set_zero_copy(bool value) {
+                zero_copy = value;
+            }
+
+            /** Publishes the message. If the body is at least as long as
+             *  the compression threshold it's deflated and sent with a
+             *  content encoding of "deflate". */
             void publish(const char * exchange_name, const char * routing_key,
                          const char * messagebody);
 
+            /** Holds on to a message to be published by flush. */
+            void queue_message(const char * exchange_name,
+                               const char * routing_key,
+                               const char * messagebody);
+
+            /** Blocks until the broker confirms every message published
+             *  since enable_confirms was called. Throws
+             *  PUBLISH_NOT_CONFIRMED if the broker rejected any of them, or
+             *  CHANNEL_CLOSED_BY_BROKER if the broker closed the channel
+             *  first (for instance because the exchange didn't exist). */
+            void wait_for_confirms();
+
         protected:
             AmqpChannel(AmqpConnection * parent, const int channel_number);
             AmqpChannel(const AmqpChannel & other);
@@ -167,16 +367,68 @@ namespace nova { namespace rpc {
         private:
             const int channel_number;
 
+            size_t compression_threshold;
+
+            bool confirms_enabled;
+
+            // One per queue consumed, named after the queue.
+            std::set<std::string> consumer_tags;
+
+            bool consuming;
+
+            std::deque<AmqpQueueMessagePtr> deliveries;
+
+            // Set if the broker may not agree the channel is closed, meaning
+            // its number must not be reused.
+            bool is_bad;
+
             void check(const amqp_rpc_reply_t reply,
                        const AmqpException::Code & code);
 
             bool is_open;
 
+            // Sequence number the broker will give the next published
+            // message when confirms are enabled.
+            uint64_t next_publish_tag;
+
+            /** Records a publisher confirm (or rejection) from the broker. */
+            void on_confirm(uint64_t delivery_tag, bool multiple, bool nack);
+
+            std::vector<AmqpOutgoingMessage> outgoing;
+
             AmqpConnection * parent;
 
+            bool publish_nacked;
+
+            /** Reads a single delivery off the connection, blocking until
+             *  it arrives. Returns null if the next frame is not a delivery.
+             *  If allow_zero_copy is true single frame bodies are not
+             *  copied. */
+            AmqpQueueMessagePtr read_message(bool allow_zero_copy);
+
+            /** Reads the rest of a message given the frame with its
+             *  basic.deliver method. */
+            AmqpQueueMessagePtr read_delivery(const amqp_frame_t & method,
+                                              bool allow_zero_copy);
+
             int reference_count;
 
+            /** Sends a method which has no reply, throwing code if that
+             *  fails. */
+            void send_method(amqp_method_number_t method, void * args,
+                             const AmqpException::Code & code);
+
             void _throw(const AmqpException::Code & code);
+
+            // Sequence numbers of published messages not yet confirmed.
+            std::set<uint64_t> unconfirmed;
+
+            /** Waits for the next frame on this channel. Frames for other
+             *  channels which arrive first, such as publisher confirms, are
+             *  handed to the connection to deal with. */
+            void wait_channel_frame(amqp_frame_t & frame);
+
+            bool zero_copy;
     };
 
 } } // end namespace
@@ -7,9 +7,11 @@ namespace nova { namespace rpc {
 
     class AmqpConnection;
     class AmqpChannel;
+    struct AmqpQueueMessage;
 
     typedef boost::intrusive_ptr<AmqpConnection> AmqpConnectionPtr;
     typedef boost::intrusive_ptr<AmqpChannel> AmqpChannelPtr;
+    typedef boost::shared_ptr<AmqpQueueMessage> AmqpQueueMessagePtr;
 
     void intrusive_ptr_add_ref(AmqpConnection * ref);
     void intrusive_ptr_release(AmqpConnection * ref);
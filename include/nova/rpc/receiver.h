@@ -2,83 +2,338 @@
 #define __NOVA_RPC_RECEIVER_H
 
 #include "nova/rpc/amqp_ptr.h"
+#include "nova/rpc/reply_cache.h"
+#include "nova/rpc/topology.h"
 #include <nova/json.h>
+#include "nova/json/sax.h"
 #include "nova/guest/guest.h"
 #include "nova/Log.h"
+#include <map>
 #include <memory>
 #include <boost/optional.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
 #include <string>
+#include <boost/thread.hpp>
+#include <vector>
 
 
 namespace nova { namespace rpc {
 
+    /** Tuning options for a Receiver. */
+    struct ReceiverConfig {
+        ReceiverConfig();
+
+        /** How many unacknowledged messages the broker may push to us ahead
+         *  of time (zero for no limit). */
+        unsigned short prefetch_count;
+
+        /** Replies at least this many bytes long are deflated. Zero turns
+         *  this off; see AmqpChannel::set_compression_threshold. */
+        size_t compression_threshold;
+
+        /** Seconds a caller waits for a reply, counted from the message's
+         *  _context_timestamp. Calls older than this are answered with a
+         *  failure instead of being run. Zero means callers wait forever.
+         *  Messages sent with an AMQP expiration and timestamp use those
+         *  instead. */
+        double time_budget;
+
+        /** Overrides time_budget for particular methods. */
+        std::map<std::string, double> method_time_budgets;
+
+        /** Seconds between AMQP heartbeats on connections opened by a
+         *  ResilentReceiver, or zero for none. A dead broker is noticed
+         *  after two of these go by in silence. */
+        int heartbeat;
+
+        /** The longest a ResilentReceiver waits between reconnect
+         *  attempts, in seconds. The wait starts at reconnect_wait_time
+         *  and doubles with each failed attempt up to this, and each one
+         *  is picked at random from zero to that ceiling so receivers
+         *  that lost the same broker don't all come back at once. */
+        unsigned long max_reconnect_wait_time;
+
+        /** If set, messages are also taken from the fanout exchange of
+         *  this name, through a private queue that goes away with the
+         *  connection. Lets one publish reach every receiver. */
+        std::string fanout_exchange;
+
+        /** If set, messages are also taken from this queue and marked
+         *  high priority, so the dispatcher runs them ahead of the rest.
+         *  It has a prefetch window of its own, so a backlog on the main
+         *  queue can't keep its messages from being delivered. */
+        std::string priority_topic;
+
+        /** If true, replies are not considered sent until the broker
+         *  confirms it has them. */
+        bool publisher_confirms;
+
+        /** If set, a ResilentReceiver saves the replies it remembers to
+         *  this file and reads them back when it starts. */
+        std::string reply_cache_path;
+
+        /** How many replies a ResilentReceiver remembers, so messages the
+         *  broker hands out again aren't run twice. Zero for none. */
+        size_t reply_cache_size;
+
+        /** If set, messages are also taken from this queue, which every
+         *  receiver of the same kind shares. */
+        std::string shared_topic;
+    };
+
     class Receiver {
 
     public:
+        /** If a topology is given and isn't empty it's replayed to set up
+         *  the broker, falling back to declaring everything one at a time
+         *  if that fails. Otherwise whatever gets declared is recorded in
+         *  it for next time. */
         Receiver(AmqpConnectionPtr connection, const char * topic,
-                 const char * exchange_name);
+                 const char * exchange_name,
+                 const ReceiverConfig & config = ReceiverConfig(),
+                 AmqpTopology * topology = 0);
 
         ~Receiver();
 
-        /** Finishes a message. */
-        void finish_message(const nova::guest::GuestOutput & output);
+        /** See AmqpConnection::abandon. The receiver can only be deleted
+         *  afterwards. */
+        void abandon();
+
+        /** Acknowledges the given message and sends the output as its
+         *  reply. Messages may be finished in any order. */
+        void finish_message(const nova::guest::GuestInput & input,
+                            const nova::guest::GuestOutput & output);
+
+        /** Like the above, with a reply made by serialize_reply. */
+        void finish_message(const nova::guest::GuestInput & input,
+                            const std::string & reply);
+
+        /** The socket to wait on before calling read_message. */
+        int get_socket_fd() const;
+
+        /** True if read_message can be called without waiting on the
+         *  socket, because something was already read off of it. */
+        bool has_buffered_messages();
 
         /** Grabs the next message. */
         nova::guest::GuestInput next_message();
 
+        /** Reads what the broker sent and returns a message if that
+         *  completes one. Only blocks if there's nothing to read, so
+         *  call it when the socket is readable or has_buffered_messages
+         *  is true. Malformed messages are answered with a failure and
+         *  acknowledged rather than returned. */
+        boost::optional<nova::guest::GuestInput> read_message();
+
+        /** The reply sent to Nova for the given output. */
+        static std::string serialize_reply(
+            const nova::guest::GuestOutput & output);
+
+        /** See AmqpConnection::service_heartbeat. */
+        void service_heartbeat();
+
     private:
+        ReceiverConfig config;
         AmqpConnectionPtr connection;
-        int last_delivery_tag;
-        boost::optional<std::string> last_msg_id;
+        // Named anew for each connection.
+        std::string fanout_queue;
         Log log;
+
+        // Kept to reuse its buffer from one message to the next.
+        nova::json::SaxParser parser;
+
         AmqpChannelPtr queue;
         const std::string topic;
 
-        nova::JsonObjectPtr _next_message();
+        void declare_fanout(const char * exchange_name);
+
+        void declare_queue(const char * queue_name,
+                           const char * exchange_name,
+                           AmqpTopology & topology);
+
+        std::string fanout_queue_name(const char * exchange_name) const;
+
+        /* When the caller gives up, going by the context timestamp and the
+         * time budget of the method. */
+        boost::optional<double> context_deadline(
+            const boost::optional<std::string> & timestamp,
+            const std::string & method_name);
+
+        /* Fills in what the input needs from the message properties. */
+        AmqpQueueMessagePtr _next_message(bool wait,
+                                          nova::guest::GuestInput & input);
+
+        boost::optional<nova::guest::GuestInput> _parse_message(bool wait);
+
+        /* Fills in the rest of the input from the body, returning false
+         * if the message is malformed. */
+        bool _read_envelope(const AmqpQueueMessage & msg,
+                            nova::guest::GuestInput & input);
+
+        /* Acknowledges a malformed message, answering with a failure if
+         * it had a _msg_id. */
+        void _refuse_message(const nova::guest::GuestInput & input);
 
     };
 
     /** Like the standard receiver, but kills and waits to restablish
-     *  the connection anytime there's a problem. */
+     *  the connection anytime there's a problem. The old connection is
+     *  abandoned and the replacement opened on another thread, so a
+     *  caller driven by get_socket_fd is never held up by the backoff.
+     *
+     *  Messages lost with a connection are handed out again by the
+     *  broker. Those which were already answered get the same reply
+     *  again from a cache, and those still being worked on are answered
+     *  once the first copy finishes, so neither is run twice. Replies
+     *  holding credentials are never cached, so those messages are run
+     *  again. */
     class ResilentReceiver {
 
     public:
         ResilentReceiver(const char * host, int port, const char * userid,
             const char * password, size_t client_memory, const char * topic,
-            const char * exchange_name, unsigned long reconnect_wait_time);
+            const char * exchange_name, unsigned long reconnect_wait_time,
+            const ReceiverConfig & config = ReceiverConfig());
 
         ~ResilentReceiver();
 
-        /** Finishes a message. */
-        void finish_message(const nova::guest::GuestOutput & output);
+        /** Finishes a message, and any copies of it which arrived while it
+         *  ran. Only the reply is sent if the connection the message came
+         *  in on has since been replaced. Every message handed out must
+         *  be finished, if only with a failure, or its copies are held
+         *  on to for good. */
+        void finish_message(const nova::guest::GuestInput & input,
+                            const nova::guest::GuestOutput & output);
+
+        /** Bumped each time the connection is replaced. */
+        inline unsigned long get_connection_generation() const {
+            return connection_generation;
+        }
+
+        /** Time taken by the last reset, from losing the connection to
+         *  having a new one ready. */
+        inline double get_last_reconnect_seconds() const {
+            return last_reconnect_seconds;
+        }
+
+        /** Connection attempts that failed, over the receiver's life. */
+        inline unsigned long get_reconnect_failures() const {
+            return reconnect_failures;
+        }
+
+        /** Number of times the connection has been replaced. */
+        inline unsigned long get_reconnects() const {
+            return reconnects;
+        }
+
+        /** Changes whenever the connection is replaced. While a new one
+         *  is being opened this is a pipe which becomes readable once it's
+         *  ready, and read_message then puts it in place. */
+        int get_socket_fd() const;
+
+        bool has_buffered_messages();
 
         /** Grabs the next message. */
         nova::guest::GuestInput next_message();
 
+        /** See Receiver::read_message. If the connection fails it's
+         *  replaced and none is returned, as it is for messages answered
+         *  without being run. */
+        boost::optional<nova::guest::GuestInput> read_message();
+
+        /** Abandons the connection and starts opening a new one in the
+         *  background, returning straight away. */
         void reset();
 
+        /** Keeps heartbeats going while idle, replacing the connection if
+         *  the broker has gone quiet. Call at least every half heartbeat
+         *  interval. */
+        void service_heartbeat();
+
     private:
 
         size_t client_memory;
 
         void close();
 
+        ReceiverConfig config;
+
+        /* Keeps trying to connect until it works, backing off between
+         * attempts. Used on a thread of its own, so it only touches the
+         * topology and the fields below that reset leaves alone while it
+         * runs. */
+        void connect(bool wait_first, Receiver * & result);
+
+        /* Runs connect on the reconnector thread, catching anything it
+         * throws so it can't take down the process, then writes to the
+         * reconnect pipe. */
+        void connect_in_background();
+
+        // Bumped each time a new connection is opened.
+        unsigned long connection_generation;
+
         std::string exchange_name;
 
         std::string host;
 
+        /* Copies of each message being worked on, by _msg_id, which get
+         * the original's reply once it's done. */
+        std::map<std::string, std::vector<nova::guest::GuestInput> >
+            in_flight;
+
+        double last_reconnect_seconds;
+
         Log log;
 
-        void open(bool wait_first);
+        /* Puts the connection opened in the background in place, waiting
+         * for it if wait is true. Returns false if it isn't ready, or if
+         * it failed and another attempt was started. */
+        bool finish_reconnect(bool wait);
+
+        /* How long to wait before the given retry, counting from zero. */
+        double next_wait_time(unsigned int attempt);
 
         std::string password;
 
         int port;
 
+        // For rand_r, so the jitter doesn't disturb anyone else's rand.
+        unsigned int random_seed;
+
+        // Null while a new connection is being opened.
         std::auto_ptr<Receiver> receiver;
 
+        // Set by the reconnector thread, if it succeeds.
+        Receiver * reconnected;
+
+        // Opens a new connection after a reset.
+        boost::thread reconnector;
+
+        unsigned long reconnect_failures;
+
+        // Written to by the reconnector thread when it's done.
+        int reconnect_pipe[2];
+
+        unsigned long reconnects;
+
+        ReplyCache reply_cache;
+
+        boost::posix_time::ptime reset_started;
+
+        /* Sends the reply to the input unless its connection is gone. */
+        void send_reply(const nova::guest::GuestInput & input,
+                        const std::string & reply);
+
+        /* Answers the input from the cache or holds on to it if it's a copy
+         * of a message being worked on, returning true if so. Otherwise
+         * records it as being worked on. */
+        bool take_care_of_copy(const nova::guest::GuestInput & input);
+
         std::string topic;
 
+        /* What was set up on the broker, so reconnecting is quicker. */
+        AmqpTopology topology;
+
         std::string userid;
 
         unsigned long reconnect_wait_time;
@@ -0,0 +1,62 @@
+#ifndef __NOVA_RPC_REPLY_CACHE_H
+#define __NOVA_RPC_REPLY_CACHE_H
+
+#include <boost/optional.hpp>
+#include <deque>
+#include <map>
+#include "nova/Log.h"
+#include <string>
+
+namespace nova { namespace rpc {
+
+    /** Remembers the replies sent for the most recent messages, by
+     *  _msg_id, so a message the broker hands out again after a lost
+     *  connection can be answered without running it a second time.
+     *
+     *  If given a file the cache is written there as it changes and read
+     *  back on creation, so it also survives the guest restarting. Only
+     *  the agent's user may read the file, but replies holding
+     *  credentials still shouldn't be put here. */
+    class ReplyCache {
+
+        public:
+            /** Holds up to capacity replies, forgetting the oldest first.
+             *  An empty file_path keeps everything in memory. */
+            ReplyCache(size_t capacity, const std::string & file_path = "");
+
+            boost::optional<std::string> get(const std::string & msg_id) const;
+
+            void put(const std::string & msg_id, const std::string & reply);
+
+            inline size_t size() const {
+                return replies.size();
+            }
+
+        private:
+            void append_to_file(const std::string & msg_id,
+                                const std::string & reply);
+
+            size_t capacity;
+
+            std::string file_path;
+
+            // Lines in the file, counting ones for entries since forgotten.
+            size_t file_lines;
+
+            void load();
+
+            Log log;
+
+            // Oldest first.
+            std::deque<std::string> order;
+
+            std::map<std::string, std::string> replies;
+
+            /* Writes out only what's still remembered, so the file doesn't
+             * grow forever. */
+            void rewrite_file();
+    };
+
+} }  // end namespace
+
+#endif
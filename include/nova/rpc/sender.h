@@ -4,25 +4,114 @@
 #include "nova/rpc/amqp_ptr.h"
 #include <json/json.h>
 #include "nova/Log.h"
+#include <memory>
+#include "nova/utils/ring_buffer.h"
+#include <string>
+#include <boost/thread.hpp>
 
 namespace nova { namespace rpc {
 
+    /** Tuning options for a Sender. */
+    struct SenderConfig {
+        enum OverflowPolicy {
+            /* send waits for the background thread to make room. */
+            BLOCK,
+            /* The oldest message waiting is thrown away to make room. */
+            DROP_OLDEST
+        };
+
+        SenderConfig();
+
+        /** If true, send only queues the message and returns, and a
+         *  background thread publishes it. The connection then belongs
+         *  to that thread and mustn't be used by anything else. */
+        bool async;
+
+        /** Most messages the background thread publishes in one write. */
+        size_t batch_size;
+
+        /** Seconds the destructor waits for queued messages to be
+         *  published before giving up on them and on the connection. */
+        double drain_timeout;
+
+        /** What send does when queue_capacity messages are waiting. */
+        OverflowPolicy overflow_policy;
+
+        /** How many messages may wait to be published. Rounded up to a
+         *  power of two. */
+        size_t queue_capacity;
+    };
+
     class Sender {
         public:
-            Sender(AmqpConnectionPtr connection, const char * topic);
+            Sender(AmqpConnectionPtr connection, const char * topic,
+                   const SenderConfig & config = SenderConfig());
 
+            /** In async mode, waits up to drain_timeout for everything
+             *  queued to be published. */
             ~Sender();
 
+            /** Messages thrown away to make room, or which failed to
+             *  publish in the background. */
+            unsigned long get_dropped_count() const;
+
+            /** Messages accepted by send in async mode. */
+            unsigned long get_queued_count() const;
+
+            /** True once the background thread has given up publishing,
+             *  which happens if a channel can't be opened after a failure.
+             *  Everything sent from then on is dropped. */
+            bool has_failed() const;
+
+            /** Messages published in the background. */
+            unsigned long get_sent_count() const;
+
             void send(const JsonObject & object);
 
+            /** Publishes the message, or in async mode queues it to be.
+             *  Only the synchronous mode throws if publishing fails. */
             void send(const char * publish_string);
 
         private:
+            /* Publishes queued messages until stopping is set and the
+             * queue is empty. */
+            void background_loop();
+
+            /* Replaces the channel after a failed publish, or marks the
+             * sender failed if that can't be done. */
+            void reopen_channel();
+
+            SenderConfig config;
+            AmqpConnectionPtr connection;
+            volatile unsigned long dropped_count;
             AmqpChannelPtr exchange;
             std::string exchange_name;
+            volatile bool failed;
             Log log;
+
+            // Held only to sleep on or wake up the conditions below.
+            boost::mutex mutex;
+
+            std::auto_ptr<nova::utils::RingBuffer<std::string> > queue;
             const std::string queue_name;
+            volatile unsigned long queued_count;
             const std::string routing_key;
+            volatile unsigned long sent_count;
+
+            // Signalled when the background thread frees up room.
+            boost::condition_variable space_available;
+
+            // True while the background thread is about to sleep or is.
+            volatile bool sleeping;
+
+            volatile bool stopping;
+            std::auto_ptr<boost::thread> thread;
+
+            // Number of send calls waiting on space_available.
+            volatile int waiting_senders;
+
+            // Signalled when a message is queued for a sleeping thread.
+            boost::condition_variable work_available;
     };
 
 } }  // end namespace
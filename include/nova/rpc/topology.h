@@ -0,0 +1,73 @@
+#ifndef __NOVA_RPC_TOPOLOGY_H
+#define __NOVA_RPC_TOPOLOGY_H
+
+#include "nova/rpc/amqp_ptr.h"
+#include <string>
+#include <vector>
+
+namespace nova { namespace rpc {
+
+    /** Remembers the exchanges, queues and bindings successfully set up on
+     *  a broker, so after reconnecting to the same broker they can be put
+     *  back in one go instead of being worked out again. */
+    class AmqpTopology {
+
+        public:
+            AmqpTopology();
+
+            void add_binding(const char * queue_name,
+                             const char * exchange_name,
+                             const char * routing_key);
+
+            /** If passive is true the exchange was found already existing,
+             *  so it's only checked for on replay rather than declared. */
+            void add_exchange(const char * exchange_name, const char * type,
+                              bool passive);
+
+            /** See add_exchange for what passive means. */
+            void add_queue(const char * queue_name, bool passive,
+                           bool exclusive, bool auto_delete);
+
+            void clear();
+
+            inline bool empty() const {
+                return exchanges.empty() && queues.empty()
+                       && bindings.empty();
+            }
+
+            /** Declares everything again using a single channel, without
+             *  waiting for a reply to each declaration. It ends with a
+             *  passive declare which does wait on the broker, so if any of
+             *  it failed an AmqpException is thrown. */
+            void replay(AmqpConnectionPtr connection) const;
+
+        private:
+            struct Binding {
+                std::string exchange_name;
+                std::string queue_name;
+                std::string routing_key;
+            };
+
+            struct Exchange {
+                std::string name;
+                bool passive;
+                std::string type;
+            };
+
+            struct Queue {
+                bool auto_delete;
+                bool exclusive;
+                std::string name;
+                bool passive;
+            };
+
+            std::vector<Binding> bindings;
+
+            std::vector<Exchange> exchanges;
+
+            std::vector<Queue> queues;
+    };
+
+} }  // end namespace
+
+#endif
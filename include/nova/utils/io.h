@@ -4,13 +4,14 @@
 #include <boost/optional.hpp>
 #include "nova/Log.h"
 #include <sys/select.h>
-#include <signal.h>
 #include <time.h>
 
 namespace nova { namespace utils { namespace io {
 
 /**
- * Create this to cause select_with_throw to throw TimeOutExceptions.
+ * Create this to cause select_with_throw to throw TimeOutExceptions once the
+ * given number of seconds have passed. Only affects the thread that created
+ * it. If one is already in effect the earlier of the two deadlines wins.
  */
 class Timer {
     public:
@@ -18,18 +19,13 @@ class Timer {
 
         ~Timer();
 
-        static void interrupt(int signal_number, siginfo_t * info,
-                              void * context);
-
-        static void remove_interrupt_handler();
-
-        static void set_interrupt_handler();
-
-        static bool & time_out_occurred();
+        /** Seconds left until the current thread's deadline, or none if
+         *  there's no Timer in effect. */
+        static boost::optional<double> remaining();
 
     private:
-        timer_t id;
-        Log log;
+        bool had_deadline;
+        timespec previous_deadline;
 };
 
 
@@ -39,8 +35,8 @@ bool is_file(const char * file_path);
 size_t read_with_throw(Log & log, int fd, char * const buf, size_t count);
 
 /** Throws exceptions if errors are detected.
- * Also unblocks time out signals before proceeding and throws
- * ProcessTimeOutExceptions if they happen. */
+ * Never waits past the deadline of the current thread's Timer, and throws
+ * TimeOutException if that deadline passes. */
 int select_with_throw(int nfds, fd_set * readfds, fd_set * writefds,
                       fd_set * errorfds, boost::optional<double> seconds);
 
@@ -50,6 +46,7 @@ class IOException : public std::exception {
     public:
         enum Code {
             ACCESS_DENIED,
+            EVENT_LOOP_ERROR,
             GENERAL,
             READ_ERROR,
             SIGNAL_HANDLER_DESTROY_ERROR,
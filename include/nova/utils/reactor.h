@@ -0,0 +1,95 @@
+#ifndef _NOVA_UTILS_REACTOR_H
+#define _NOVA_UTILS_REACTOR_H
+
+#include <boost/function.hpp>
+#include "nova/Log.h"
+#include <map>
+#include <boost/noncopyable.hpp>
+#include <boost/optional.hpp>
+#include <signal.h>
+
+namespace nova { namespace utils {
+
+/**
+ * Waits on file descriptors, timers and signals all at once and calls a
+ * callback for each one that's ready. Callbacks run on the thread that calls
+ * run, so they should do their work quickly and return.
+ * Everything is built on epoll, timerfd and signalfd, so nothing wakes the
+ * thread up unless there's something to do.
+ */
+class Reactor : boost::noncopyable {
+
+    public:
+        typedef boost::function<void()> Callback;
+
+        Reactor();
+
+        /** Closes the timers and the signal file descriptor. Signals given
+         *  to add_signal_handler stay blocked. */
+        ~Reactor();
+
+        /** Calls the callback whenever fd can be read from. Replaces any
+         *  callback already registered for fd. */
+        void add_reader(int fd, Callback callback);
+
+        /** Calls the callback when the given signal arrives instead of
+         *  handling it normally.
+         *  The signal is blocked for the calling thread, so this must be
+         *  called before starting any other threads or they'll still get
+         *  it. */
+        void add_signal_handler(int signal_number, Callback callback);
+
+        /** Calls the callback once every interval seconds, the first time
+         *  being first_delay seconds from now. Returns an id for
+         *  remove_timer. */
+        int add_timer(double first_delay, double interval, Callback callback);
+
+        /** Stops watching fd. Safe to call even if fd was already
+         *  closed. */
+        void remove_reader(int fd);
+
+        void remove_timer(int id);
+
+        /** Handles events until stop is called. */
+        void run();
+
+        /** Waits up to the given number of seconds (or forever if not set)
+         *  for something to happen and handles it. Returns the number of
+         *  callbacks called. */
+        int run_once(boost::optional<double> seconds=boost::none);
+
+        /** Makes run return once the current callback finishes. */
+        void stop();
+
+    private:
+        enum Kind { READER, SIGNAL, TIMER };
+
+        struct Entry {
+            Callback callback;
+            Kind kind;
+        };
+
+        int epoll_fd;
+
+        std::map<int, Entry> entries;
+
+        void handle_signals();
+
+        Log log;
+
+        void register_fd(int fd, Kind kind, Callback callback);
+
+        int signal_fd;
+
+        std::map<int, Callback> signal_handlers;
+
+        sigset_t signals;
+
+        bool stopped;
+
+        bool unregister_fd(int fd);
+};
+
+} }  // end nova::utils
+
+#endif
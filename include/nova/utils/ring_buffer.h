@@ -0,0 +1,139 @@
+#ifndef __NOVA_UTILS_RING_BUFFER_H
+#define __NOVA_UTILS_RING_BUFFER_H
+
+#include <boost/noncopyable.hpp>
+#include <stddef.h>
+#include <vector>
+
+namespace nova { namespace utils {
+
+/**
+ * A fixed size queue any number of threads can push to and pop from
+ * without taking a lock. Neither call ever waits; they return false if
+ * the buffer is full or empty, leaving what to do about that to the
+ * caller.
+ *
+ * Each slot carries a sequence number saying whose turn it is, so a
+ * thread only has to win a compare and swap on the head or tail to own a
+ * slot (see Dmitry Vyukov's bounded MPMC queue).
+ */
+template<typename T>
+class RingBuffer : boost::noncopyable {
+
+    public:
+        /** The capacity is rounded up to a power of two. */
+        explicit RingBuffer(size_t capacity)
+        :   cells(round_up(capacity)),
+            head(0),
+            mask(round_up(capacity) - 1),
+            tail(0)
+        {
+            for (size_t i = 0; i < cells.size(); i ++) {
+                cells[i].sequence = i;
+            }
+        }
+
+        inline size_t capacity() const {
+            return cells.size();
+        }
+
+        /** True if nothing had been pushed that wasn't already popped. A
+         *  push racing with this may or may not be seen. */
+        bool empty() {
+            const size_t popped = load(head);
+            return load(tail) == popped;
+        }
+
+        /** Takes the oldest value, returning false if there isn't one. */
+        bool try_pop(T & value) {
+            size_t position = load(head);
+            while(true) {
+                Cell & cell = cells[position & mask];
+                const size_t sequence = load(cell.sequence);
+                const long difference = (long) sequence
+                                        - (long) (position + 1);
+                if (difference == 0) {
+                    if (__sync_bool_compare_and_swap(&head, position,
+                                                     position + 1)) {
+                        value = cell.value;
+                        cell.value = T();
+                        store(cell.sequence, position + mask + 1);
+                        return true;
+                    }
+                    position = load(head);
+                } else if (difference < 0) {
+                    return false;
+                } else {
+                    position = load(head);
+                }
+            }
+        }
+
+        /** Adds a value, returning false if the buffer is full. */
+        bool try_push(const T & value) {
+            size_t position = load(tail);
+            while(true) {
+                Cell & cell = cells[position & mask];
+                const size_t sequence = load(cell.sequence);
+                const long difference = (long) sequence - (long) position;
+                if (difference == 0) {
+                    if (__sync_bool_compare_and_swap(&tail, position,
+                                                     position + 1)) {
+                        cell.value = value;
+                        store(cell.sequence, position + 1);
+                        return true;
+                    }
+                    position = load(tail);
+                } else if (difference < 0) {
+                    return false;
+                } else {
+                    position = load(tail);
+                }
+            }
+        }
+
+    private:
+        struct Cell {
+            volatile size_t sequence;
+            T value;
+        };
+
+        std::vector<Cell> cells;
+
+        // Padding keeps the ends of the queue off of each other's cache
+        // lines, so pushing and popping threads don't keep stealing them.
+        char pad_0[64];
+
+        volatile size_t head;
+
+        char pad_1[64];
+
+        const size_t mask;
+
+        volatile size_t tail;
+
+        char pad_2[64];
+
+        static inline size_t load(volatile size_t & variable) {
+            const size_t value = variable;
+            __sync_synchronize();
+            return value;
+        }
+
+        static size_t round_up(size_t capacity) {
+            size_t result = 2;
+            while (result < capacity) {
+                result *= 2;
+            }
+            return result;
+        }
+
+        static inline void store(volatile size_t & variable, size_t value) {
+            __sync_synchronize();
+            variable = value;
+        }
+};
+
+} }  // end namespace
+
+#endif
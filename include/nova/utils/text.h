@@ -0,0 +1,42 @@
+#ifndef __NOVA_UTILS_TEXT_H
+#define __NOVA_UTILS_TEXT_H
+
+#include <stddef.h>
+#include <vector>
+
+namespace nova { namespace utils {
+
+    /* One way of scanning text. Each CPU gets the fastest it can run,
+     * picked the first time it's needed, but every one gives the same
+     * answers. */
+    struct TextScanner {
+        const char * name;
+
+        /** Index of the first byte JSON needs escaped, which are quotes,
+         *  backslashes and control characters, or length if there are
+         *  none. */
+        size_t (*find_json_escape)(const char * text, size_t length);
+
+        /** True if text is well formed UTF-8, with no overlong forms,
+         *  surrogates or code points past U+10FFFF. */
+        bool (*is_valid_utf8)(const char * text, size_t length);
+    };
+
+    /** The scanners this CPU can run, slowest first. The first is plain
+     *  C++ and always there; SSE2 and AVX2 follow if supported. */
+    const std::vector<TextScanner> & available_text_scanners();
+
+    /** The fastest available scanner. */
+    const TextScanner & text_scanner();
+
+    inline size_t find_json_escape(const char * text, size_t length) {
+        return text_scanner().find_json_escape(text, length);
+    }
+
+    inline bool is_valid_utf8(const char * text, size_t length) {
+        return text_scanner().is_valid_utf8(text, length);
+    }
+
+} }  // end namespace
+
+#endif
@@ -1,14 +1,801 @@
 #include "nova/Log.h"
+#include <boost/thread.hpp>
+#include <errno.h>
+#include <memory>
 #ifdef _DEBUG
     #include <iostream>
 #endif
+#include "nova/utils/ring_buffer.h"
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
 #include <syslog.h>
+#include <time.h>
+#include <vector>
 
 
 using nova::Log;
+using nova::LogConfig;
+using nova::utils::RingBuffer;
+using std::string;
+using std::vector;
+
+namespace {
+
+    // Longest message written; anything past it is cut off.
+    const int BUFF_SIZE = 1024;
+
+    // Arguments taking more room than this spill onto the heap.
+    const size_t RECORD_DATA_SIZE = 192;
+
+    /* A message waiting to be written. If format is set, data holds its
+     * arguments one after another in the order the format uses them,
+     * with strings copied in after their length. Otherwise data holds the
+     * finished text.
+     *
+     * Records are copied in and out of the queues as plain bytes, which is
+     * a good deal cheaper than copying a string member, so whoever ends up
+     * with one has to call free_overflow. */
+    struct Record {
+        char data[RECORD_DATA_SIZE];
+        const char * format;
+        char * overflow;
+        size_t overflow_capacity;
+        int priority;
+        size_t size;
+        struct timeval time;
+
+        Record()
+        : format(0), overflow(0), overflow_capacity(0), priority(0), size(0)
+        {
+        }
+
+        /* The arguments or text, wherever they ended up. */
+        const char * bytes() const {
+            return overflow == 0 ? data : overflow;
+        }
+
+        void append(const void * bytes, size_t length) {
+            if (overflow == 0 && size + length <= RECORD_DATA_SIZE) {
+                memcpy(data + size, bytes, length);
+            } else {
+                if (size + length > overflow_capacity) {
+                    const size_t needed = size + length;
+                    const size_t capacity = needed > 2 * overflow_capacity
+                                            ? needed : 2 * overflow_capacity;
+                    char * grown = (char *) realloc(overflow, capacity);
+                    if (grown == 0) {
+                        // Leave it cut short.
+                        return;
+                    }
+                    if (overflow == 0) {
+                        memcpy(grown, data, size);
+                    }
+                    overflow = grown;
+                    overflow_capacity = capacity;
+                }
+                memcpy(overflow + size, bytes, length);
+            }
+            size += length;
+        }
+
+        void free_overflow() {
+            free(overflow);
+            overflow = 0;
+            overflow_capacity = 0;
+        }
+
+        template<typename T>
+        void put(const T & value) {
+            append(&value, sizeof(value));
+        }
+    };
+
+    /* Hands out what Record::put stored, in the same order. */
+    class RecordReader {
+        public:
+            RecordReader(const Record & record)
+            : next(record.bytes())
+            {
+            }
+
+            const char * bytes(size_t length) {
+                const char * start = next;
+                next += length;
+                return start;
+            }
+
+            template<typename T>
+            T get() {
+                T value;
+                memcpy(&value, bytes(sizeof(T)), sizeof(T));
+                return value;
+            }
+
+        private:
+            const char * next;
+    };
+
+    /* What a conversion takes from the arguments. */
+    enum Kind {
+        CHARACTER,
+        ERROR_TEXT,     // %m, which takes nothing but errno
+        FLOATING,
+        PERCENT,
+        POINTER,
+        SIGNED,
+        STRING,
+        UNKNOWN,
+        UNSIGNED
+    };
+
+    /* Length modifiers, such as the "l" in "%lu". */
+    enum Length {
+        CHAR_LENGTH,
+        DEFAULT_LENGTH,
+        INTMAX_LENGTH,
+        LONG_DOUBLE_LENGTH,
+        LONG_LENGTH,
+        LONG_LONG_LENGTH,
+        PTRDIFF_LENGTH,
+        SHORT_LENGTH,
+        SIZE_LENGTH
+    };
+
+    /* One conversion in a format, such as "%-8.*lu". */
+    struct Conversion {
+        // The '%' and the character after the conversion.
+        const char * start;
+        const char * end;
+
+        Kind kind;
+        Length length;
+
+        // Where the length modifier, if any, begins.
+        const char * length_start;
+
+        // Set if given as digits rather than '*'.
+        int precision;
+
+        bool precision_star;
+        char type;
+        bool width_star;
+    };
+
+    inline bool is_digit(char c) {
+        return c >= '0' && c <= '9';
+    }
+
+    inline bool is_flag(char c) {
+        return c == '-' || c == '+' || c == ' ' || c == '#' || c == '0'
+               || c == '\'';
+    }
+
+    Kind kind_of(char type) {
+        switch(type) {
+            case 'd': case 'i':
+                return SIGNED;
+            case 'o': case 'u': case 'x': case 'X':
+                return UNSIGNED;
+            case 'a': case 'A': case 'e': case 'E': case 'f': case 'F':
+            case 'g': case 'G':
+                return FLOATING;
+            case 'c':
+                return CHARACTER;
+            case 'm':
+                return ERROR_TEXT;
+            case 'p':
+                return POINTER;
+            case 's':
+                return STRING;
+            case '%':
+                return PERCENT;
+            default:
+                return UNKNOWN;
+        }
+    }
+
+    /* Reads the length modifier at p, returning the character after. */
+    const char * read_length(const char * p, Length & length) {
+        switch(*p) {
+            case 'h':
+                if (p[1] == 'h') {
+                    length = CHAR_LENGTH;
+                    return p + 2;
+                }
+                length = SHORT_LENGTH;
+                return p + 1;
+            case 'l':
+                if (p[1] == 'l') {
+                    length = LONG_LONG_LENGTH;
+                    return p + 2;
+                }
+                length = LONG_LENGTH;
+                return p + 1;
+            case 'q': length = LONG_LONG_LENGTH; return p + 1;
+            case 'L': length = LONG_DOUBLE_LENGTH; return p + 1;
+            case 'j': length = INTMAX_LENGTH; return p + 1;
+            case 'z': length = SIZE_LENGTH; return p + 1;
+            case 't': length = PTRDIFF_LENGTH; return p + 1;
+            default: length = DEFAULT_LENGTH; return p;
+        }
+    }
+
+    /* Finds the first conversion in text, returning false if there are
+     * none. "%%" counts, as a conversion of kind PERCENT. */
+    bool next_conversion(const char * text, Conversion & c) {
+        const char * p = strchr(text, '%');
+        if (p == 0) {
+            return false;
+        }
+        c.start = p ++;
+        while (is_flag(*p)) {
+            p ++;
+        }
+        c.width_star = *p == '*';
+        if (c.width_star) {
+            p ++;
+        }
+        while (is_digit(*p)) {
+            p ++;
+        }
+        c.precision = -1;
+        c.precision_star = false;
+        if (*p == '.') {
+            p ++;
+            if (*p == '*') {
+                c.precision_star = true;
+                p ++;
+            } else {
+                c.precision = 0;
+                while (is_digit(*p)) {
+                    c.precision = c.precision * 10 + (*p - '0');
+                    p ++;
+                }
+            }
+        }
+        c.length_start = p;
+        p = read_length(p, c.length);
+        c.type = *p;
+        c.kind = kind_of(c.type);
+        if (*p != '\0') {
+            p ++;
+        }
+        c.end = p;
+        return true;
+    }
+
+    long long signed_arg(va_list & args, Length length) {
+        switch(length) {
+            case CHAR_LENGTH: return (signed char) va_arg(args, int);
+            case SHORT_LENGTH: return (short) va_arg(args, int);
+            case LONG_LENGTH: return va_arg(args, long);
+            case LONG_LONG_LENGTH: return va_arg(args, long long);
+            case INTMAX_LENGTH: return va_arg(args, intmax_t);
+            case SIZE_LENGTH: return va_arg(args, ssize_t);
+            case PTRDIFF_LENGTH: return va_arg(args, ptrdiff_t);
+            default: return va_arg(args, int);
+        }
+    }
+
+    unsigned long long unsigned_arg(va_list & args, Length length) {
+        switch(length) {
+            case CHAR_LENGTH:
+                return (unsigned char) va_arg(args, unsigned int);
+            case SHORT_LENGTH:
+                return (unsigned short) va_arg(args, unsigned int);
+            case LONG_LENGTH: return va_arg(args, unsigned long);
+            case LONG_LONG_LENGTH: return va_arg(args, unsigned long long);
+            case INTMAX_LENGTH: return va_arg(args, uintmax_t);
+            case SIZE_LENGTH: return va_arg(args, size_t);
+            case PTRDIFF_LENGTH: return va_arg(args, ptrdiff_t);
+            default: return va_arg(args, unsigned int);
+        }
+    }
+
+    void put_string(Record & record, const char * text, int precision) {
+        if (text == 0) {
+            text = "(null)";
+        }
+        // Past BUFF_SIZE it would only be cut off anyway.
+        const size_t most = precision >= 0 && precision < BUFF_SIZE
+                            ? (size_t) precision : (size_t) BUFF_SIZE;
+        const size_t length = strnlen(text, most);
+        record.put(length);
+        record.append(text, length);
+    }
+
+    /* Copies the arguments the format uses into the record. Stops at a
+     * conversion it doesn't know, since it can't tell what to take. */
+    void put_arguments(Record & record, const char * format, va_list & args,
+                       int saved_errno) {
+        Conversion c;
+        const char * text = format;
+        while (next_conversion(text, c)) {
+            text = c.end;
+            if (c.kind == PERCENT) {
+                continue;
+            }
+            if (c.kind == UNKNOWN) {
+                return;
+            }
+            if (c.width_star) {
+                record.put(va_arg(args, int));
+            }
+            int precision = c.precision;
+            if (c.precision_star) {
+                precision = va_arg(args, int);
+                record.put(precision);
+            }
+            switch(c.kind) {
+                case CHARACTER:
+                    record.put(va_arg(args, int));
+                    break;
+                case ERROR_TEXT:
+                    put_string(record, strerror(saved_errno), precision);
+                    break;
+                case FLOATING:
+                    if (c.length == LONG_DOUBLE_LENGTH) {
+                        record.put(va_arg(args, long double));
+                    } else {
+                        record.put(va_arg(args, double));
+                    }
+                    break;
+                case POINTER:
+                    record.put(va_arg(args, void *));
+                    break;
+                case SIGNED:
+                    record.put(signed_arg(args, c.length));
+                    break;
+                case STRING:
+                    put_string(record, va_arg(args, const char *), precision);
+                    break;
+                default:
+                    record.put(unsigned_arg(args, c.length));
+            }
+        }
+    }
+
+    /* Adds text to out, keeping out's last byte for the ending zero. */
+    void add_text(char * out, size_t & used, const char * text,
+                  size_t length) {
+        const size_t room = BUFF_SIZE - 1 - used;
+        if (length > room) {
+            length = room;
+        }
+        memcpy(out + used, text, length);
+        used += length;
+    }
+
+    template<typename T>
+    void add_value(char * out, size_t & used, const char * spec, T value) {
+        const int written = snprintf(out + used, BUFF_SIZE - used, spec,
+                                     value);
+        if (written > 0) {
+            used += written;
+            if (used > BUFF_SIZE - 1) {
+                used = BUFF_SIZE - 1;
+            }
+        }
+    }
+
+    /* Formats a record the way vsnprintf would have at the time. Each
+     * conversion is formatted on its own, with the stored width and
+     * precision written in for any '*' and integers widened to long
+     * long. */
+    void format_record(const Record & record, char * out) {
+        size_t used = 0;
+        RecordReader reader(record);
+        if (record.format == 0) {
+            add_text(out, used, record.bytes(), record.size);
+            out[used] = '\0';
+            return;
+        }
+        Conversion c;
+        const char * text = record.format;
+        while (next_conversion(text, c)) {
+            add_text(out, used, text, c.start - text);
+            text = c.end;
+            if (c.kind == PERCENT) {
+                add_text(out, used, "%", 1);
+                continue;
+            }
+            if (c.kind == UNKNOWN) {
+                // put_arguments stopped here too.
+                text = c.start;
+                break;
+            }
+
+            // Flags, width and precision, with numbers for '*'.
+            char spec[64];
+            size_t spec_length = 0;
+            for (const char * p = c.start; p < c.length_start
+                 && spec_length < sizeof(spec) - 32; p ++) {
+                if (*p == '*') {
+                    spec_length += sprintf(spec + spec_length, "%d",
+                                           reader.get<int>());
+                } else {
+                    spec[spec_length ++] = *p;
+                }
+            }
+            switch(c.kind) {
+                case SIGNED:
+                case UNSIGNED:
+                    spec[spec_length ++] = 'l';
+                    spec[spec_length ++] = 'l';
+                    break;
+                case FLOATING:
+                    if (c.length == LONG_DOUBLE_LENGTH) {
+                        spec[spec_length ++] = 'L';
+                    }
+                    break;
+                default:
+                    break;
+            }
+            spec[spec_length ++] = c.kind == ERROR_TEXT ? 's' : c.type;
+            spec[spec_length] = '\0';
+
+            switch(c.kind) {
+                case CHARACTER:
+                    add_value(out, used, spec, reader.get<int>());
+                    break;
+                case FLOATING:
+                    if (c.length == LONG_DOUBLE_LENGTH) {
+                        add_value(out, used, spec, reader.get<long double>());
+                    } else {
+                        add_value(out, used, spec, reader.get<double>());
+                    }
+                    break;
+                case POINTER:
+                    add_value(out, used, spec, reader.get<void *>());
+                    break;
+                case SIGNED:
+                    add_value(out, used, spec, reader.get<long long>());
+                    break;
+                case UNSIGNED:
+                    add_value(out, used, spec,
+                              reader.get<unsigned long long>());
+                    break;
+                default: {
+                    // Strings were copied without their ending zero.
+                    const size_t length = reader.get<size_t>();
+                    string copy(reader.bytes(length), length);
+                    add_value(out, used, spec, copy.c_str());
+                }
+            }
+        }
+        add_text(out, used, text, strlen(text));
+        out[used] = '\0';
+    }
+
+    void write_line(int priority, const char * text) {
+        #ifdef _DEBUG
+            if (priority == LOG_INFO) {
+                std::cout << text << std::endl;
+            } else {
+                std::cerr << text << std::endl;
+            }
+        #endif
+        syslog(priority, "%s", text);
+    }
+
+
+    /* A queue for one thread's messages. Once its thread exits, the writer
+     * frees it as soon as it's empty. */
+    struct ThreadQueue {
+        explicit ThreadQueue(size_t size)
+        : abandoned(false), records(size) {
+        }
+
+        volatile bool abandoned;
+        RingBuffer<Record> records;
+    };
+
+    // The calling thread's queue, once it has logged something.
+    __thread ThreadQueue * thread_queue = 0;
+
+    // Set once the thread's queue was given up as the thread exits, after
+    // which the thread logs synchronously.
+    __thread bool thread_exiting = false;
+
+    void abandon_queue(ThreadQueue * queue) {
+        thread_exiting = true;
+        thread_queue = 0;
+        queue->abandoned = true;
+    }
+
+    /* Everything the background writer shares with the threads logging. */
+    struct AsyncState {
+        AsyncState()
+        :   config(),
+            dropped_count(0),
+            file(0),
+            queues(),
+            queues_mutex(),
+            queue_owner(abandon_queue),
+            reopen_requested(false),
+            reported_dropped_count(0),
+            running(false),
+            sleeping(false),
+            stopping(false),
+            wake(),
+            wake_mutex(),
+            writer()
+        {
+        }
+
+        ~AsyncState() {
+            // Threads still around at exit never give theirs up.
+            queue_owner.release();
+            if (!running) {
+                for (size_t i = 0; i < queues.size(); i ++) {
+                    delete queues[i];
+                }
+            }
+        }
+
+        LogConfig config;
+        volatile unsigned long dropped_count;
+        FILE * file;
+
+        // Every queue not yet freed, guarded by queues_mutex.
+        vector<ThreadQueue *> queues;
+        boost::mutex queues_mutex;
+
+        // Only here to call abandon_queue when a thread exits.
+        boost::thread_specific_ptr<ThreadQueue> queue_owner;
+
+        // Set by reopen_file for the writer to act on.
+        volatile bool reopen_requested;
+
+        unsigned long reported_dropped_count;
+
+        // True while messages go to the queues.
+        volatile bool running;
+
+        // True while the writer is about to sleep or is.
+        volatile bool sleeping;
+
+        volatile bool stopping;
+
+        // Signalled when a message is queued for a sleeping writer.
+        boost::condition_variable wake;
+        boost::mutex wake_mutex;
+
+        std::auto_ptr<boost::thread> writer;
+    };
+
+    AsyncState & async_state() {
+        static AsyncState state;
+        return state;
+    }
+
+    ThreadQueue * register_thread() {
+        AsyncState & state = async_state();
+        ThreadQueue * queue = new ThreadQueue(state.config.queue_size);
+        {
+            boost::lock_guard<boost::mutex> lock(state.queues_mutex);
+            state.queues.push_back(queue);
+        }
+        state.queue_owner.reset(queue);
+        thread_queue = queue;
+        return queue;
+    }
+
+    /* The calling thread's queue if logging is asynchronous, or null. */
+    ThreadQueue * current_queue() {
+        if (!async_state().running || thread_exiting) {
+            return 0;
+        }
+        ThreadQueue * queue = thread_queue;
+        return queue != 0 ? queue : register_thread();
+    }
+
+    /* A full queue drops the message rather than wait. */
+    void push_record(ThreadQueue * queue, Record & record) {
+        AsyncState & state = async_state();
+        if (!queue->records.try_push(record)) {
+            __sync_fetch_and_add(&state.dropped_count, 1);
+            record.free_overflow();
+            return;
+        }
+        // Pairs with the barrier in the writer, so either it sees the
+        // message or this sees that it has to be woken.
+        __sync_synchronize();
+        if (state.sleeping) {
+            boost::lock_guard<boost::mutex> lock(state.wake_mutex);
+            state.wake.notify_one();
+        }
+    }
+
+    /* Queues a formatted message, returning false if logging isn't
+     * asynchronous. */
+    bool queue_format(int priority, const char * format, va_list & args) {
+        const int saved_errno = errno;
+        ThreadQueue * queue = current_queue();
+        if (queue == 0) {
+            return false;
+        }
+        Record record;
+        record.format = format;
+        record.priority = priority;
+        gettimeofday(&record.time, 0);
+        put_arguments(record, format, args, saved_errno);
+        push_record(queue, record);
+        return true;
+    }
+
+    /* Queues finished text, returning false if logging isn't
+     * asynchronous. */
+    bool queue_text(int priority, const string & text) {
+        ThreadQueue * queue = current_queue();
+        if (queue == 0) {
+            return false;
+        }
+        Record record;
+        record.priority = priority;
+        gettimeofday(&record.time, 0);
+        record.append(text.data(), text.size() < (size_t) BUFF_SIZE
+                                   ? text.size() : (size_t) BUFF_SIZE);
+        push_record(queue, record);
+        return true;
+    }
+
+    /* Opens the configured file, leaving messages to go to syslog if it
+     * can't be. */
+    void open_file() {
+        AsyncState & state = async_state();
+        state.file = fopen(state.config.file.c_str(), "a");
+        if (state.file == 0) {
+            char buf[BUFF_SIZE];
+            snprintf(buf, BUFF_SIZE, "Could not open log file %s, using "
+                     "syslog.", state.config.file.c_str());
+            write_line(LOG_ERR, buf);
+        }
+    }
+
+    void write_record(const Record & record) {
+        AsyncState & state = async_state();
+        char buf[BUFF_SIZE];
+        format_record(record, buf);
+        if (state.file == 0) {
+            write_line(record.priority, buf);
+            return;
+        }
+        struct tm parts;
+        localtime_r(&record.time.tv_sec, &parts);
+        char when[32];
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &parts);
+        fprintf(state.file, "%s.%06d %s %s\n", when, (int) record.time.tv_usec,
+                record.priority == LOG_ERR ? "ERROR" : "INFO", buf);
+    }
+
+    /* Writes everything queued so far, returning how many messages that
+     * was, and frees the queues of threads which are gone. */
+    size_t write_queued() {
+        AsyncState & state = async_state();
+        if (state.reopen_requested && !state.config.file.empty()) {
+            // Whatever was written so far goes to the old file.
+            state.reopen_requested = false;
+            if (state.file != 0) {
+                fclose(state.file);
+            }
+            open_file();
+        }
+        vector<ThreadQueue *> queues;
+        {
+            boost::lock_guard<boost::mutex> lock(state.queues_mutex);
+            queues = state.queues;
+        }
+        size_t written = 0;
+        Record record;
+        for (size_t i = 0; i < queues.size(); i ++) {
+            while (queues[i]->records.try_pop(record)) {
+                write_record(record);
+                record.free_overflow();
+                written ++;
+            }
+        }
+
+        const unsigned long dropped = state.dropped_count;
+        if (dropped != state.reported_dropped_count) {
+            char buf[BUFF_SIZE];
+            snprintf(buf, BUFF_SIZE, "Dropped %lu log messages since the "
+                     "queues were full.",
+                     dropped - state.reported_dropped_count);
+            Record notice;
+            notice.priority = LOG_ERR;
+            gettimeofday(&notice.time, 0);
+            notice.append(buf, strlen(buf));
+            write_record(notice);
+            state.reported_dropped_count = dropped;
+        }
+
+        if (state.file != 0 && written > 0) {
+            fflush(state.file);
+        }
+
+        boost::lock_guard<boost::mutex> lock(state.queues_mutex);
+        for (size_t i = 0; i < state.queues.size(); ) {
+            ThreadQueue * queue = state.queues[i];
+            if (queue->abandoned && queue->records.empty()) {
+                delete queue;
+                state.queues.erase(state.queues.begin() + i);
+            } else {
+                i ++;
+            }
+        }
+        return written;
+    }
+
+    bool anything_queued() {
+        AsyncState & state = async_state();
+        boost::lock_guard<boost::mutex> lock(state.queues_mutex);
+        for (size_t i = 0; i < state.queues.size(); i ++) {
+            if (!state.queues[i]->records.empty()) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void write_until_stopped() {
+        AsyncState & state = async_state();
+        // Waking a sleeping writer costs the thread logging far more than
+        // queueing does, so while messages keep coming the writer naps
+        // instead of sleeping and nobody needs to wake it.
+        const int NAPS_BEFORE_SLEEPING = 10;
+        int naps = 0;
+        while(true) {
+            if (write_queued() > 0) {
+                naps = 0;
+                continue;
+            }
+            if (naps < NAPS_BEFORE_SLEEPING && !state.stopping) {
+                naps ++;
+                boost::this_thread::sleep(boost::posix_time::microseconds(100));
+                continue;
+            }
+            naps = 0;
+            boost::unique_lock<boost::mutex> lock(state.wake_mutex);
+            if (state.stopping) {
+                lock.unlock();
+                write_queued();
+                return;
+            }
+            state.sleeping = true;
+            // Pairs with the barrier in push_record.
+            __sync_synchronize();
+            if (!anything_queued() && !state.reopen_requested) {
+                // Waking now and then frees the queues of threads which
+                // have exited.
+                state.wake.timed_wait(lock,
+                                      boost::posix_time::seconds(1));
+            }
+            state.sleeping = false;
+        }
+    }
+
+} // end anonymous namespace
+
+
+/**---------------------------------------------------------------------------
+ *- LogConfig
+ *---------------------------------------------------------------------------*/
+
+LogConfig::LogConfig()
+:   file(),
+    queue_size(512)
+{
+}
+
+
+/**---------------------------------------------------------------------------
+ *- Log
+ *---------------------------------------------------------------------------*/
 
 void Log::debug(const char* format, ... ) {
     #ifdef _DEBUG
@@ -27,46 +814,84 @@ void Log::debug(const char* format, ... ) {
 }
 
 void Log::info(const std::string & msg) {
-    #ifdef _DEBUG
-        std::cout << msg << std::endl;
-    #endif
-    syslog(LOG_INFO, "%s", msg.c_str());
+    if (!queue_text(LOG_INFO, msg)) {
+        write_line(LOG_INFO, msg.c_str());
+    }
 }
 
 void Log::info2(const char* format, ... ) {
     va_list args;
     va_start(args, format);
-    const int BUFF_SIZE = 1024;
-    char buf[BUFF_SIZE];
-    vsnprintf(buf, BUFF_SIZE, format, args);
-
-    #ifdef _DEBUG
-        std::cout << buf << std::endl;
-    #endif
-
-    syslog(LOG_INFO, "%s", buf);
+    if (!queue_format(LOG_INFO, format, args)) {
+        char buf[BUFF_SIZE];
+        vsnprintf(buf, BUFF_SIZE, format, args);
+        write_line(LOG_INFO, buf);
+    }
     va_end(args);
 }
 
 
 void Log::error(const std::string & msg) {
-    #ifdef _DEBUG
-        std::cerr << msg << std::endl;
-    #endif
-    syslog(LOG_ERR, "%s", msg.c_str());
+    if (!queue_text(LOG_ERR, msg)) {
+        write_line(LOG_ERR, msg.c_str());
+    }
 }
 
 void Log::error2(const char* format, ... ) {
     va_list args;
     va_start(args, format);
-    const int BUFF_SIZE = 1024;
-    char buf[BUFF_SIZE];
-    vsnprintf(buf, BUFF_SIZE, format, args);
+    if (!queue_format(LOG_ERR, format, args)) {
+        char buf[BUFF_SIZE];
+        vsnprintf(buf, BUFF_SIZE, format, args);
+        write_line(LOG_ERR, buf);
+    }
+    va_end(args);
+}
 
-    #ifdef _DEBUG
-        std::cerr << buf << std::endl;
-    #endif
+unsigned long Log::get_dropped_count() {
+    return async_state().dropped_count;
+}
 
-    syslog(LOG_ERR, "%s", buf);
-    va_end(args);
+void Log::start_async(const LogConfig & config) {
+    AsyncState & state = async_state();
+    if (state.running) {
+        return;
+    }
+    state.config = config;
+    state.reopen_requested = false;
+    if (!config.file.empty()) {
+        open_file();
+    }
+    state.stopping = false;
+    state.writer.reset(new boost::thread(write_until_stopped));
+    state.running = true;
+}
+
+void Log::reopen_file() {
+    AsyncState & state = async_state();
+    if (!state.running) {
+        return;
+    }
+    boost::lock_guard<boost::mutex> lock(state.wake_mutex);
+    state.reopen_requested = true;
+    state.wake.notify_one();
+}
+
+void Log::stop_async() {
+    AsyncState & state = async_state();
+    if (!state.running) {
+        return;
+    }
+    state.running = false;
+    {
+        boost::lock_guard<boost::mutex> lock(state.wake_mutex);
+        state.stopping = true;
+        state.wake.notify_one();
+    }
+    state.writer->join();
+    state.writer.reset();
+    if (state.file != 0) {
+        fclose(state.file);
+        state.file = 0;
+    }
 }
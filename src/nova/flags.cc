@@ -242,6 +242,22 @@ const char * FlagValues::guest_ethernet_device() const {
     return map->get("guest_ethernet_device", "eth0");
 }
 
+double FlagValues::guest_message_time_budget() const {
+    return get_flag_value(*map, "guest_message_time_budget", (double) 0);
+}
+
+const char * FlagValues::guest_method_time_budgets() const {
+    return map->get("guest_method_time_budgets", "");
+}
+
+const char * FlagValues::guest_priority_methods() const {
+    return map->get("guest_priority_methods", "is_root_enabled,version");
+}
+
+size_t FlagValues::guest_worker_count() const {
+    return get_flag_value(*map, "guest_worker_count", (size_t) 4);
+}
+
 optional<const char *> FlagValues::host() const {
     const char * value = map->get("host", false);
     if (value == 0) {
@@ -250,6 +266,19 @@ optional<const char *> FlagValues::host() const {
     return optional<const char *>(value);
 }
 
+bool FlagValues::log_async() const {
+    const char * value = map->get("log_async", "false");
+    return strncmp(value, "true", 4) == 0;
+}
+
+const char * FlagValues::log_file() const {
+    return map->get("log_file", "");
+}
+
+size_t FlagValues::log_queue_size() const {
+    return get_flag_value(*map, "log_queue_size", (size_t) 512);
+}
+
 const char * FlagValues::node_availability_zone() const {
     return map->get("node_availability_zone", "nova");
 }
@@ -282,10 +311,38 @@ size_t FlagValues::rabbit_client_memory() const {
     return get_flag_value(*map, "rabbit_client_memory", (size_t) 4096);
 }
 
+size_t FlagValues::rabbit_compression_threshold() const {
+    return get_flag_value(*map, "rabbit_compression_threshold", (size_t) 0);
+}
+
+int FlagValues::rabbit_heartbeat() const {
+    return map->get_as_int("rabbit_heartbeat", 30);
+}
+
 const char * FlagValues::rabbit_host() const {
     return map->get("rabbit_host", "localhost");
 }
 
+bool FlagValues::rabbit_listen_to_fanout() const {
+    const char * value = map->get("rabbit_listen_to_fanout", "false");
+    return strncmp(value, "true", 4) == 0;
+}
+
+bool FlagValues::rabbit_listen_to_priority() const {
+    const char * value = map->get("rabbit_listen_to_priority", "false");
+    return strncmp(value, "true", 4) == 0;
+}
+
+bool FlagValues::rabbit_listen_to_topic() const {
+    const char * value = map->get("rabbit_listen_to_topic", "false");
+    return strncmp(value, "true", 4) == 0;
+}
+
+unsigned long FlagValues::rabbit_max_reconnect_wait_time() const {
+    return get_flag_value(*map, "rabbit_max_reconnect_wait_time",
+                                 (unsigned long) 300);
+}
+
 const char * FlagValues::rabbit_password() const {
     return map->get("rabbit_password", "guest");
 }
@@ -294,6 +351,15 @@ const int FlagValues::rabbit_port() const {
     return map->get_as_int("rabbit_port", 5672);
 }
 
+unsigned short FlagValues::rabbit_prefetch_count() const {
+    return get_flag_value(*map, "rabbit_prefetch_count", (unsigned short) 10);
+}
+
+bool FlagValues::rabbit_publisher_confirms() const {
+    const char * value = map->get("rabbit_publisher_confirms", "true");
+    return strncmp(value, "true", 4) == 0;
+}
+
 unsigned long FlagValues::rabbit_reconnect_wait_time() const {
     return get_flag_value(*map, "rabbit_reconnect_wait_time",
                                  (unsigned long) 30);
@@ -303,6 +369,14 @@ const char * FlagValues::rabbit_userid() const {
     return map->get("rabbit_userid", "guest");
 }
 
+const char * FlagValues::reply_cache_path() const {
+    return map->get("reply_cache_path", "");
+}
+
+size_t FlagValues::reply_cache_size() const {
+    return get_flag_value(*map, "reply_cache_size", (size_t) 64);
+}
+
 unsigned long FlagValues::report_interval() const {
     return get_flag_value(*map, "report_interval", (unsigned long) 10);
 }
@@ -11,8 +11,10 @@ GuestException::GuestException(GuestException::Code code) throw()
 GuestException::~GuestException() throw() {
 }
 
-const char * GuestException::what() throw() {
+const char * GuestException::what() const throw() {
     switch(code) {
+        case COULD_NOT_CREATE_PIPE:
+            return "Could not create a pipe.";
         case CONFIG_FILE_PARSE_ERROR:
             return "Error parsing config file!";
         case COULD_NOT_CONVERT_ADDRESS:
@@ -25,6 +27,8 @@ const char * GuestException::what() throw() {
             return "Error grabbing the host name.";
         case MALFORMED_INPUT:
             return "The input message was malformed.";
+        case MESSAGE_EXPIRED:
+            return "The message expired before it could be run.";
         case NO_SUCH_METHOD:
             return "Could not handle the JSON input. No such method was found.";
         default:
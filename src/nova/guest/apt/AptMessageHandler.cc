@@ -1,6 +1,7 @@
 #include "nova/guest/apt.h"
 
 #include "nova/guest/GuestException.h"
+#include "nova/json/dom.h"
 #include "nova/Log.h"
 #include <boost/optional.hpp>
 #include <sstream>
@@ -10,27 +11,44 @@ using nova::JsonData;
 using nova::JsonDataPtr;
 using nova::Log;
 using nova::guest::GuestException;
+using nova::json::Document;
+using nova::json::DocumentPtr;
 using boost::optional;
 using std::string;
 using std::stringstream;
 
 namespace nova { namespace guest { namespace apt {
 
+namespace {
+
+    /* The arguments, read into a Document which goes away with the
+     * message. */
+    DocumentPtr read_args(const GuestInput & input) {
+        return Document::parse(input.args_text.empty() ? string("{}")
+                                                       : input.args_text);
+    }
+
+}
+
 AptMessageHandler::AptMessageHandler(AptGuest * apt_guest)
 : apt_guest(apt_guest) {
 }
 
 JsonDataPtr AptMessageHandler::handle_message(const GuestInput & input) {
     if (input.method_name == "install") {
-        apt_guest->install(input.args->get_string("package_name"),
-                           input.args->get_int("time_out"));
+        DocumentPtr args = read_args(input);
+        apt_guest->install(args->root().get("package_name").get_string(),
+                           args->root().get("time_out").get_int());
         return JsonData::from_null();
     } else if (input.method_name == "remove") {
-        apt_guest->remove(input.args->get_string("package_name"),
-                          input.args->get_int("time_out"));
+        DocumentPtr args = read_args(input);
+        apt_guest->remove(args->root().get("package_name").get_string(),
+                          args->root().get("time_out").get_int());
         return JsonData::from_null();
     } else if (input.method_name == "version") {
-        const char * package_name = input.args->get_string("package_name");
+        DocumentPtr args = read_args(input);
+        const char * package_name =
+            args->root().get("package_name").get_string();
         optional<string> version = apt_guest->version(package_name);
         if (version) {
             return JsonData::from_string(version.get().c_str());
@@ -0,0 +1,268 @@
+#include "nova/guest/dispatcher.h"
+
+#include <boost/bind.hpp>
+#include <errno.h>
+#include <fcntl.h>
+#include "nova/guest/GuestException.h"
+#include <sys/time.h>
+#include <unistd.h>
+
+using std::string;
+using std::vector;
+
+namespace nova { namespace guest {
+
+namespace {
+
+    double seconds_since_epoch() {
+        timeval now;
+        gettimeofday(&now, 0);
+        return now.tv_sec + now.tv_usec / 1000000.0;
+    }
+
+    void set_non_blocking(int fd) {
+        int flags = fcntl(fd, F_GETFL, 0);
+        if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+            throw GuestException(GuestException::COULD_NOT_CREATE_PIPE);
+        }
+    }
+
+}
+
+Dispatcher::Dispatcher(const vector<MessageHandlerPtr> & handlers,
+                       size_t worker_count)
+: classes(),
+  completions(),
+  exclusive_running(false),
+  flights(),
+  handlers(handlers),
+  log(),
+  mutex(),
+  outstanding(0),
+  pending(),
+  priority_methods(),
+  priority_pending(),
+  single_flight_methods(),
+  stopping(false),
+  workers(),
+  work_available()
+{
+    if (pipe(wake_pipe) < 0) {
+        throw GuestException(GuestException::COULD_NOT_CREATE_PIPE);
+    }
+    try {
+        set_non_blocking(wake_pipe[0]);
+        set_non_blocking(wake_pipe[1]);
+    } catch(const GuestException & ge) {
+        close(wake_pipe[0]);
+        close(wake_pipe[1]);
+        throw;
+    }
+    for (size_t i = 0; i < worker_count; i ++) {
+        workers.create_thread(boost::bind(&Dispatcher::worker_loop, this));
+    }
+}
+
+Dispatcher::~Dispatcher() {
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        stopping = true;
+    }
+    work_available.notify_all();
+    workers.join_all();
+    close(wake_pipe[0]);
+    close(wake_pipe[1]);
+}
+
+void Dispatcher::dispatch(const GuestInput & input) {
+    Job job;
+    job.input = input;
+    if (single_flight_methods.find(input.method_name)
+        != single_flight_methods.end()) {
+        job.flight_key = input.method_name + " "
+                         + input.parse_args()->to_canonical_string();
+    }
+    const bool high_priority = is_high_priority(input);
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        outstanding ++;
+        if (!job.flight_key.empty()) {
+            std::map<string, vector<GuestInput> >::iterator itr =
+                flights.find(job.flight_key);
+            if (itr != flights.end()) {
+                log.info2("Sharing the result of an identical %s already "
+                          "dispatched.", input.method_name.c_str());
+                itr->second.push_back(input);
+                return;
+            }
+            flights[job.flight_key];
+        }
+        (high_priority ? priority_pending : pending).push_back(job);
+    }
+    work_available.notify_all();
+}
+
+Dispatcher::ConcurrencyClass Dispatcher::get_concurrency_class(
+    const string & method_name) const
+{
+    std::map<string, ConcurrencyClass>::const_iterator itr
+        = classes.find(method_name);
+    return itr == classes.end() ? EXCLUSIVE : itr->second;
+}
+
+size_t Dispatcher::get_outstanding_count() const {
+    boost::lock_guard<boost::mutex> lock(mutex);
+    return outstanding;
+}
+
+bool Dispatcher::is_high_priority(const GuestInput & input) const {
+    return input.high_priority
+        || priority_methods.find(input.method_name) != priority_methods.end();
+}
+
+bool Dispatcher::next_runnable(Job & job, bool & exclusive) {
+    // An exclusive message waiting in the priority queue goes before any
+    // waiting in the other, even if it arrived later.
+    bool passed_exclusive = false;
+    return next_runnable_in(priority_pending, job, exclusive, passed_exclusive)
+        || next_runnable_in(pending, job, exclusive, passed_exclusive);
+}
+
+bool Dispatcher::next_runnable_in(std::deque<Job> & jobs, Job & job,
+                                  bool & exclusive, bool & passed_exclusive) {
+    for (std::deque<Job>::iterator itr = jobs.begin();
+         itr != jobs.end(); itr ++) {
+        exclusive = !itr->task
+            && get_concurrency_class(itr->input.method_name) == EXCLUSIVE;
+        if (exclusive) {
+            // Only the oldest exclusive message may go, and only once the
+            // last one is done.
+            if (passed_exclusive || exclusive_running) {
+                passed_exclusive = true;
+                continue;
+            }
+            exclusive_running = true;
+        }
+        job = *itr;
+        jobs.erase(itr);
+        return true;
+    }
+    return false;
+}
+
+void Dispatcher::post(Task task) {
+    Job job;
+    job.task = task;
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        pending.push_back(job);
+    }
+    work_available.notify_all();
+}
+
+GuestOutput Dispatcher::run(const GuestInput & input) {
+    GuestOutput output;
+    try {
+        // After a long outage the queue can be full of messages nobody is
+        // waiting on anymore, so those are answered without running them.
+        if (input.deadline && seconds_since_epoch() > input.deadline.get()) {
+            throw GuestException(GuestException::MESSAGE_EXPIRED);
+        }
+        for (size_t i = 0; i < handlers.size() && !output.result; i ++) {
+            output.result = handlers[i]->handle_message(input);
+        }
+        if (!output.result) {
+            throw GuestException(GuestException::NO_SUCH_METHOD);
+        }
+        output.failure = boost::none;
+    } catch(const std::exception & e) {
+        // Letting this escape would take down the whole process.
+        log.error2("Error running method %s : %s",
+                   input.method_name.c_str(), e.what());
+        output.result.reset();
+        output.failure = e.what();
+    }
+    return output;
+}
+
+void Dispatcher::set_concurrency_class(const char * method_name,
+                                       ConcurrencyClass value) {
+    classes[method_name] = value;
+}
+
+void Dispatcher::set_high_priority(const char * method_name) {
+    priority_methods.insert(method_name);
+}
+
+void Dispatcher::set_single_flight(const char * method_name) {
+    single_flight_methods.insert(method_name);
+}
+
+void Dispatcher::take_completions(vector<Completion> & completed) {
+    char buffer[64];
+    while (read(wake_pipe[0], buffer, sizeof(buffer)) > 0) {
+        // Just emptying the pipe so select won't return immediately.
+    }
+    boost::lock_guard<boost::mutex> lock(mutex);
+    outstanding -= completions.size();
+    completed.insert(completed.end(), completions.begin(), completions.end());
+    completions.clear();
+}
+
+void Dispatcher::worker_loop() {
+    while(true) {
+        Job job;
+        bool exclusive = false;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while(!stopping && !next_runnable(job, exclusive)) {
+                work_available.wait(lock);
+            }
+            if (stopping) {
+                return;
+            }
+        }
+
+        if (job.task) {
+            try {
+                job.task();
+            } catch(const std::exception & e) {
+                log.error2("Error running task: %s", e.what());
+            }
+            continue;
+        }
+
+        Completion completion;
+        completion.input = job.input;
+        log.info2("Running method %s.", completion.input.method_name.c_str());
+        completion.output = run(completion.input);
+
+        {
+            boost::lock_guard<boost::mutex> lock(mutex);
+            if (exclusive) {
+                exclusive_running = false;
+            }
+            completions.push_back(completion);
+            if (!job.flight_key.empty()) {
+                std::map<string, vector<GuestInput> >::iterator itr =
+                    flights.find(job.flight_key);
+                for (size_t i = 0; i < itr->second.size(); i ++) {
+                    completion.input = itr->second[i];
+                    completions.push_back(completion);
+                }
+                flights.erase(itr);
+            }
+        }
+        if (exclusive) {
+            // Whatever was waiting on this one can go now.
+            work_available.notify_all();
+        }
+        // If the pipe is full the reader has plenty to wake it already.
+        if (write(wake_pipe[1], "!", 1) < 0 && errno != EAGAIN) {
+            log.error2("Could not signal completion of %s.",
+                       completion.input.method_name.c_str());
+        }
+    }
+}
+
+} }  // end namespace
@@ -4,10 +4,10 @@
 #include "nova/Log.h"
 #include <boost/foreach.hpp>
 #include "nova/db/mysql.h"
+#include "nova/json/dom.h"
 #include "nova/guest/mysql/MySqlMessageHandler.h"
 #include "nova/guest/mysql/MySqlNovaUpdater.h"
 #include "nova/guest/mysql/MySqlPreparer.h"
-#include <sstream>
 
 
 using nova::guest::apt::AptGuest;
@@ -15,8 +15,11 @@ using boost::format;
 using nova::Log;
 using nova::JsonData;
 using nova::JsonDataPtr;
-using nova::JsonObject;
-using nova::JsonObjectPtr;
+using nova::JsonException;
+using nova::JsonWriter;
+using nova::json::Document;
+using nova::json::DocumentPtr;
+using nova::json::Value;
 using namespace nova::db::mysql;
 using namespace std;
 
@@ -37,58 +40,85 @@ namespace {
 #define METHOD_NAME(name) STR_VALUE(name)
 #define REGISTER(name) { METHOD_NAME(name), & name }
 #define JSON_METHOD(name) JsonDataPtr \
-    name(const MySqlMessageHandler * guest, JsonObjectPtr args)
+    name(const MySqlMessageHandler * guest, Value args)
 
 
 namespace {
 
-    MySqlDatabasePtr db_from_obj(JsonObjectPtr obj) {
+    /* Null values count as missing. */
+    Value find_member(Value object, const char * key) {
+        Value value = object.find(key);
+        return value.is_null() ? Value() : value;
+    }
+
+    Value get_member(Value object, const char * key) {
+        Value value = find_member(object, key);
+        if (value.is_missing()) {
+            throw JsonException(JsonException::KEY_ERROR);
+        }
+        return value;
+    }
+
+    Value get_array(Value object, const char * key) {
+        Value value = get_member(object, key);
+        if (value.get_type() != nova::json::ARRAY) {
+            throw JsonException(JsonException::TYPE_ERROR_NOT_ARRAY);
+        }
+        return value;
+    }
+
+    string string_of(Value value) {
+        return string(value.get_string(), value.size());
+    }
+
+    MySqlDatabasePtr db_from_value(Value value) {
         MySqlDatabasePtr db(new MySqlDatabase());
-        string char_set = obj->get_string_or_default(
-            "_character_set",
-            MySqlDatabase::default_character_set());
-        db->set_character_set(char_set);
-        string collate = obj->get_string_or_default(
-            "_collate", MySqlDatabase::default_collation());
-        db->set_collation(collate);
-        db->set_name(obj->get_string("_name"));
+        Value character_set = find_member(value, "_character_set");
+        db->set_character_set(character_set.is_missing()
+                              ? MySqlDatabase::default_character_set()
+                              : string_of(character_set));
+        Value collate = find_member(value, "_collate");
+        db->set_collation(collate.is_missing()
+                          ? MySqlDatabase::default_collation()
+                          : string_of(collate));
+        db->set_name(string_of(get_member(value, "_name")));
         return db;
     }
 
-    void db_list_from_array(MySqlDatabaseListPtr db_list, JsonArrayPtr array) {
-        for (int i = 0; i < array->get_length(); i ++) {
-            JsonObjectPtr db_obj = array->get_object(i);
-            log.info2("database json info:%s", db_obj->to_string());
-            db_list->push_back(db_from_obj(db_obj));
+    void db_list_from_array(MySqlDatabaseListPtr db_list, Value array) {
+        for (size_t i = 0; i < array.size(); i ++) {
+            MySqlDatabasePtr db = db_from_value(array.at(i));
+            log.info2("database json info:%s", db->get_name().c_str());
+            db_list->push_back(db);
         };
     }
 
-    MySqlUserPtr user_from_obj(JsonObjectPtr obj) {
+    MySqlUserPtr user_from_value(Value value) {
         MySqlUserPtr user(new MySqlUser());
-        user->set_name(obj->get_string("_name"));
-        user->set_password(obj->get_optional_string("_password"));
-        JsonArrayPtr db_array = obj->get_array("_databases");
-        db_list_from_array(user->get_databases(), db_array);
+        user->set_name(string_of(get_member(value, "_name")));
+        Value password = find_member(value, "_password");
+        if (!password.is_missing()) {
+            user->set_password(string_of(password));
+        }
+        db_list_from_array(user->get_databases(),
+                           get_array(value, "_databases"));
         return user;
     }
 
-    void user_to_stream(stringstream & out, MySqlUserPtr user) {
-        out << "{\"_name\":" << JsonData::json_string(user->get_name().c_str())
-            << ", \"_password\":";
-        if (user->get_password()) {
-            out << JsonData::json_string(user->get_password().get().c_str());
-        } else {
-            out << "null";
-        }
-        out << " }";
+    void user_to_stream(JsonWriter & out, MySqlUserPtr user) {
+        out.begin_object();
+        out.key("_name");
+        out.value(user->get_name());
+        out.key("_password");
+        out.value(user->get_password());
+        out.end_object();
     }
 
     JSON_METHOD(create_database) {
         MySqlAdminPtr sql = guest->sql_admin();
         log.info2("guest create_database"); //", guest->create_database().c_str());
         MySqlDatabaseListPtr databases(new MySqlDatabaseList());
-        JsonArrayPtr array = args->get_array("databases");
-        db_list_from_array(databases, array);
+        db_list_from_array(databases, get_array(args, "databases"));
         sql->create_database(databases);
         return JsonData::from_null();
     }
@@ -96,9 +126,9 @@ namespace {
     JSON_METHOD(create_user) {
         MySqlAdminPtr sql = guest->sql_admin();
         MySqlUserListPtr users(new MySqlUserList());
-        JsonArrayPtr array = args->get_array("users");
-        for (int i = 0; i < array->get_length(); i ++) {
-            users->push_back(user_from_obj(array->get_object(i)));
+        Value array = get_array(args, "users");
+        for (size_t i = 0; i < array.size(); i ++) {
+            users->push_back(user_from_value(array.at(i)));
         };
         sql->create_users(users);
         return JsonData::from_null();
@@ -106,56 +136,45 @@ namespace {
 
     JSON_METHOD(list_users) {
         MySqlAdminPtr sql = guest->sql_admin();
-        std::stringstream user_xml;
+        JsonWriter out;
         MySqlUserListPtr users = sql->list_users();
-        user_xml << "[";
-        bool once = false;
+        out.begin_array();
         BOOST_FOREACH(MySqlUserPtr & user, *users) {
-            if (once) {
-                user_xml << ", ";
-            }
-            user_to_stream(user_xml, user);
-            once = true;
+            user_to_stream(out, user);
         }
-        user_xml << "]";
-        JsonDataPtr rtn(new JsonArray(user_xml.str().c_str()));
-        return rtn;
+        out.end_array();
+        return out.to_json_data();
     }
 
     JSON_METHOD(delete_user) {
         MySqlAdminPtr sql = guest->sql_admin();
-        MySqlUserPtr user = user_from_obj(args->get_object("user"));
+        MySqlUserPtr user = user_from_value(get_member(args, "user"));
         sql->delete_user(user->get_name());
         return JsonData::from_null();
     }
 
     JSON_METHOD(list_databases) {
         MySqlAdminPtr sql = guest->sql_admin();
-        std::stringstream database_xml;
+        JsonWriter out;
         MySqlDatabaseListPtr databases = sql->list_databases();
-        database_xml << "[";
-        bool once = false;
+        out.begin_array();
         BOOST_FOREACH(MySqlDatabasePtr & database, *databases) {
-            if (once) {
-                database_xml << ", ";
-            }
-            once = true;
-            database_xml << "{ \"_name\":"
-                         << JsonData::json_string(database->get_name())
-                         << ", \"_collate\":"
-                         << JsonData::json_string(database->get_collation())
-                         << ", \"_character_set\":"
-                         << JsonData::json_string(database->get_character_set())
-                         << " }";
+            out.begin_object();
+            out.key("_name");
+            out.value(database->get_name());
+            out.key("_collate");
+            out.value(database->get_collation());
+            out.key("_character_set");
+            out.value(database->get_character_set());
+            out.end_object();
         }
-        database_xml << "]";
-        JsonDataPtr rtn(new JsonArray(database_xml.str().c_str()));
-        return rtn;
+        out.end_array();
+        return out.to_json_data();
     }
 
     JSON_METHOD(delete_database) {
         MySqlAdminPtr sql = guest->sql_admin();
-        MySqlDatabasePtr db = db_from_obj(args->get_object("database"));
+        MySqlDatabasePtr db = db_from_value(get_member(args, "database"));
         sql->delete_database(db->get_name());
         return JsonData::from_null();
     }
@@ -163,10 +182,9 @@ namespace {
     JSON_METHOD(enable_root) {
         MySqlAdminPtr sql = guest->sql_admin();
         MySqlUserPtr user = sql->enable_root();
-        stringstream out;
+        JsonWriter out;
         user_to_stream(out, user);
-        JsonDataPtr rtn(new JsonObject(out.str().c_str()));
-        return rtn;
+        return out.to_json_data();
     }
 
     JSON_METHOD(is_root_enabled) {
@@ -189,7 +207,6 @@ namespace {
         // The argument signature is the same as create_database so just
         // forward the method.
         log.info("Creating initial databases following successful prepare");
-        log.info2("Here's the args: %s", args->to_string());
         return create_database(guest, args);
     }
 
@@ -229,7 +246,12 @@ JsonDataPtr MySqlMessageHandler::handle_message(const GuestInput & input) {
         // Make sure our connection is fresh.
         MethodPtr & method = method_itr->second;  // value
         log.info2( "Executing method %s", input.method_name.c_str());
-        JsonDataPtr result = (*(method))(this, input.args);
+        // Read again into a Document, which holds all of the arguments in
+        // one arena instead of a JsonObject for every user and database in
+        // a batch. It goes away as soon as the method returns.
+        DocumentPtr args = input.args_text.empty() ? Document::parse("{}")
+                           : Document::parse(input.args_text);
+        JsonDataPtr result = (*(method))(this, args->root());
         return result;
     } else {
         return JsonDataPtr();
@@ -1,5 +1,8 @@
 #include "nova/json.h"
 #include <json/json.h>
+#include "nova/utils/text.h"
+#include <stdio.h>
+#include <string.h>
 
 using boost::optional;
 using std::string;
@@ -67,6 +70,40 @@ namespace {
         return json_object_get_string(string_obj);
     }
 
+    void write_canonical(json_object * obj, string & out) {
+        if (obj == 0) {
+            out += "null";
+        } else if (json_object_is_type(obj, json_type_object)) {
+            std::map<string, json_object *> sorted;
+            json_object_object_foreach(obj, key, value) {
+                sorted[key] = value;
+            }
+            out += '{';
+            for (std::map<string, json_object *>::const_iterator itr
+                    = sorted.begin(); itr != sorted.end(); itr ++) {
+                if (itr != sorted.begin()) {
+                    out += ',';
+                }
+                out += JsonData::json_string(itr->first);
+                out += ':';
+                write_canonical(itr->second, out);
+            }
+            out += '}';
+        } else if (json_object_is_type(obj, json_type_array)) {
+            out += '[';
+            const int length = json_object_array_length(obj);
+            for (int i = 0; i < length; i ++) {
+                if (i > 0) {
+                    out += ',';
+                }
+                write_canonical(json_object_array_get_idx(obj, i), out);
+            }
+            out += ']';
+        } else {
+            out += json_object_to_json_string(obj);
+        }
+    }
+
 } // end anonymous namespace
 
 
@@ -116,7 +153,7 @@ const char * JsonException::what() const throw() {
  *---------------------------------------------------------------------------*/
 
 JsonData::JsonData()
-: object(0), root(0) {
+: object(0), root(0), raw() {
 }
 
 JsonData::JsonData(json_object * obj)
@@ -179,7 +216,9 @@ void JsonData::check_initial_object(bool owned, json_object * obj,
 }
 
 std::string JsonData::json_string(const char * text) {
-    return from_string(text)->to_string();
+    string out;
+    JsonWriter::write_string(out, text, strlen(text));
+    return out;
 }
 
 JsonDataPtr JsonData::from_boolean(bool value) {
@@ -200,6 +239,12 @@ JsonDataPtr JsonData::from_null() {
     return ptr;
 }
 
+JsonDataPtr JsonData::from_raw(const string & text) {
+    JsonDataPtr ptr(new JsonData());
+    ptr->raw = text;
+    return ptr;
+}
+
 JsonDataPtr JsonData::from_string(const char * text) {
     json_object * obj = json_object_new_string(text);
     JsonDataPtr ptr(new JsonData(obj, json_type_string));
@@ -232,7 +277,24 @@ void JsonData::set_root(json_object * obj) {
     this->object = obj;
 }
 
+string JsonData::to_canonical_string() const {
+    string out;
+    if (raw) {
+        json_object * parsed = json_tokener_parse(raw.get().c_str());
+        write_canonical(parsed, out);
+        if (parsed != 0) {
+            json_object_put(parsed);
+        }
+        return out;
+    }
+    write_canonical(object, out);
+    return out;
+}
+
 const char * JsonData::to_string() const {
+    if (raw) {
+        return raw.get().c_str();
+    }
     if (object == 0) {
         return "null";
     }
@@ -330,6 +392,19 @@ JsonObject::JsonObject(const char * json_text)
                     JsonException::CTOR_ARGUMENT_NOT_OBJECT);
 }
 
+JsonObject::JsonObject(const char * json_text, size_t length)
+: JsonData()
+{
+    json_tokener * tokener = json_tokener_new();
+    json_object * obj = json_tokener_parse_ex(tokener, json_text, length);
+    json_tokener_free(tokener);
+    if (obj == 0) {
+        throw JsonException(JsonException::CTOR_ARGUMENT_IS_NOT_JSON_STRING);
+    }
+    initialize_root(obj, json_type_object,
+                    JsonException::CTOR_ARGUMENT_NOT_OBJECT);
+}
+
 JsonObject::JsonObject(json_object * obj)
 : JsonData()
 {
@@ -419,4 +494,226 @@ const char * JsonObject::get_string_or_default(const char * key,
     return get_json_string_or_default(string_obj, default_value);
 }
 
+bool JsonObject::try_get_array(const char * key, JsonArrayPtr & value) const {
+    return JsonMember(json_object_object_get(object, key), root).as(value);
+}
+
+bool JsonObject::try_get_int(const char * key, int & value) const {
+    return JsonMember(json_object_object_get(object, key), root).as(value);
+}
+
+bool JsonObject::try_get_object(const char * key, JsonObjectPtr & value) const {
+    return JsonMember(json_object_object_get(object, key), root).as(value);
+}
+
+bool JsonObject::try_get_string(const char * key, string & value) const {
+    return JsonMember(json_object_object_get(object, key), root).as(value);
+}
+
+
+/**---------------------------------------------------------------------------
+ *- JsonMember
+ *---------------------------------------------------------------------------*/
+
+JsonMember::JsonMember(json_object * value, JsonData::Root * root)
+: root(root), value(value)
+{
+}
+
+bool JsonMember::as(bool & value) const {
+    if (!json_object_is_type(this->value, json_type_boolean)) {
+        return false;
+    }
+    value = json_object_get_boolean(this->value) != 0;
+    return true;
+}
+
+bool JsonMember::as(int & value) const {
+    if (!json_object_is_type(this->value, json_type_int)) {
+        return false;
+    }
+    value = json_object_get_int(this->value);
+    return true;
+}
+
+bool JsonMember::as(string & value) const {
+    if (!json_object_is_type(this->value, json_type_string)) {
+        return false;
+    }
+    value = json_object_get_string(this->value);
+    return true;
+}
+
+bool JsonMember::as(optional<string> & value) const {
+    if (!json_object_is_type(this->value, json_type_string)) {
+        return false;
+    }
+    value = string(json_object_get_string(this->value));
+    return true;
+}
+
+bool JsonMember::as(JsonArrayPtr & value) const {
+    if (!json_object_is_type(this->value, json_type_array)) {
+        return false;
+    }
+    value.reset(new JsonArray(this->value, root));
+    return true;
+}
+
+bool JsonMember::as(JsonObjectPtr & value) const {
+    if (!json_object_is_type(this->value, json_type_object)) {
+        return false;
+    }
+    value.reset(new JsonObject(this->value, root));
+    return true;
+}
+
+bool JsonMember::is_null() const {
+    return value == (json_object *)0;
+}
+
+
+/**---------------------------------------------------------------------------
+ *- JsonWriter
+ *---------------------------------------------------------------------------*/
+
+JsonWriter::JsonWriter()
+: buffer(), has_items(), key_written(false)
+{
+}
+
+void JsonWriter::before_value() {
+    if (key_written) {
+        key_written = false;
+        return;
+    }
+    if (!has_items.empty()) {
+        if (has_items.back()) {
+            buffer += ',';
+        }
+        has_items.back() = true;
+    }
+}
+
+void JsonWriter::begin_array() {
+    before_value();
+    buffer += '[';
+    has_items.push_back(false);
+}
+
+void JsonWriter::begin_object() {
+    before_value();
+    buffer += '{';
+    has_items.push_back(false);
+}
+
+void JsonWriter::clear() {
+    buffer.clear();
+    has_items.clear();
+    key_written = false;
+}
+
+void JsonWriter::end_array() {
+    has_items.pop_back();
+    buffer += ']';
+}
+
+void JsonWriter::end_object() {
+    has_items.pop_back();
+    buffer += '}';
+}
+
+void JsonWriter::key(const char * name) {
+    before_value();
+    write_string(buffer, name, strlen(name));
+    buffer += ':';
+    key_written = true;
+}
+
+void JsonWriter::null_value() {
+    before_value();
+    buffer += "null";
+}
+
+JsonDataPtr JsonWriter::to_json_data() const {
+    return JsonData::from_raw(buffer);
+}
+
+void JsonWriter::value(bool value) {
+    before_value();
+    buffer += value ? "true" : "false";
+}
+
+void JsonWriter::value(int value) {
+    before_value();
+    char digits[16];
+    buffer.append(digits, snprintf(digits, sizeof(digits), "%d", value));
+}
+
+void JsonWriter::value(const char * value) {
+    before_value();
+    write_string(buffer, value, strlen(value));
+}
+
+void JsonWriter::value(const std::string & value) {
+    before_value();
+    write_string(buffer, value.data(), value.size());
+}
+
+void JsonWriter::value(const boost::optional<std::string> & value) {
+    if (value) {
+        this->value(value.get());
+    } else {
+        null_value();
+    }
+}
+
+void JsonWriter::write_string(std::string & out, const char * text,
+                              size_t length) {
+    static const char HEX[] = "0123456789abcdef";
+    out.reserve(out.size() + length + 2);
+    out += '"';
+    size_t start = 0;
+    while(true) {
+        // Copy the run of plain characters before the next escape all at
+        // once.
+        const size_t i = start + nova::utils::find_json_escape(
+            text + start, length - start);
+        out.append(text + start, i - start);
+        if (i == length) {
+            break;
+        }
+        start = i + 1;
+        const unsigned char c = (unsigned char) text[i];
+        switch(c) {
+            case '"':
+                out += "\\\"";
+                break;
+            case '\\':
+                out += "\\\\";
+                break;
+            case '\b':
+                out += "\\b";
+                break;
+            case '\f':
+                out += "\\f";
+                break;
+            case '\n':
+                out += "\\n";
+                break;
+            case '\r':
+                out += "\\r";
+                break;
+            case '\t':
+                out += "\\t";
+                break;
+            default:
+                out += "\\u00";
+                out += HEX[c >> 4];
+                out += HEX[c & 0xf];
+        }
+    }
+    out += '"';
+}
+
 } // end namespace nova
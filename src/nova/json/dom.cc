@@ -0,0 +1,368 @@
+#include "nova/json/dom.h"
+#include "nova/json/sax.h"
+#include <new>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+using std::vector;
+
+namespace nova { namespace json {
+
+namespace {
+
+    // Every allocation is rounded up to this, which suits all of a Node's
+    // members.
+    const size_t ALIGNMENT = 8;
+
+    inline size_t align(size_t size) {
+        return (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+    }
+
+    /* Builds Nodes in an arena from what a SaxParser reads. Items and
+     * members are gathered on stacks until their array or object closes,
+     * then copied into the arena side by side, so the stacks are the only
+     * other memory used however many values there are. */
+    class Builder : public SaxHandler {
+
+        public:
+            Builder(Arena & arena, Node & root)
+            :   arena(arena), frames(), items(), members(), root(root)
+            {
+            }
+
+            virtual bool begin_array() {
+                begin(false);
+                return true;
+            }
+
+            virtual bool begin_object() {
+                begin(true);
+                return true;
+            }
+
+            virtual bool bool_value(bool value) {
+                Node node = scalar(BOOLEAN);
+                node.data.boolean = value;
+                add(node);
+                return true;
+            }
+
+            virtual bool double_value(double value) {
+                Node node = scalar(DOUBLE);
+                node.data.number = value;
+                add(node);
+                return true;
+            }
+
+            virtual bool end_array() {
+                const size_t first = frames.back().first;
+                const size_t count = items.size() - first;
+                Node node = scalar(ARRAY);
+                node.length = count;
+                Node * copy = 0;
+                if (count > 0) {
+                    copy = (Node *) arena.allocate(sizeof(Node) * count);
+                    memcpy(copy, &items[first], sizeof(Node) * count);
+                }
+                node.data.items = copy;
+                items.resize(first);
+                frames.pop_back();
+                add(node);
+                return true;
+            }
+
+            virtual bool end_object() {
+                const size_t first = frames.back().first;
+                const size_t count = members.size() - first;
+                Node node = scalar(OBJECT);
+                node.length = count;
+                Member * copy = 0;
+                if (count > 0) {
+                    copy = (Member *) arena.allocate(sizeof(Member) * count);
+                    memcpy(copy, &members[first], sizeof(Member) * count);
+                }
+                node.data.members = copy;
+                members.resize(first);
+                frames.pop_back();
+                add(node);
+                return true;
+            }
+
+            virtual bool int_value(long long value) {
+                Node node = scalar(INTEGER);
+                node.data.integer = value;
+                add(node);
+                return true;
+            }
+
+            virtual KeyAction key(const StringView & name) {
+                frames.back().key = copy_string(name);
+                frames.back().key_length = name.length;
+                return READ;
+            }
+
+            virtual bool null_value() {
+                add(scalar(NULL_VALUE));
+                return true;
+            }
+
+            virtual bool string_value(const StringView & value) {
+                Node node = scalar(STRING);
+                node.length = value.length;
+                node.data.string = copy_string(value);
+                add(node);
+                return true;
+            }
+
+        private:
+            /* An array or object which hasn't closed yet. */
+            struct Frame {
+                size_t first;
+                bool is_object;
+                const char * key;
+                size_t key_length;
+            };
+
+            Arena & arena;
+            vector<Frame> frames;
+            vector<Node> items;
+            vector<Member> members;
+            Node & root;
+
+            /* Puts a finished value where it belongs. Anything nested in
+             * it was already taken off the stacks. */
+            void add(const Node & node) {
+                if (frames.empty()) {
+                    root = node;
+                } else if (frames.back().is_object) {
+                    Member member;
+                    member.key = frames.back().key;
+                    member.key_length = frames.back().key_length;
+                    member.value = node;
+                    members.push_back(member);
+                } else {
+                    items.push_back(node);
+                }
+            }
+
+            void begin(bool is_object) {
+                Frame frame;
+                frame.first = is_object ? members.size() : items.size();
+                frame.is_object = is_object;
+                frame.key = 0;
+                frame.key_length = 0;
+                frames.push_back(frame);
+            }
+
+            const char * copy_string(const StringView & text) {
+                char * copy = (char *) arena.allocate(text.length + 1);
+                memcpy(copy, text.data, text.length);
+                copy[text.length] = '\0';
+                return copy;
+            }
+
+            static Node scalar(Type type) {
+                Node node;
+                node.type = type;
+                node.length = 0;
+                return node;
+            }
+    };
+
+} // end anonymous namespace
+
+
+/**---------------------------------------------------------------------------
+ *- Arena
+ *---------------------------------------------------------------------------*/
+
+Arena::Arena(size_t first_chunk_size)
+:   bytes_used(0),
+    chunk_count(0),
+    chunks(0),
+    cursor(0),
+    end(0),
+    next_chunk_size(align(first_chunk_size))
+{
+}
+
+Arena::~Arena() {
+    while (chunks != 0) {
+        Chunk * previous = chunks->previous;
+        free(chunks);
+        chunks = previous;
+    }
+}
+
+void Arena::add_chunk(size_t at_least) {
+    size_t size = next_chunk_size;
+    while (size < at_least) {
+        size *= 2;
+    }
+    const size_t header = align(sizeof(Chunk));
+    Chunk * chunk = (Chunk *) malloc(header + size);
+    if (chunk == 0) {
+        throw std::bad_alloc();
+    }
+    chunk->previous = chunks;
+    chunk->size = size;
+    chunks = chunk;
+    chunk_count ++;
+    cursor = ((char *) chunk) + header;
+    end = cursor + size;
+    next_chunk_size = size * 2;
+}
+
+void * Arena::allocate(size_t size) {
+    size = align(size);
+    if ((size_t) (end - cursor) < size || cursor == 0) {
+        add_chunk(size);
+    }
+    void * result = cursor;
+    cursor += size;
+    bytes_used += size;
+    return result;
+}
+
+
+/**---------------------------------------------------------------------------
+ *- Value
+ *---------------------------------------------------------------------------*/
+
+Value::Value()
+: node(0)
+{
+}
+
+Value::Value(const Node * node)
+: node(node)
+{
+}
+
+Value Value::at(size_t index) const {
+    if (get_type() != ARRAY) {
+        throw JsonException(JsonException::TYPE_ERROR_NOT_ARRAY);
+    }
+    if (index >= node->length) {
+        throw JsonException(JsonException::INDEX_ERROR);
+    }
+    return Value(node->data.items + index);
+}
+
+Value Value::find(const char * key) const {
+    if (get_type() != OBJECT) {
+        throw JsonException(JsonException::TYPE_ERROR_NOT_OBJECT);
+    }
+    const size_t key_length = strlen(key);
+    for (size_t i = 0; i < node->length; i ++) {
+        const Member & member = node->data.members[i];
+        if (member.key_length == key_length
+            && memcmp(member.key, key, key_length) == 0) {
+            return Value(&member.value);
+        }
+    }
+    return Value();
+}
+
+Value Value::get(const char * key) const {
+    Value value = find(key);
+    if (value.is_missing()) {
+        throw JsonException(JsonException::KEY_ERROR);
+    }
+    return value;
+}
+
+bool Value::get_bool() const {
+    if (get_type() != BOOLEAN) {
+        throw JsonException(JsonException::TYPE_INCORRECT);
+    }
+    return node->data.boolean;
+}
+
+double Value::get_double() const {
+    if (get_type() == INTEGER) {
+        return (double) node->data.integer;
+    } else if (get_type() != DOUBLE) {
+        throw JsonException(JsonException::TYPE_INCORRECT);
+    }
+    return node->data.number;
+}
+
+int Value::get_int() const {
+    if (get_type() != INTEGER) {
+        throw JsonException(JsonException::TYPE_ERROR_NOT_INT);
+    }
+    return (int) node->data.integer;
+}
+
+const char * Value::get_string() const {
+    if (get_type() != STRING) {
+        throw JsonException(JsonException::TYPE_ERROR_NOT_STRING);
+    }
+    return node->data.string;
+}
+
+Type Value::get_type() const {
+    return node == 0 ? NULL_VALUE : node->type;
+}
+
+bool Value::is_null() const {
+    return get_type() == NULL_VALUE;
+}
+
+const char * Value::key_at(size_t index) const {
+    if (get_type() != OBJECT) {
+        throw JsonException(JsonException::TYPE_ERROR_NOT_OBJECT);
+    }
+    if (index >= node->length) {
+        throw JsonException(JsonException::INDEX_ERROR);
+    }
+    return node->data.members[index].key;
+}
+
+size_t Value::size() const {
+    return node == 0 ? 0 : node->length;
+}
+
+Value Value::value_at(size_t index) const {
+    if (get_type() != OBJECT) {
+        throw JsonException(JsonException::TYPE_ERROR_NOT_OBJECT);
+    }
+    if (index >= node->length) {
+        throw JsonException(JsonException::INDEX_ERROR);
+    }
+    return Value(&node->data.members[index].value);
+}
+
+
+/**---------------------------------------------------------------------------
+ *- Document
+ *---------------------------------------------------------------------------*/
+
+// Nodes take a few times the room of the text they come from, so starting
+// there means most messages fit in the first chunk.
+Document::Document(size_t text_length)
+:   arena(text_length * 4 > 4096 ? text_length * 4 : 4096),
+    reference_count(0),
+    root_node(0)
+{
+}
+
+Document::~Document() {
+}
+
+DocumentPtr Document::parse(const char * text, size_t length) {
+    if (text == 0) {
+        throw JsonException(JsonException::CTOR_ARGUMENT_IS_NULL);
+    }
+    DocumentPtr document(new Document(length));
+    Node * root = (Node *) document->arena.allocate(sizeof(Node));
+    Builder builder(document->arena, *root);
+    SaxParser parser;
+    parser.parse(text, length, builder);
+    document->root_node = root;
+    return document;
+}
+
+} } // end namespace
@@ -0,0 +1,484 @@
+#include "nova/json/sax.h"
+#include <stdlib.h>
+
+using std::string;
+
+namespace nova { namespace json {
+
+namespace {
+
+    // Deeper nesting than this is refused rather than risk the stack.
+    const int MAX_DEPTH = 512;
+
+    inline void fail() {
+        throw JsonException(JsonException::CTOR_ARGUMENT_IS_NOT_JSON_STRING);
+    }
+
+    inline int hex_digit(char c) {
+        if (c >= '0' && c <= '9') {
+            return c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+            return c - 'a' + 10;
+        } else if (c >= 'A' && c <= 'F') {
+            return c - 'A' + 10;
+        }
+        return -1;
+    }
+
+    inline bool is_digit(char c) {
+        return c >= '0' && c <= '9';
+    }
+
+    /* Reads the four hex digits after the 'u' at escape. */
+    unsigned long read_hex(const char * escape, const char * stop) {
+        if (stop - escape < 5) {
+            fail();
+        }
+        unsigned long value = 0;
+        for (int i = 1; i <= 4; i ++) {
+            const int digit = hex_digit(escape[i]);
+            if (digit < 0) {
+                fail();
+            }
+            value = (value << 4) | digit;
+        }
+        return value;
+    }
+
+    /* Writes code_point as UTF-8, returning the byte after it. */
+    char * write_utf8(char * out, unsigned long code_point) {
+        if (code_point < 0x80) {
+            *out++ = (char) code_point;
+        } else if (code_point < 0x800) {
+            *out++ = (char) (0xC0 | (code_point >> 6));
+            *out++ = (char) (0x80 | (code_point & 0x3F));
+        } else if (code_point < 0x10000) {
+            *out++ = (char) (0xE0 | (code_point >> 12));
+            *out++ = (char) (0x80 | ((code_point >> 6) & 0x3F));
+            *out++ = (char) (0x80 | (code_point & 0x3F));
+        } else {
+            *out++ = (char) (0xF0 | (code_point >> 18));
+            *out++ = (char) (0x80 | ((code_point >> 12) & 0x3F));
+            *out++ = (char) (0x80 | ((code_point >> 6) & 0x3F));
+            *out++ = (char) (0x80 | (code_point & 0x3F));
+        }
+        return out;
+    }
+
+    /* Unescapes the text between start and stop into out, which must have
+     * room for stop - start bytes since unescaping never adds any.
+     * Returns the byte after the last one written. */
+    char * unescape(const char * start, const char * stop, char * out) {
+        for (const char * read = start; read != stop; read ++) {
+            if (*read != '\\') {
+                *out++ = *read;
+                continue;
+            }
+            read ++;
+            switch(*read) {
+                case '"': *out++ = '"'; break;
+                case '\'': *out++ = '\''; break;
+                case '\\': *out++ = '\\'; break;
+                case '/': *out++ = '/'; break;
+                case 'b': *out++ = '\b'; break;
+                case 'f': *out++ = '\f'; break;
+                case 'n': *out++ = '\n'; break;
+                case 'r': *out++ = '\r'; break;
+                case 't': *out++ = '\t'; break;
+                case 'u': {
+                    unsigned long code_point = read_hex(read, stop);
+                    read += 4;
+                    if (code_point >= 0xD800 && code_point < 0xDC00
+                        && stop - read > 6 && read[1] == '\\'
+                        && read[2] == 'u') {
+                        const unsigned long low = read_hex(read + 2, stop);
+                        if (low >= 0xDC00 && low < 0xE000) {
+                            code_point = 0x10000
+                                + ((code_point - 0xD800) << 10)
+                                + (low - 0xDC00);
+                            read += 6;
+                        }
+                    }
+                    out = write_utf8(out, code_point);
+                    break;
+                }
+                default:
+                    fail();
+            }
+        }
+        return out;
+    }
+
+} // end anonymous namespace
+
+
+/**---------------------------------------------------------------------------
+ *- SaxHandler
+ *---------------------------------------------------------------------------*/
+
+SaxHandler::~SaxHandler() {
+}
+
+bool SaxHandler::begin_array() {
+    return true;
+}
+
+bool SaxHandler::begin_object() {
+    return true;
+}
+
+bool SaxHandler::bool_value(bool value) {
+    return true;
+}
+
+bool SaxHandler::double_value(double value) {
+    return true;
+}
+
+bool SaxHandler::end_array() {
+    return true;
+}
+
+bool SaxHandler::end_object() {
+    return true;
+}
+
+bool SaxHandler::int_value(long long value) {
+    return true;
+}
+
+SaxHandler::KeyAction SaxHandler::key(const StringView & name) {
+    return READ;
+}
+
+bool SaxHandler::null_value() {
+    return true;
+}
+
+bool SaxHandler::raw_value(const StringView & text) {
+    return true;
+}
+
+bool SaxHandler::string_value(const StringView & value) {
+    return true;
+}
+
+
+/**---------------------------------------------------------------------------
+ *- SaxParser
+ *---------------------------------------------------------------------------*/
+
+SaxParser::SaxParser()
+: end(0), position(0), unescaped()
+{
+}
+
+bool SaxParser::parse(const char * text, size_t length,
+                      SaxHandler & handler) {
+    if (text == 0) {
+        throw JsonException(JsonException::CTOR_ARGUMENT_IS_NULL);
+    }
+    position = text;
+    end = text + length;
+    if (!parse_value(handler, 0)) {
+        return false;
+    }
+    skip_space();
+    if (position != end) {
+        fail();
+    }
+    return true;
+}
+
+bool SaxParser::parse_array(SaxHandler & handler, int depth) {
+    position ++;
+    if (!handler.begin_array()) {
+        return false;
+    }
+    skip_space();
+    if (position != end && *position == ']') {
+        position ++;
+        return handler.end_array();
+    }
+    while(true) {
+        if (!parse_value(handler, depth + 1)) {
+            return false;
+        }
+        skip_space();
+        if (position == end) {
+            fail();
+        } else if (*position == ',') {
+            position ++;
+        } else if (*position == ']') {
+            position ++;
+            return handler.end_array();
+        } else {
+            fail();
+        }
+    }
+}
+
+bool SaxParser::parse_number(SaxHandler & handler) {
+    const char * start = position;
+    bool negative = false;
+    if (*position == '-') {
+        negative = true;
+        position ++;
+    }
+    if (position == end || !is_digit(*position)) {
+        fail();
+    }
+    // Up to 18 characters always fit in a long long; longer integers are
+    // read as doubles.
+    long long integer = 0;
+    bool is_integer = true;
+    if (*position == '0') {
+        position ++;
+    } else {
+        while (position != end && is_digit(*position)) {
+            if (position - start < 18) {
+                integer = integer * 10 + (*position - '0');
+            } else {
+                is_integer = false;
+            }
+            position ++;
+        }
+    }
+    if (position != end && *position == '.') {
+        is_integer = false;
+        position ++;
+        if (position == end || !is_digit(*position)) {
+            fail();
+        }
+        while (position != end && is_digit(*position)) {
+            position ++;
+        }
+    }
+    if (position != end && (*position == 'e' || *position == 'E')) {
+        is_integer = false;
+        position ++;
+        if (position != end && (*position == '+' || *position == '-')) {
+            position ++;
+        }
+        if (position == end || !is_digit(*position)) {
+            fail();
+        }
+        while (position != end && is_digit(*position)) {
+            position ++;
+        }
+    }
+    if (is_integer) {
+        return handler.int_value(negative ? -integer : integer);
+    }
+
+    // strtod needs a zero at the end, which the text may lack.
+    const size_t length = position - start;
+    char small[64];
+    string large;
+    const char * number_text;
+    if (length < sizeof(small)) {
+        memcpy(small, start, length);
+        small[length] = '\0';
+        number_text = small;
+    } else {
+        large.assign(start, length);
+        number_text = large.c_str();
+    }
+    return handler.double_value(strtod(number_text, 0));
+}
+
+bool SaxParser::parse_object(SaxHandler & handler, int depth) {
+    position ++;
+    if (!handler.begin_object()) {
+        return false;
+    }
+    skip_space();
+    if (position != end && *position == '}') {
+        position ++;
+        return handler.end_object();
+    }
+    while(true) {
+        skip_space();
+        if (position == end || (*position != '"' && *position != '\'')) {
+            fail();
+        }
+        const SaxHandler::KeyAction action = handler.key(parse_string());
+        skip_space();
+        if (position == end || *position != ':') {
+            fail();
+        }
+        position ++;
+        if (action == SaxHandler::READ) {
+            if (!parse_value(handler, depth + 1)) {
+                return false;
+            }
+        } else if (action == SaxHandler::RAW) {
+            skip_space();
+            const char * start = position;
+            skip_value();
+            if (!handler.raw_value(StringView(start, position - start))) {
+                return false;
+            }
+        } else if (action == SaxHandler::SKIP) {
+            skip_value();
+        } else {
+            return false;
+        }
+        skip_space();
+        if (position == end) {
+            fail();
+        } else if (*position == ',') {
+            position ++;
+        } else if (*position == '}') {
+            position ++;
+            return handler.end_object();
+        } else {
+            fail();
+        }
+    }
+}
+
+StringView SaxParser::parse_string() {
+    const char quote = *position;
+    position ++;
+    const char * start = position;
+    bool escaped = false;
+    while (position != end && *position != quote) {
+        if (*position == '\\') {
+            escaped = true;
+            position ++;
+            if (position == end) {
+                fail();
+            }
+        } else if ((unsigned char) *position < 0x20) {
+            fail();
+        }
+        position ++;
+    }
+    if (position == end) {
+        fail();
+    }
+    const char * const stop = position;
+    position ++;
+    if (!escaped) {
+        return StringView(start, stop - start);
+    }
+    unescaped.resize(stop - start);
+    char * const out = &unescaped[0];
+    const char * written = unescape(start, stop, out);
+    return StringView(out, written - out);
+}
+
+bool SaxParser::parse_value(SaxHandler & handler, int depth) {
+    if (depth > MAX_DEPTH) {
+        fail();
+    }
+    skip_space();
+    if (position == end) {
+        fail();
+    }
+    switch(*position) {
+        case '{':
+            return parse_object(handler, depth);
+        case '[':
+            return parse_array(handler, depth);
+        case '"':
+        case '\'':
+            return handler.string_value(parse_string());
+        case 't':
+            if (end - position < 4 || memcmp(position, "true", 4) != 0) {
+                fail();
+            }
+            position += 4;
+            return handler.bool_value(true);
+        case 'f':
+            if (end - position < 5 || memcmp(position, "false", 5) != 0) {
+                fail();
+            }
+            position += 5;
+            return handler.bool_value(false);
+        case 'n':
+            if (end - position < 4 || memcmp(position, "null", 4) != 0) {
+                fail();
+            }
+            position += 4;
+            return handler.null_value();
+        default:
+            return parse_number(handler);
+    }
+}
+
+void SaxParser::skip_space() {
+    while (position != end && (*position == ' ' || *position == '\n'
+           || *position == '\r' || *position == '\t')) {
+        position ++;
+    }
+}
+
+void SaxParser::skip_value() {
+    skip_space();
+    if (position == end) {
+        fail();
+    }
+    int depth = 0;
+    do {
+        switch(*position) {
+            case '"':
+            case '\'': {
+                const char quote = *position;
+                position ++;
+                while (position != end && *position != quote) {
+                    if (*position == '\\' && ++ position == end) {
+                        fail();
+                    }
+                    position ++;
+                }
+                if (position == end) {
+                    fail();
+                }
+                position ++;
+                break;
+            }
+            case '{':
+            case '[':
+                depth ++;
+                position ++;
+                break;
+            case '}':
+            case ']':
+                if (depth == 0) {
+                    fail();
+                }
+                depth --;
+                position ++;
+                break;
+            case ',':
+            case ' ':
+            case '\n':
+            case '\r':
+            case '\t':
+            case ':':
+                if (depth == 0) {
+                    fail();
+                }
+                position ++;
+                break;
+            default: {
+                // A number or literal; what it holds isn't checked.
+                const char * start = position;
+                while (position != end
+                       && strchr(",:{}[]\"' \n\r\t", *position) == 0) {
+                    position ++;
+                }
+                if (position == start) {
+                    fail();
+                }
+            }
+        }
+    } while (depth > 0 && position != end);
+    if (depth > 0) {
+        fail();
+    }
+}
+
+} } // end namespace
@@ -132,11 +132,21 @@ Process::Process(const CommandList & cmds, bool wait_for_close)
             str << ",";
         }
         str << "}";
-        LOG_DEBUG(str.str().c_str());
+        log.info(str.str());
     #endif
-    int status = posix_spawn(&pid, program_path, &file_actions, NULL,
+    // The daemon blocks the signals it handles through signalfd, and the
+    // child would otherwise inherit that.
+    posix_spawnattr_t attributes;
+    checkEqual0(log, posix_spawnattr_init(&attributes));
+    sigset_t no_signals;
+    sigemptyset(&no_signals);
+    checkEqual0(log, posix_spawnattr_setsigmask(&attributes, &no_signals));
+    checkEqual0(log, posix_spawnattr_setflags(&attributes,
+                                              POSIX_SPAWN_SETSIGMASK));
+    int status = posix_spawn(&pid, program_path, &file_actions, &attributes,
                              new_argv, environ);
     delete_argv(new_argv, new_argv_length);
+    posix_spawnattr_destroy(&attributes);
     posix_spawn_file_actions_destroy(&file_actions);
 
     // Close file descriptors on parent side.
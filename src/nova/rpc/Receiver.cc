@@ -1,19 +1,30 @@
 #include "nova/rpc/receiver.h"
 #include "nova/rpc/amqp.h"
 
+#include <algorithm>
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/format.hpp>
 #include <boost/thread.hpp>
+#include <errno.h>
 #include "nova/guest/GuestException.h"
+#include "nova/json/sax.h"
 #include "nova/Log.h"
+#include <stdlib.h>
 #include <string>
+#include <string.h>
 #include <sstream>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
 
 using boost::format;
 using nova::guest::GuestInput;
 using nova::guest::GuestException;
 using nova::guest::GuestOutput;
-using nova::JsonObject;
-using nova::JsonObjectPtr;
+using nova::json::StringView;
+using nova::JsonWriter;
 using nova::Log;
 using std::string;
 
@@ -21,6 +32,117 @@ namespace nova { namespace rpc {
 
 namespace {
     const char * EMPTY_MESSAGE = "{ \"failure\": null, \"result\":null }";
+
+    // Only this much of each reply is logged.
+    const size_t LOGGED_REPLY_LENGTH = 1024;
+
+    // Replies holding credentials, such as the root password enable_root
+    // makes up, aren't kept anywhere, so a copy handed out again is run
+    // again.
+    inline bool holds_credentials(const string & reply) {
+        return memmem(reply.data(), reply.size(), "password", 8) != 0;
+    }
+
+    /* Picks the parts of a message the Receiver needs out of the body,
+     * passing over the rest, so none of the _context_ fields Nova sends
+     * along are copied anywhere. The arguments are left as text for the
+     * handlers to read. Anything but a string where one is wanted
+     * marks the message malformed. */
+    class EnvelopeReader : public nova::json::SaxHandler {
+
+        public:
+            EnvelopeReader()
+            :   args(), context_timestamp(), depth(0), malformed(false),
+                method(), msg_id(), target(0)
+            {
+            }
+
+            virtual bool begin_array() {
+                return wrong_type();
+            }
+
+            virtual bool begin_object() {
+                if (depth > 0) {
+                    return wrong_type();
+                }
+                depth ++;
+                return true;
+            }
+
+            virtual bool bool_value(bool value) {
+                return wrong_type();
+            }
+
+            virtual bool double_value(double value) {
+                return wrong_type();
+            }
+
+            virtual bool int_value(long long value) {
+                return wrong_type();
+            }
+
+            virtual KeyAction key(const StringView & name) {
+                if (name == "args") {
+                    return RAW;
+                } else if (name == "method") {
+                    target = &method;
+                } else if (name == "_msg_id") {
+                    target = &msg_id;
+                } else if (name == "_context_timestamp") {
+                    target = &context_timestamp;
+                } else {
+                    return SKIP;
+                }
+                return READ;
+            }
+
+            virtual bool raw_value(const StringView & text) {
+                args = text;
+                return true;
+            }
+
+            virtual bool string_value(const StringView & value) {
+                if (target == 0) {
+                    return wrong_type();
+                }
+                *target = value.str();
+                return true;
+            }
+
+            // Points into the message body.
+            StringView args;
+
+            boost::optional<string> context_timestamp;
+            int depth;
+            bool malformed;
+            boost::optional<string> method;
+            boost::optional<string> msg_id;
+
+        private:
+            // Where the value of the last key read goes.
+            boost::optional<string> * target;
+
+            bool wrong_type() {
+                malformed = true;
+                return false;
+            }
+    };
+
+    /* Reads timestamps as Nova writes them, for example
+     * "2011-05-12T19:07:32.123456", in UTC. */
+    boost::optional<double> parse_timestamp(const char * text) {
+        struct tm parts;
+        memset(&parts, 0, sizeof(parts));
+        double seconds = 0;
+        if (sscanf(text, "%d-%d-%d%*c%d:%d:%lf", &parts.tm_year,
+                   &parts.tm_mon, &parts.tm_mday, &parts.tm_hour,
+                   &parts.tm_min, &seconds) != 6) {
+            return boost::none;
+        }
+        parts.tm_year -= 1900;
+        parts.tm_mon -= 1;
+        return timegm(&parts) + seconds;
+    }
 }
 
 
@@ -28,17 +150,37 @@ namespace {
  *- Receiver
  *---------------------------------------------------------------------------*/
 
+ReceiverConfig::ReceiverConfig()
+:   prefetch_count(0),
+    compression_threshold(0),
+    time_budget(0),
+    method_time_budgets(),
+    heartbeat(0),
+    max_reconnect_wait_time(0),
+    fanout_exchange(),
+    priority_topic(),
+    publisher_confirms(false),
+    reply_cache_path(),
+    reply_cache_size(0),
+    shared_topic()
+{
+}
+
 Receiver::Receiver(AmqpConnectionPtr connection, const char * topic,
-                   const char * exchange_name)
-:   connection(connection),
-    last_delivery_tag(-1),
-    last_msg_id(boost::none),
+                   const char * exchange_name, const ReceiverConfig & config,
+                   AmqpTopology * topology)
+:   config(config),
+    connection(connection),
+    fanout_queue(),
     log(),
+    parser(),
     queue(),
     topic(topic)
 {
     queue = connection->new_channel();
-
+    // Messages are parsed before the next one is read, so there's no need to
+    // copy their bodies out of librabbitmq's buffers.
+    queue->set_zero_copy(true);
 
     // Nova seems to declare the following
     // Queues:
@@ -51,25 +193,71 @@ Receiver::Receiver(AmqpConnectionPtr connection, const char * topic,
     // "nova" 'topic'
     // "nova" 'direct"'
 
-    // TODO : Make three extra queues to listen to. :c
-    const char * queue_name = topic;
+    bool declared = false;
+    if (topology != 0 && !topology->empty()) {
+        try {
+            topology->replay(connection);
+            declared = true;
+        } catch(const AmqpException & ae) {
+            log.error2("Could not replay topology, declaring it again: %s",
+                       ae.what());
+        }
+    }
+    if (!declared) {
+        AmqpTopology discovered;
+        declare_queue(topic, exchange_name, discovered);
+        if (!config.priority_topic.empty()) {
+            declare_queue(config.priority_topic.c_str(), exchange_name,
+                          discovered);
+        }
+        if (!config.shared_topic.empty()) {
+            declare_queue(config.shared_topic.c_str(), exchange_name,
+                          discovered);
+        }
+        if (topology != 0) {
+            *topology = discovered;
+        }
+    }
+    // The fanout queue is exclusive to this connection, so it's left out of
+    // the topology and declared afresh under a new name every time.
+    if (!config.fanout_exchange.empty()) {
+        fanout_queue = fanout_queue_name(config.fanout_exchange.c_str());
+        declare_fanout(config.fanout_exchange.c_str());
+    }
 
-    //MB queue->declare_queue(queue_name);
+    // All of the queues are consumed on the same channel. The deliveries
+    // come back as one stream, each tagged with the queue it came from.
+    // There's a single consumer for each for the lifetime of the receiver
+    // so the broker can push messages while we're still working on the
+    // last one.
+    queue->consume(topic, config.prefetch_count);
+    if (!config.priority_topic.empty()) {
+        queue->consume(config.priority_topic.c_str(), config.prefetch_count);
+    }
+    if (!config.shared_topic.empty()) {
+        queue->consume(config.shared_topic.c_str(), config.prefetch_count);
+    }
+    if (!config.fanout_exchange.empty()) {
+        queue->consume(fanout_queue.c_str(), config.prefetch_count);
+    }
+}
 
-    connection->attempt_declare_queue(queue_name);
-    connection->attempt_declare_exchange(exchange_name, "topic");
+Receiver::~Receiver() {
+}
 
-    //queue->declare_exchange(topic, "direct");  //TODO(tim.simpson): Remove?
-    queue->bind_queue_to_exchange(queue_name, exchange_name, queue_name);
+void Receiver::abandon() {
+    connection->abandon();
 }
 
-Receiver::~Receiver() {
+void Receiver::finish_message(const GuestInput & input,
+                              const GuestOutput & output) {
+    finish_message(input, serialize_reply(output));
 }
 
-void Receiver::finish_message(const GuestOutput & output) {
-    queue->ack_message(last_delivery_tag);
+void Receiver::finish_message(const GuestInput & input, const string & msg) {
+    queue->ack_message(input.delivery_tag);
 
-    if (!last_msg_id) {
+    if (!input.msg_id) {
         // No reply necessary.
         log.info("Acknowledged message but will not send reply because "
                  "no _msg_id was given.");
@@ -78,98 +266,258 @@ void Receiver::finish_message(const GuestOutput & output) {
 
     // Send reply.
     string exchange_name_str = str(format("__agent_response_%s")
-                                   % last_msg_id.get());
+                                   % input.msg_id.get());
 
     //const char * const queue_name = last_msg_id.c_str();
-    const char * const exchange_name = last_msg_id.get().c_str();
-    const char * const routing_key = last_msg_id.get().c_str(); //"";
+    const char * const exchange_name = input.msg_id.get().c_str();
+    const char * const routing_key = input.msg_id.get().c_str(); //"";
     // queue_name, exchange_name, and routing_key are all the same.
-    AmqpChannelPtr rtn_ex_channel = connection->new_channel();
-    string msg;
-    if (!output.failure) {
-        msg = str(format("{ \"failure\":null, \"result\":%s }")
-                  % output.result->to_string());
-        //msg = "{ 'failure': null }";
-        //msg = "{\"failure\":null}";
-        JsonObject obj(msg.c_str());
-        msg = obj.to_string();
-    } else {
-        msg = str(format("{\"failure\":{\"exc_type\":\"std::exception\", "
-                         "\"value\":%s, "
-                         "\"traceback\":\"unavailable\" } }")
-                  % JsonData::json_string(output.failure.get().c_str()));
-    }
+    AmqpChannelPtr rtn_ex_channel = connection->acquire_channel();
     Log log;
-    if (msg.find("password") == string::npos) {
-            log.info2("Replying with the following: %s", msg.c_str());
+    // Only what gets logged has to be checked for passwords; a value is
+    // always preceded by its key.
+    const int logged = (int) std::min(msg.size(), LOGGED_REPLY_LENGTH);
+    const char * const more = msg.size() > LOGGED_REPLY_LENGTH ? "..." : "";
+    if (memmem(msg.data(), logged, "password", 8) == 0) {
+        log.info2("Replying with the following: %.*s%s", logged,
+                  msg.data(), more);
     } else {
         log.info2("Replying to message...");
         #ifdef _DEBUG
-            log.info2("(DEBUG) Replying with the following: %s", msg.c_str());
+            log.info2("(DEBUG) Replying with the following: %.*s%s", logged,
+                      msg.data(), more);
         #endif
     }
 
-    rtn_ex_channel->publish(exchange_name, routing_key, msg.c_str());
+    if (config.publisher_confirms) {
+        rtn_ex_channel->enable_confirms();
+    }
+    rtn_ex_channel->set_compression_threshold(config.compression_threshold);
+
+    rtn_ex_channel->queue_message(exchange_name, routing_key, msg.c_str());
 
     // This is like telling Nova "roger."
     log.info2("Replying with empty message: %s", EMPTY_MESSAGE);
-    rtn_ex_channel->publish(exchange_name, routing_key, EMPTY_MESSAGE);
+    rtn_ex_channel->queue_message(exchange_name, routing_key, EMPTY_MESSAGE);
+
+    // Both go out together.
+    rtn_ex_channel->flush();
+
+    if (config.publisher_confirms) {
+        try {
+            rtn_ex_channel->wait_for_confirms();
+        } catch(const AmqpException & ae) {
+            if (ae.code != AmqpException::CHANNEL_CLOSED_BY_BROKER) {
+                throw;
+            }
+            // Most likely the caller gave up and its reply exchange is gone.
+            // Only this channel is lost, so it's dropped rather than the
+            // connection being reset.
+            log.error2("Reply to %s was dropped: %s", exchange_name,
+                       ae.what());
+            return;
+        }
+    }
+
+    // Only gets here if nothing went wrong, so the channel is safe to reuse.
+    connection->release_channel(rtn_ex_channel);
+}
+
+void Receiver::declare_fanout(const char * exchange_name) {
+    connection->attempt_declare_exchange(exchange_name, "fanout");
+    connection->attempt_declare_queue(fanout_queue.c_str(), true, true);
+    queue->bind_queue_to_exchange(fanout_queue.c_str(), exchange_name,
+                                  fanout_queue.c_str());
+}
+
+void Receiver::declare_queue(const char * queue_name,
+                             const char * exchange_name,
+                             AmqpTopology & topology) {
+    topology.add_queue(queue_name,
+                       connection->attempt_declare_queue(queue_name),
+                       false, false);
+    topology.add_exchange(exchange_name, "topic",
+        connection->attempt_declare_exchange(exchange_name, "topic"));
+    queue->bind_queue_to_exchange(queue_name, exchange_name, queue_name);
+    topology.add_binding(queue_name, exchange_name, queue_name);
+}
+
+string Receiver::fanout_queue_name(const char * exchange_name) const {
+    // Nova names these after the topic and a random number. The queue is
+    // exclusive, and the broker may not have noticed the last connection
+    // is gone yet, so each one needs a name of its own.
+    static unsigned long count = 0;
+    return str(format("%s_%s_%d_%d") % exchange_name % topic % getpid()
+               % count ++);
+}
+
+int Receiver::get_socket_fd() const {
+    return connection->get_socket_fd();
+}
+
+bool Receiver::has_buffered_messages() {
+    return queue->has_buffered_data();
+}
+
+string Receiver::serialize_reply(const GuestOutput & output) {
+    // The result is already serialized, so the envelope is written around
+    // it rather than parsing everything back into one object.
+    string msg;
+    if (!output.failure) {
+        const char * const result = output.result ? output.result->to_string()
+                                                  : "null";
+        const size_t result_length = strlen(result);
+        msg.reserve(result_length + 32);
+        msg += "{\"failure\":null,\"result\":";
+        msg.append(result, result_length);
+        msg += '}';
+    } else {
+        const string & failure = output.failure.get();
+        msg.reserve(failure.size() + 80);
+        msg += "{\"failure\":{\"exc_type\":\"std::exception\",\"value\":";
+        JsonWriter::write_string(msg, failure.data(), failure.size());
+        msg += ",\"traceback\":\"unavailable\"}}";
+    }
+    return msg;
+}
+
+void Receiver::service_heartbeat() {
+    connection->service_heartbeat();
+}
+
+boost::optional<double> Receiver::context_deadline(
+    const boost::optional<string> & timestamp, const string & method_name)
+{
+    std::map<string, double>::const_iterator itr =
+        config.method_time_budgets.find(method_name);
+    const double budget = itr != config.method_time_budgets.end()
+                          ? itr->second : config.time_budget;
+    if (budget <= 0) {
+        return boost::none;
+    }
+    if (!timestamp) {
+        return boost::none;
+    }
+    boost::optional<double> sent = parse_timestamp(timestamp.get().c_str());
+    if (!sent) {
+        log.error2("Could not read _context_timestamp %s.",
+                   timestamp.get().c_str());
+        return boost::none;
+    }
+    return sent.get() + budget;
 }
 
-JsonObjectPtr Receiver::_next_message() {
+AmqpQueueMessagePtr Receiver::_next_message(bool wait, GuestInput & input) {
     AmqpQueueMessagePtr msg;
     while(!msg) {
         msg = queue->get_message(topic.c_str());
         if (!msg) {
             log.info("Received an empty message.");
+            if (!wait) {
+                return msg;
+            }
         }
     }
     std::stringstream log_msg;
     log_msg << "Received message "
+        << ", consumer " << msg->consumer_tag
         << ", key " << msg->routing_key
         << ", tag " << msg->delivery_tag
         << ", ex " << msg->exchange
         << ", content_type " << msg->content_type;
-    if (msg->message.find("password") == string::npos) {
-        log_msg << ", message " << msg->message;
+    if (memmem(msg->body(), msg->body_length(), "password", 8) == 0) {
+        log_msg << ", message ";
+        log_msg.write(msg->body(), msg->body_length());
     } else {
         #ifdef _DEBUG
-            log_msg << ", (DEBUG) message " << msg->message;
+            log_msg << ", (DEBUG) message ";
+            log_msg.write(msg->body(), msg->body_length());
         #endif
     }
     log.info(log_msg.str());
-    JsonObjectPtr json_obj(new JsonObject(msg->message.c_str()));
-
-    last_delivery_tag = msg->delivery_tag;
-    return json_obj;
+    input.delivery_tag = msg->delivery_tag;
+    // Consumer tags are the names of the queues.
+    input.high_priority = !config.priority_topic.empty()
+                          && msg->consumer_tag == config.priority_topic;
+    if (msg->timestamp != 0 && !msg->expiration.empty()) {
+        input.deadline = msg->timestamp
+                         + atof(msg->expiration.c_str()) / 1000.0;
+    }
+    return msg;
 }
 
 GuestInput Receiver::next_message() {
+    return _parse_message(true).get();
+}
+
+boost::optional<GuestInput> Receiver::read_message() {
+    return _parse_message(false);
+}
+
+boost::optional<GuestInput> Receiver::_parse_message(bool wait) {
     while(true) {
-        JsonObjectPtr raw;
-        try {
-            raw = _next_message();
-        } catch(const JsonException & je) {
-            log.error2("Message was not JSON! %s", je.what());
-            throw GuestException(GuestException::MALFORMED_INPUT);
+        GuestInput input;
+        AmqpQueueMessagePtr msg = _next_message(wait, input);
+        if (!msg) {
+            return boost::none;
         }
-        try {
-            last_msg_id = raw->get_string("_msg_id");
-        } catch(const JsonException & je) {
-            last_msg_id = boost::none;
+        // A body which couldn't be inflated is left deflated, and there's
+        // nothing to read in it. One which isn't UTF-8 is still read so
+        // whoever sent it can be told.
+        const bool inflated = msg->content_encoding != "deflate";
+        if (inflated && _read_envelope(*msg, input) && msg->valid_utf8) {
+            return input;
         }
-        try {
+        // Sending it back to the broker would only get it handed out
+        // again, so it's answered here and never reaches the dispatcher.
+        _refuse_message(input);
+        if (!wait) {
+            return boost::none;
+        }
+    }
+}
 
-            GuestInput input;
-            input.method_name = raw->get_string("method");
-            input.args = raw->get_object_or_empty("args");
-            return input;
-        } catch(const JsonException & je) {
-            log.error("Json message was malformed.");
-            log.error(raw->to_string());
-            throw GuestException(GuestException::MALFORMED_INPUT);
+bool Receiver::_read_envelope(const AmqpQueueMessage & msg,
+                              GuestInput & input) {
+    EnvelopeReader envelope;
+    try {
+        parser.parse(msg.body(), msg.body_length(), envelope);
+        if (!envelope.malformed && envelope.args.length > 0
+            && envelope.args != "null") {
+            // The parser has already seen it's JSON, so it only has to be
+            // an object.
+            if (envelope.args.data[0] != '{') {
+                throw JsonException(JsonException::TYPE_ERROR_NOT_OBJECT);
+            }
+            input.args_text.assign(envelope.args.data, envelope.args.length);
         }
+    } catch(const JsonException & je) {
+        log.error2("Message was not JSON! %s", je.what());
+        envelope.malformed = true;
     }
+    // Whatever was read before things went wrong says who to answer.
+    input.msg_id = envelope.msg_id;
+    input.method_name = envelope.method.get_value_or("");
+    if (envelope.malformed || !envelope.method) {
+        log.error("Json message was malformed.");
+        return false;
+    }
+    if (input.args_text.empty()) {
+        input.args_text = "{}";
+    }
+    // Casts have nobody waiting on them, so they are always run.
+    if (!input.deadline && input.msg_id) {
+        input.deadline = context_deadline(envelope.context_timestamp,
+                                          input.method_name);
+    }
+    return true;
+}
+
+void Receiver::_refuse_message(const GuestInput & input) {
+    GuestOutput output;
+    output.failure =
+        GuestException(GuestException::MALFORMED_INPUT).what();
+    finish_message(input, output);
 }
 
 
@@ -180,47 +528,111 @@ GuestInput Receiver::next_message() {
 ResilentReceiver::ResilentReceiver(const char * host, int port,
     const char * userid, const char * password, size_t client_memory,
     const char * topic, const char * exchange_name,
-    unsigned long reconnect_wait_time)
+    unsigned long reconnect_wait_time, const ReceiverConfig & config)
 : client_memory(client_memory),
+  config(config),
+  connection_generation(0),
   exchange_name(exchange_name),
   host(host),
+  in_flight(),
+  last_reconnect_seconds(0),
   log(),
   password(password),
   port(port),
+  random_seed(time(0) ^ getpid()),
   receiver(0),
+  reconnected(0),
+  reconnector(),
+  reconnect_failures(0),
+  reconnects(0),
+  reply_cache(config.reply_cache_size, config.reply_cache_path),
+  reset_started(),
   topic(topic),
+  topology(),
   userid(userid),
   reconnect_wait_time(reconnect_wait_time)
 {
-    open(false);
+    if (pipe(reconnect_pipe) < 0) {
+        throw GuestException(GuestException::COULD_NOT_CREATE_PIPE);
+    }
+    Receiver * fresh = 0;
+    try {
+        connect(false, fresh);
+    } catch(...) {
+        ::close(reconnect_pipe[0]);
+        ::close(reconnect_pipe[1]);
+        throw;
+    }
+    receiver.reset(fresh);
+    connection_generation ++;
 }
 
 ResilentReceiver::~ResilentReceiver() {
+    if (receiver.get() == 0) {
+        // Stops it if it's between attempts.
+        reconnector.interrupt();
+        reconnector.join();
+        delete reconnected;
+    }
     close();
+    ::close(reconnect_pipe[0]);
+    ::close(reconnect_pipe[1]);
 }
 
 void ResilentReceiver::close() {
     receiver.reset(0);
 }
 
-void ResilentReceiver::finish_message(const GuestOutput & output) {
-    while(true) {
-        try {
-            log.info("Finishing message.");
-            receiver->finish_message(output);
-            return;
-        } catch(const AmqpException & amqpe) {
-            log.error2("Error with AMQP connection! : %s", amqpe.what());
-            reset();
-        }
+void ResilentReceiver::finish_message(const GuestInput & input,
+                                      const GuestOutput & output) {
+    const string reply = Receiver::serialize_reply(output);
+    if (!input.msg_id) {
+        send_reply(input, reply);
+        return;
+    }
+    // Taken out first so nothing below can leave it behind.
+    std::vector<GuestInput> copies;
+    std::map<string, std::vector<GuestInput> >::iterator itr =
+        in_flight.find(input.msg_id.get());
+    if (itr != in_flight.end()) {
+        copies.swap(itr->second);
+        in_flight.erase(itr);
+    }
+    // Remembered even if it can't be sent, so the copy the broker hands out
+    // next time gets it.
+    if (!holds_credentials(reply)) {
+        reply_cache.put(input.msg_id.get(), reply);
+    }
+    send_reply(input, reply);
+    BOOST_FOREACH(const GuestInput & copy, copies) {
+        send_reply(copy, reply);
     }
 }
 
+int ResilentReceiver::get_socket_fd() const {
+    if (receiver.get() == 0) {
+        return reconnect_pipe[0];
+    }
+    return receiver->get_socket_fd();
+}
+
+bool ResilentReceiver::has_buffered_messages() {
+    return receiver.get() != 0 && receiver->has_buffered_messages();
+}
+
 GuestInput ResilentReceiver::next_message() {
     while(true) {
+        if (receiver.get() == 0) {
+            finish_reconnect(true);
+            continue;
+        }
         try {
             log.info("Waiting for next message...");
-            return receiver->next_message();
+            GuestInput input = receiver->next_message();
+            input.connection_generation = connection_generation;
+            if (!take_care_of_copy(input)) {
+                return input;
+            }
         } catch(const AmqpException & amqpe) {
             log.error2("Error with AMQP connection! : %s", amqpe.what());
             reset();
@@ -228,30 +640,177 @@ GuestInput ResilentReceiver::next_message() {
     }
 }
 
-void ResilentReceiver::open(bool wait_first) {
-    while(receiver.get() == 0) {
+boost::optional<GuestInput> ResilentReceiver::read_message() {
+    if (receiver.get() == 0) {
+        finish_reconnect(false);
+        return boost::none;
+    }
+    try {
+        boost::optional<GuestInput> input = receiver->read_message();
+        if (input) {
+            input->connection_generation = connection_generation;
+            if (take_care_of_copy(input.get())) {
+                return boost::none;
+            }
+        }
+        return input;
+    } catch(const AmqpException & amqpe) {
+        log.error2("Error with AMQP connection! : %s", amqpe.what());
+        reset();
+        return boost::none;
+    }
+}
+
+void ResilentReceiver::connect(bool wait_first, Receiver * & result) {
+    for (unsigned int attempt = 0; true; attempt ++) {
         try {
-            if (wait_first) {
-                log.info("Waiting to create fresh AMQP connection...");
-                boost::posix_time::seconds time(reconnect_wait_time);
-                boost::this_thread::sleep(time);
+            if (wait_first || attempt > 0) {
+                double wait = next_wait_time(wait_first ? attempt
+                                                        : attempt - 1);
+                log.info2("Waiting %.2f seconds to create fresh AMQP "
+                          "connection...", wait);
+                boost::this_thread::sleep(boost::posix_time::milliseconds(
+                    (long) (wait * 1000)));
             }
             AmqpConnectionPtr connection =
                 AmqpConnection::create(host.c_str(), port, userid.c_str(),
-                    password.c_str(), client_memory);
-            receiver.reset(new Receiver(connection, topic.c_str(),
-                                        exchange_name.c_str()));
+                    password.c_str(), client_memory, config.heartbeat);
+            result = new Receiver(connection, topic.c_str(),
+                                  exchange_name.c_str(), config, &topology);
             return;
         } catch(const AmqpException & amqpe) {
             log.error2("Error establishing AMQP connection: %s", amqpe.what());
-            wait_first = true;
+            reconnect_failures ++;
         }
     }
 }
 
+void ResilentReceiver::connect_in_background() {
+    try {
+        connect(true, reconnected);
+    } catch(const std::exception & e) {
+        log.error2("Error connecting in the background: %s", e.what());
+    }
+    if (write(reconnect_pipe[1], "!", 1) < 0) {
+        log.error2("Could not write to the reconnect pipe: %s",
+                   strerror(errno));
+    }
+}
+
+bool ResilentReceiver::finish_reconnect(bool wait) {
+    struct pollfd poll_fd;
+    poll_fd.fd = reconnect_pipe[0];
+    poll_fd.events = POLLIN;
+    if (poll(&poll_fd, 1, wait ? -1 : 0) <= 0) {
+        return false;
+    }
+    char done;
+    if (read(reconnect_pipe[0], &done, 1) < 0) {
+        log.error2("Could not read from the reconnect pipe: %s",
+                   strerror(errno));
+    }
+    reconnector.join();
+    Receiver * fresh = reconnected;
+    reconnected = 0;
+    if (fresh == 0) {
+        // Whatever went wrong was logged on the other thread.
+        reconnector = boost::thread(boost::bind(
+            &ResilentReceiver::connect_in_background, this));
+        return false;
+    }
+    receiver.reset(fresh);
+    connection_generation ++;
+    reconnects ++;
+    last_reconnect_seconds = (boost::posix_time::microsec_clock::universal_time()
+                              - reset_started).total_milliseconds() / 1000.0;
+    log.info2("Reconnected in %.2f seconds (%lu reconnects, %lu failed "
+              "attempts so far).", last_reconnect_seconds, reconnects,
+              reconnect_failures);
+    return true;
+}
+
+double ResilentReceiver::next_wait_time(unsigned int attempt) {
+    const double cap = std::max(reconnect_wait_time,
+                                config.max_reconnect_wait_time);
+    double ceiling = reconnect_wait_time;
+    for (unsigned int i = 0; i < attempt && ceiling < cap; i ++) {
+        ceiling *= 2;
+    }
+    ceiling = std::min(ceiling, cap);
+    return ceiling * (rand_r(&random_seed) / (RAND_MAX + 1.0));
+}
+
 void ResilentReceiver::reset() {
+    if (receiver.get() == 0) {
+        return;
+    }
+    reset_started = boost::posix_time::microsec_clock::universal_time();
+    // Whatever went wrong, the broker can't be relied on to answer a
+    // close, so nothing is said to it.
+    receiver->abandon();
     close();
-    open(true);
+    // Anything read off the old connection can't be acknowledged now.
+    connection_generation ++;
+    reconnector = boost::thread(boost::bind(
+        &ResilentReceiver::connect_in_background, this));
+}
+
+void ResilentReceiver::send_reply(const GuestInput & input,
+                                  const string & reply) {
+    while(true) {
+        if (input.connection_generation != connection_generation) {
+            // The delivery tag belongs to a connection that's gone. The
+            // broker will hand the message out again, so there's nothing
+            // useful left to do with it.
+            log.error2("Dropping result of %s as the connection it arrived "
+                       "on was lost.", input.method_name.c_str());
+            return;
+        }
+        try {
+            log.info("Finishing message.");
+            receiver->finish_message(input, reply);
+            return;
+        } catch(const AmqpException & amqpe) {
+            log.error2("Error with AMQP connection! : %s", amqpe.what());
+            reset();
+        }
+    }
+}
+
+void ResilentReceiver::service_heartbeat() {
+    if (receiver.get() == 0) {
+        return;
+    }
+    try {
+        receiver->service_heartbeat();
+    } catch(const AmqpException & amqpe) {
+        log.error2("Error with AMQP connection! : %s", amqpe.what());
+        reset();
+    }
+}
+
+bool ResilentReceiver::take_care_of_copy(const GuestInput & input) {
+    if (!input.msg_id) {
+        return false;
+    }
+    const string & msg_id = input.msg_id.get();
+    boost::optional<string> reply = reply_cache.get(msg_id);
+    if (reply) {
+        log.info2("Answering %s for message %s with the cached reply.",
+                  input.method_name.c_str(), msg_id.c_str());
+        receiver->finish_message(input, reply.get());
+        return true;
+    }
+    std::map<string, std::vector<GuestInput> >::iterator itr =
+        in_flight.find(msg_id);
+    if (itr != in_flight.end()) {
+        log.info2("Message %s is already being worked on, it will get the "
+                  "same reply.", msg_id.c_str());
+        itr->second.push_back(input);
+        return true;
+    }
+    in_flight[msg_id];
+    return false;
 }
 
 } }  // end namespace
@@ -1,19 +1,48 @@
 #include "nova/json.h"
 #include "nova/rpc/sender.h"
 #include "nova/rpc/amqp.h"
+#include <boost/bind.hpp>
+#include <pthread.h>
+#include <signal.h>
 #include <sstream>
 
 
 using nova::JsonObjectPtr;
 using namespace nova::rpc;
+using nova::utils::RingBuffer;
+using std::string;
 
 
-Sender::Sender(AmqpConnectionPtr connection, const char * topic)
-:   exchange(),
+SenderConfig::SenderConfig()
+:   async(false),
+    batch_size(64),
+    drain_timeout(5),
+    overflow_policy(DROP_OLDEST),
+    queue_capacity(1024)
+{
+}
+
+Sender::Sender(AmqpConnectionPtr connection, const char * topic,
+               const SenderConfig & config)
+:   config(config),
+    connection(connection),
+    dropped_count(0),
+    exchange(),
     exchange_name("nova"),
+    failed(false),
     log(),
+    mutex(),
+    queue(),
     queue_name(topic),
-    routing_key(topic)
+    queued_count(0),
+    routing_key(topic),
+    sent_count(0),
+    space_available(),
+    sleeping(false),
+    stopping(false),
+    thread(),
+    waiting_senders(0),
+    work_available()
 {
     exchange = connection->new_channel();
 
@@ -27,14 +56,160 @@ Sender::Sender(AmqpConnectionPtr connection, const char * topic)
                                routing_key.c_str());
     log.debug("Creating exchange channel.");
     exchange = connection->new_channel();
+
+    if (config.async) {
+        queue.reset(new RingBuffer<string>(config.queue_capacity));
+        thread.reset(new boost::thread(
+            boost::bind(&Sender::background_loop, this)));
+    }
 }
 
 Sender::~Sender() {
+    if (thread.get() != 0) {
+        {
+            boost::lock_guard<boost::mutex> lock(mutex);
+            stopping = true;
+            work_available.notify_one();
+        }
+        const boost::posix_time::time_duration drain_time =
+            boost::posix_time::milliseconds(
+                (long) (config.drain_timeout * 1000));
+        if (!thread->timed_join(drain_time)) {
+            log.error2("Gave up on queued messages after %.1f seconds.",
+                       config.drain_timeout);
+            failed = true;
+            // A publish stuck on a broker that stopped answering only
+            // returns once the socket is gone.
+            connection->abandon();
+            thread->join();
+        }
+    }
+}
+
+void Sender::background_loop() {
+    // Publishing to a broker that's gone, or after the destructor abandons
+    // the connection, then fails with EPIPE instead of killing the process.
+    sigset_t pipe_signal;
+    sigemptyset(&pipe_signal);
+    sigaddset(&pipe_signal, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_signal, 0);
+
+    string message;
+    while(true) {
+        size_t batch = 0;
+        if (failed) {
+            // Nothing can go out, but the queue is still emptied so no
+            // send waits on room forever.
+            while (queue->try_pop(message)) {
+                batch ++;
+            }
+            __sync_fetch_and_add(&dropped_count, batch);
+        } else {
+            try {
+                while (batch < config.batch_size
+                       && queue->try_pop(message)) {
+                    exchange->queue_message(exchange_name.c_str(),
+                                            routing_key.c_str(),
+                                            message.c_str());
+                    batch ++;
+                }
+                if (batch > 0) {
+                    exchange->flush();
+                    __sync_fetch_and_add(&sent_count, batch);
+                }
+            } catch(const std::exception & e) {
+                log.error2("Could not publish %d queued messages: %s",
+                           (int) batch, e.what());
+                __sync_fetch_and_add(&dropped_count, batch);
+                reopen_channel();
+            }
+        }
+        if (batch > 0) {
+            if (__sync_fetch_and_add(&waiting_senders, 0) > 0) {
+                boost::lock_guard<boost::mutex> lock(mutex);
+                space_available.notify_all();
+            }
+            continue;
+        }
+
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (stopping) {
+            return;
+        }
+        sleeping = true;
+        // Pairs with the barrier in send, so either this sees the new
+        // message or send sees that it has to wake us.
+        __sync_synchronize();
+        if (queue->empty()) {
+            work_available.wait(lock);
+        }
+        sleeping = false;
+    }
+}
+
+unsigned long Sender::get_dropped_count() const {
+    return dropped_count;
+}
+
+unsigned long Sender::get_queued_count() const {
+    return queued_count;
+}
+
+unsigned long Sender::get_sent_count() const {
+    return sent_count;
+}
+
+bool Sender::has_failed() const {
+    return failed;
+}
+
+void Sender::reopen_channel() {
+    // Whatever went wrong may have left the channel closed.
+    exchange.reset();
+    try {
+        exchange = connection->new_channel();
+    } catch(const std::exception & e) {
+        log.error2("Could not reopen the channel, so nothing more will be "
+                   "published: %s", e.what());
+        failed = true;
+    }
 }
 
 void Sender::send(const char * publish_string) {
-    exchange->publish(exchange_name.c_str(), routing_key.c_str(),
-                      publish_string);
+    if (!config.async) {
+        exchange->publish(exchange_name.c_str(), routing_key.c_str(),
+                          publish_string);
+        return;
+    }
+
+    const string message(publish_string);
+    bool pushed = queue->try_push(message);
+    while (!pushed) {
+        if (config.overflow_policy == SenderConfig::DROP_OLDEST) {
+            string oldest;
+            if (queue->try_pop(oldest)) {
+                __sync_fetch_and_add(&dropped_count, 1);
+            }
+            pushed = queue->try_push(message);
+        } else {
+            // Counting ourselves as waiting before trying again means the
+            // background thread can't free up room without waking us.
+            boost::unique_lock<boost::mutex> lock(mutex);
+            __sync_fetch_and_add(&waiting_senders, 1);
+            pushed = queue->try_push(message);
+            if (!pushed) {
+                space_available.wait(lock);
+            }
+            __sync_fetch_and_sub(&waiting_senders, 1);
+        }
+    }
+    __sync_fetch_and_add(&queued_count, 1);
+
+    __sync_synchronize();
+    if (sleeping) {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        work_available.notify_one();
+    }
 }
 
 void Sender::send(const JsonObject & publish_object) {
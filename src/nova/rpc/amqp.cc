@@ -1,10 +1,12 @@
 #include "nova/rpc/amqp.h"
 #include <algorithm>
 #include <boost/foreach.hpp>
+#include "nova/utils/text.h"
 //#include "nova/utils/io.h"
 #include <limits>
 #include <sstream>
 #include <string.h>
+#include <zlib.h>
 
 // For SIGPIPE ignoring
 #include <errno.h>
@@ -12,9 +14,87 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 
+// For TCP_CORK
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+// For heartbeats
+#include <poll.h>
+#include <time.h>
+
 
 namespace nova { namespace rpc {
 
+namespace {
+    /* Most replies only need a single channel, so keep the pool small. */
+    const size_t MAX_POOLED_CHANNELS = 4;
+
+    /* Low numbers are skipped to stay out of the way of anything else
+     * sharing the connection. AMQP channel numbers are 16 bits wide. */
+    const int FIRST_CHANNEL_NUMBER = 10;
+    const int LAST_CHANNEL_NUMBER = 65535;
+
+    /* A broker is given up on after this many heartbeat intervals of
+     * silence, which is what the AMQP spec suggests. */
+    const double MISSED_HEARTBEAT_LIMIT = 2.0;
+
+    double now() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+    }
+
+    /* The content encoding of bodies squeezed with zlib. */
+    const char * const DEFLATE = "deflate";
+
+    bool deflate_body(const char * body, size_t length, std::string & out) {
+        uLongf out_length = compressBound(length);
+        out.resize(out_length);
+        if (compress2((Bytef *) &out[0], &out_length, (const Bytef *) body,
+                      length, Z_BEST_SPEED) != Z_OK) {
+            return false;
+        }
+        out.resize(out_length);
+        return true;
+    }
+
+    /* Inflated bodies may be at most this many frames long, which keeps a
+     * small message from ballooning into all of memory. */
+    const size_t MAX_INFLATED_FRAMES = 1024;
+
+    /* The frame size assumed when none was asked for at login. */
+    const size_t DEFAULT_FRAME_MAX = 131072;
+
+    /* Fails if the body is not valid zlib data or would inflate to more
+     * than limit bytes. */
+    bool inflate_body(const char * body, size_t length, size_t limit,
+                      std::string & out) {
+        z_stream stream;
+        memset(&stream, 0, sizeof(stream));
+        if (inflateInit(&stream) != Z_OK) {
+            return false;
+        }
+        stream.next_in = (Bytef *) body;
+        stream.avail_in = length;
+        // JSON usually shrinks by several times.
+        out.resize(std::min(std::max(length * 4, (size_t) 1024), limit));
+        int result = Z_OK;
+        while(result == Z_OK) {
+            if (stream.total_out == out.size()) {
+                if (out.size() == limit) {
+                    break;
+                }
+                out.resize(std::min(out.size() * 2, limit));
+            }
+            stream.next_out = (Bytef *) &out[stream.total_out];
+            stream.avail_out = out.size() - stream.total_out;
+            result = inflate(&stream, Z_NO_FLUSH);
+        }
+        out.resize(stream.total_out);
+        inflateEnd(&stream);
+        return result == Z_STREAM_END;
+    }
+}
 
 /**---------------------------------------------------------------------------
  *- AmqpException
@@ -36,12 +116,16 @@ const char * AmqpException::what() const throw() {
                    "in the header.";
         case BODY_EXPECTED:
             return "Body expected in message but unseen!";
+        case CHANNEL_CLOSED_BY_BROKER:
+            return "The broker closed the channel.";
         case CLOSE_CHANNEL_FAILED:
             return "Could not close channel.";
         case CLOSE_CONNECTION_FAILED:
             return "Could not close connection.";
         case CONNECTION_FAILED:
             return "Connection failed.";
+        case CONFIRM_SELECT_FAILED:
+            return "Could not turn on publisher confirms.";
         case CONSUME:
             return "Consume failed.";
         case DECLARE_QUEUE_FAILURE:
@@ -50,14 +134,22 @@ const char * AmqpException::what() const throw() {
             return "Failed to destroy connection.";
         case EXCHANGE_DECLARE_FAIL:
             return "Exchange declare fail.";
+        case FRAME_WAIT_TIMED_OUT:
+            return "Nothing was heard from the broker for too long.";
         case HEADER_EXPECTED:
             return "A header was expected in a message but unseen!";
         case LOGIN_FAILED:
             return "Login failed!";
+        case NO_FREE_CHANNELS:
+            return "All channel numbers are in use.";
         case OPEN_CHANNEL_FAILED:
             return "Failed to open channel.";
         case PUBLISH_FAILURE:
             return "Error publishing message.";
+        case PUBLISH_NOT_CONFIRMED:
+            return "The broker did not accept a published message.";
+        case SET_QOS_FAILED:
+            return "Could not set the prefetch window of the channel.";
         case WAIT_FRAME_FAILED:
             return "Error while waiting for the next frame of a message.";
         default:
@@ -88,9 +180,12 @@ void intrusive_ptr_release(AmqpConnection * ref) {
 
 AmqpConnection::AmqpConnection(const char * host_name, const int port,
                                const char * user_name, const char * password,
-                               size_t client_memory)
-: bad_channels(), channels(), connection(0), log(), reference_count(0),
-  sockfd(-1)
+                               size_t client_memory, int heartbeat)
+: broker_lost(false), channel_pool(), channels(), channels_opened(0),
+  channels_reused(0), client_memory(client_memory), connection(0),
+  free_channel_numbers(),
+  heartbeat(heartbeat), last_heartbeat_sent(0), last_received(0), log(),
+  next_channel_number(FIRST_CHANNEL_NUMBER), reference_count(0), sockfd(-1)
 {
     // Create connection.
     connection = amqp_new_connection();
@@ -105,9 +200,12 @@ AmqpConnection::AmqpConnection(const char * host_name, const int port,
         amqp_set_sockfd(connection, sockfd);
 
         // Login
-        amqp_check(amqp_login(connection, "/", 0, client_memory, 0,
+        // The heartbeat goes out in tune-ok, so the broker will expect
+        // one from us at least that often and send its own as well.
+        amqp_check(amqp_login(connection, "/", 0, client_memory, heartbeat,
                               AMQP_SASL_METHOD_PLAIN, user_name, password),
                    AmqpException::LOGIN_FAILED);
+        last_heartbeat_sent = last_received = now();
     } catch(const AmqpException & amqpe) {
         if (amqp_destroy_connection(connection) < 0) {
             log.error("FATAL ERROR: COULD NOT DESTROY OPEN AMQP CONNECTION!");
@@ -133,14 +231,31 @@ void AmqpConnection::check_references(AmqpConnection * ref) {
     ref->log.debug("Checking the references to AmqpConnection, which has "
                    "a reference_count of %d and owns %d channels.",
                    ref->reference_count, ref->channels.size());
+    if (ref->reference_count <= 0 && !ref->channel_pool.empty()) {
+        // Nobody can acquire the pooled channels anymore, so let them go.
+        // Each release calls back into this method, and the last one deletes
+        // the connection, so "ref" must not be touched after this.
+        std::vector<AmqpChannelPtr> pooled;
+        pooled.swap(ref->channel_pool);
+        return;
+    }
     if (ref->reference_count <= 0 && ref->channels.size() <= 0) {
         delete ref;
     }
 }
 
+void AmqpConnection::abandon() {
+    broker_lost = true;
+    if (shutdown(sockfd, SHUT_RDWR) < 0) {
+        log.error2("Could not shut down the socket: %s", strerror(errno));
+    }
+}
+
 void AmqpConnection::close() {
-    amqp_check(amqp_connection_close(connection, AMQP_REPLY_SUCCESS),
-               AmqpException::CLOSE_CONNECTION_FAILED);
+    if (!broker_lost) {
+        amqp_check(amqp_connection_close(connection, AMQP_REPLY_SUCCESS),
+                   AmqpException::CLOSE_CONNECTION_FAILED);
+    }
     if (amqp_destroy_connection(connection) < 0) {
         throw AmqpException(AmqpException::DESTROY_CONNECTION);
     }
@@ -149,24 +264,27 @@ void AmqpConnection::close() {
 AmqpConnectionPtr AmqpConnection::create(const char * host_name, const int port,
                                          const char * user_name,
                                          const char * password,
-                                         size_t client_memory) {
+                                         size_t client_memory,
+                                         int heartbeat) {
     AmqpConnectionPtr ptr(new AmqpConnection(host_name, port,
                                              user_name, password,
-                                             client_memory));
+                                             client_memory, heartbeat));
     return ptr;
 }
 
-void AmqpConnection::attempt_declare_exchange(const char * exchange_name,
+bool AmqpConnection::attempt_declare_exchange(const char * exchange_name,
                                               const char * type) {
     AmqpChannelPtr channel = new_channel();
     log.info2("Attempting to declare exchange %s.", exchange_name);
     try {
         channel->declare_exchange(exchange_name, type, true);
         log.info("Exchange already declared.");
+        return true;
     } catch(const AmqpException & ae) {
         if (ae.code == AmqpException::EXCHANGE_DECLARE_FAIL) {
             log.info("Could not passive declare exchange. Trying non-passive.");
             new_channel()->declare_exchange(exchange_name, type, false);
+            return false;
         } else {
             log.error("AmqpException was thrown trying to declare exchange.");
             throw ae;
@@ -174,7 +292,7 @@ void AmqpConnection::attempt_declare_exchange(const char * exchange_name,
     }
 }
 
-void AmqpConnection::attempt_declare_queue(const char * queue_name,
+bool AmqpConnection::attempt_declare_queue(const char * queue_name,
                                            bool exclusive,
                                            bool auto_delete) {
     AmqpChannelPtr channel = new_channel();
@@ -182,11 +300,14 @@ void AmqpConnection::attempt_declare_queue(const char * queue_name,
     try {
         channel->declare_queue(queue_name, true);
         log.info2("Queue already declared.");
+        return true;
     } catch(const AmqpException & ae) {
         if (ae.code == AmqpException::DECLARE_QUEUE_FAILURE) {
             log.info2("Could not declare queue %s. Trying non-passive.",
                       queue_name);
-            new_channel()->declare_queue(queue_name, false);
+            new_channel()->declare_queue(queue_name, false, exclusive,
+                                         auto_delete);
+            return false;
         } else {
             log.error("AmqpException was thrown trying to declare queue.");
             throw ae;
@@ -194,47 +315,203 @@ void AmqpConnection::attempt_declare_queue(const char * queue_name,
     }
 }
 
+void AmqpConnection::confirm_channel_close(int channel_number) {
+    amqp_channel_close_ok_t close_ok;
+    if (amqp_send_method(connection, channel_number,
+                         AMQP_CHANNEL_CLOSE_OK_METHOD, &close_ok) < 0) {
+        log.error2("Could not confirm close of channel #%d.", channel_number);
+        throw AmqpException(AmqpException::CLOSE_CHANNEL_FAILED);
+    }
+}
+
 void AmqpConnection::mark_channel_as_bad(AmqpChannel * channel) {
-    bad_channels.push_back(channel->get_channel_number());
-}
-
-int AmqpConnection::new_channel_number() const {
-    bool found=false;
-    int number = 10;
-    while(!found) {
-        found = true;
-        BOOST_FOREACH(int bad_channel, bad_channels) {
-            if (bad_channel == number) {
-                found = false;
-                number ++;
-                break;
-            }
+    channel->is_bad = true;
+}
+
+int AmqpConnection::new_channel_number() {
+    if (!free_channel_numbers.empty()) {
+        int number = free_channel_numbers.back();
+        free_channel_numbers.pop_back();
+        return number;
+    }
+    if (next_channel_number > LAST_CHANNEL_NUMBER) {
+        throw AmqpException(AmqpException::NO_FREE_CHANNELS);
+    }
+    return next_channel_number ++;
+}
+
+void AmqpConnection::release_channel_number(int number) {
+    free_channel_numbers.push_back(number);
+}
+
+void AmqpConnection::service_heartbeat() {
+    if (heartbeat <= 0) {
+        return;
+    }
+    double time = now();
+    if (time - last_received >= heartbeat * MISSED_HEARTBEAT_LIMIT) {
+        log.error2("No word from the broker in %d seconds.",
+                   (int) (time - last_received));
+        broker_lost = true;
+        throw AmqpException(AmqpException::FRAME_WAIT_TIMED_OUT);
+    }
+    if (time - last_heartbeat_sent >= heartbeat / 2.0) {
+        amqp_frame_t frame;
+        frame.frame_type = AMQP_FRAME_HEARTBEAT;
+        frame.channel = 0;
+        if (amqp_send_frame(connection, &frame) < 0) {
+            broker_lost = true;
+            throw AmqpException(AmqpException::WAIT_FRAME_FAILED);
         }
-        if (found == true) {
-            BOOST_FOREACH(const AmqpChannel * const channel, channels) {
-                if (channel->get_channel_number() == number) {
-                    found = false;
-                    number ++;
-                    break;
-                }
+        last_heartbeat_sent = time;
+    }
+}
+
+void AmqpConnection::wait_frame(amqp_frame_t & frame,
+                                bool return_heartbeats) {
+    while(true) {
+        if (heartbeat > 0 && !amqp_frames_enqueued(connection)
+            && !amqp_data_in_buffer(connection)) {
+            // Don't block in librabbitmq for longer than it takes for the
+            // next heartbeat to come due.
+            service_heartbeat();
+            struct pollfd poll_fd;
+            poll_fd.fd = sockfd;
+            poll_fd.events = POLLIN;
+            int timeout_ms = (int) (heartbeat * 1000 / 2);
+            int result = poll(&poll_fd, 1, timeout_ms);
+            if (result < 0 && errno != EINTR) {
+                broker_lost = true;
+                throw AmqpException(AmqpException::WAIT_FRAME_FAILED);
             }
+            if (result <= 0) {
+                continue;
+            }
+        }
+        if (amqp_simple_wait_frame(connection, &frame) < 0) {
+            broker_lost = true;
+            throw AmqpException(AmqpException::WAIT_FRAME_FAILED);
+        }
+        last_received = now();
+        if (frame.frame_type != AMQP_FRAME_HEARTBEAT || return_heartbeats) {
+            return;
         }
     }
-    return number;
 }
 
 AmqpChannelPtr AmqpConnection::new_channel() {
-    AmqpChannel * new_instance = new AmqpChannel(this, new_channel_number());
+    int number = new_channel_number();
+    AmqpChannel * new_instance;
+    try {
+        new_instance = new AmqpChannel(this, number);
+    } catch(...) {
+        // The channel never opened, or the broker closed it, so the number
+        // can be handed out again.
+        release_channel_number(number);
+        throw;
+    }
     channels.push_back(new_instance);
+    channels_opened ++;
     AmqpChannelPtr ptr(new_instance);
     return ptr;
 }
 
+AmqpChannelPtr AmqpConnection::acquire_channel() {
+    while (!channel_pool.empty()) {
+        AmqpChannelPtr ptr = channel_pool.back();
+        channel_pool.pop_back();
+        if (ptr->is_open) {
+            channels_reused ++;
+            return ptr;
+        }
+    }
+    return new_channel();
+}
+
+void AmqpConnection::release_channel(AmqpChannelPtr channel) {
+    if (channel->is_open && !channel->consuming
+        && channel_pool.size() < MAX_POOLED_CHANNELS) {
+        channel_pool.push_back(channel);
+    }
+    log.debug("Channels opened: %lu, reused: %lu.", channels_opened,
+              channels_reused);
+}
+
+void AmqpConnection::dispatch_frame(const amqp_frame_t & frame) {
+    if (frame.frame_type == AMQP_FRAME_HEARTBEAT) {
+        return;
+    }
+    if (frame.frame_type != AMQP_FRAME_METHOD) {
+        log.debug("Ignoring frame of type %d on channel #%d.",
+                  (int) frame.frame_type, (int) frame.channel);
+        return;
+    }
+    AmqpChannel * channel = find_channel(frame.channel);
+    switch(frame.payload.method.id) {
+        case AMQP_CHANNEL_CLOSE_METHOD:
+            on_channel_closed_by_broker(frame.channel);
+            break;
+        case AMQP_BASIC_ACK_METHOD:
+            if (channel != 0) {
+                amqp_basic_ack_t * ack = (amqp_basic_ack_t *)
+                    frame.payload.method.decoded;
+                channel->on_confirm(ack->delivery_tag, ack->multiple != 0,
+                                    false);
+            }
+            break;
+        case AMQP_BASIC_NACK_METHOD:
+            if (channel != 0) {
+                amqp_basic_nack_t * nack = (amqp_basic_nack_t *)
+                    frame.payload.method.decoded;
+                channel->on_confirm(nack->delivery_tag, nack->multiple != 0,
+                                    true);
+            }
+            break;
+        case AMQP_BASIC_DELIVER_METHOD:
+            if (channel != 0) {
+                // Read the rest of the message now, or its content frames
+                // would be mistaken for someone else's.
+                AmqpQueueMessagePtr msg = channel->read_delivery(frame, false);
+                channel->deliveries.push_back(msg);
+            } else {
+                log.error2("Delivery for unknown channel #%d dropped.",
+                           (int) frame.channel);
+            }
+            break;
+        default:
+            log.debug("Ignoring method 0x%08x on channel #%d.",
+                      (unsigned int) frame.payload.method.id,
+                      (int) frame.channel);
+    }
+}
+
+AmqpChannel * AmqpConnection::find_channel(int channel_number) {
+    BOOST_FOREACH(AmqpChannel * channel, channels) {
+        if (channel->get_channel_number() == channel_number) {
+            return channel;
+        }
+    }
+    return 0;
+}
+
+void AmqpConnection::on_channel_closed_by_broker(int channel_number) {
+    log.error2("Broker closed channel #%d.", channel_number);
+    confirm_channel_close(channel_number);
+    BOOST_FOREACH(AmqpChannel * channel, channels) {
+        if (channel->get_channel_number() == channel_number) {
+            channel->is_open = false;
+        }
+    }
+}
+
 void AmqpConnection::remove_channel(AmqpChannel * channel) {
     for (std::vector<AmqpChannel *>::iterator itr = channels.begin();
          itr != channels.end(); itr ++) {
         if (*itr == channel) {
             channels.erase(itr);
+            // A bad channel which was still open gets its number back if the
+            // broker confirms the close below.
+            bool confirmed = channel->is_open;
             // A try / catch is necessary here because this method is called by
             // the smart pointer release function, which could be used very
             // naturually in a destructor of some class.
@@ -243,6 +520,14 @@ void AmqpConnection::remove_channel(AmqpChannel * channel) {
             } catch(const AmqpException & ae) {
                 log.error("AmqpException during channel close, removing anyway.");
                 log.error(ae.what());
+                confirmed = false;
+            }
+            if (!channel->is_bad || confirmed) {
+                release_channel_number(channel->get_channel_number());
+            } else {
+                log.error2("Channel #%d could not be closed cleanly and its "
+                           "number will not be reused.",
+                           channel->get_channel_number());
             }
             delete channel;
             break;
@@ -257,11 +542,18 @@ void AmqpConnection::remove_channel(AmqpChannel * channel) {
  *---------------------------------------------------------------------------*/
 
 AmqpQueueMessage::AmqpQueueMessage()
-:  content_type(),
+:  body_bytes(0),
+   body_bytes_length(0),
+   consumer_tag(),
+   content_encoding(),
+   content_type(),
    delivery_tag(),
    exchange(),
+   expiration(),
    message(),
-   routing_key()
+   routing_key(),
+   timestamp(0),
+   valid_utf8(true)
 {
 }
 
@@ -284,8 +576,12 @@ void intrusive_ptr_release(AmqpChannel * ref) {
 }
 
 AmqpChannel::AmqpChannel(AmqpConnection * parent, const int channel_number)
-: channel_number(channel_number), is_open(false), parent(parent),
-  reference_count(0)
+: channel_number(channel_number), compression_threshold(0),
+  confirms_enabled(false),
+  consumer_tags(), consuming(false), deliveries(),
+  is_bad(false), is_open(false), next_publish_tag(1), outgoing(),
+  parent(parent), publish_nacked(false), reference_count(0),
+  unconfirmed(), zero_copy(false)
 {
     amqp_connection_state_t conn = parent->get_connection();
     parent->log.debug("Opening new channel with # %d.", channel_number);
@@ -310,6 +606,18 @@ void AmqpChannel::ack_message(int delivery_tag) {
 
 void AmqpChannel::check(const amqp_rpc_reply_t reply,
                              const AmqpException::Code & code) {
+    if (reply.reply_type == AMQP_RESPONSE_SERVER_EXCEPTION
+        && reply.reply.id == AMQP_CHANNEL_CLOSE_METHOD) {
+        // The broker closed the channel because of the failure. Confirming
+        // this leaves the channel closed cleanly on both ends.
+        is_open = false;
+        try {
+            parent->confirm_channel_close(channel_number);
+        } catch(const AmqpException & ae) {
+            _throw(code);
+        }
+        throw AmqpException(code);
+    }
     if (reply.reply_type != AMQP_RESPONSE_NORMAL) {
         _throw(code);
     }
@@ -328,6 +636,10 @@ void AmqpChannel::check(const amqp_rpc_reply_t reply,
 // }
 
 void AmqpChannel::close() {
+    if (is_open && parent->broker_lost) {
+        // Nothing would answer the close, and the connection is going.
+        is_open = false;
+    }
     if (is_open) {
         parent->log.debug("Closing channel #%d", channel_number);
         amqp_connection_state_t conn = parent->get_connection();
@@ -375,7 +687,8 @@ void AmqpChannel::close() {
 
 void AmqpChannel::bind_queue_to_exchange(const char * queue_name,
                                          const char * exchange_name,
-                                         const char * routing_key) {
+                                         const char * routing_key,
+                                         bool nowait) {
     amqp_connection_state_t conn = parent->get_connection();
 
     amqp_queue_bind_t args;
@@ -383,10 +696,15 @@ void AmqpChannel::bind_queue_to_exchange(const char * queue_name,
     args.queue = amqp_cstring_bytes(queue_name);
     args.exchange = amqp_cstring_bytes(exchange_name);
     args.routing_key = amqp_cstring_bytes(routing_key);
-    args.nowait = 0;
+    args.nowait = nowait ? 1 : 0;
     args.arguments.num_entries = 0;
     args.arguments.entries = NULL;
 
+    if (nowait) {
+        send_method(AMQP_QUEUE_BIND_METHOD, &args,
+                    AmqpException::BIND_QUEUE_FAILURE);
+        return;
+    }
     amqp_method_number_t number = AMQP_QUEUE_BIND_OK_METHOD;
     amqp_rpc_reply_t reply = amqp_simple_rpc(conn, channel_number,
                                              AMQP_QUEUE_BIND_METHOD,
@@ -396,7 +714,8 @@ void AmqpChannel::bind_queue_to_exchange(const char * queue_name,
 }
 
 void AmqpChannel::declare_exchange(const char * exchange_name,
-                                   const char * type, bool passive) {
+                                   const char * type, bool passive,
+                                   bool nowait) {
     amqp_connection_state_t conn = parent->get_connection();
     amqp_exchange_declare_t args;
     args.exchange = amqp_cstring_bytes(exchange_name);
@@ -405,8 +724,13 @@ void AmqpChannel::declare_exchange(const char * exchange_name,
     args.durable = 0;
     args.auto_delete = 0;
     args.internal = 0;
-    args.nowait = 0;
+    args.nowait = nowait ? 1 : 0;
     args.arguments = AMQP_EMPTY_TABLE;
+    if (nowait) {
+        send_method(AMQP_EXCHANGE_DECLARE_METHOD, &args,
+                    AmqpException::EXCHANGE_DECLARE_FAIL);
+        return;
+    }
     amqp_method_number_t number = AMQP_EXCHANGE_DECLARE_OK_METHOD;
     amqp_rpc_reply_t reply = amqp_simple_rpc(conn, channel_number,
                                             AMQP_EXCHANGE_DECLARE_METHOD,
@@ -419,9 +743,9 @@ void AmqpChannel::declare_exchange(const char * exchange_name,
     }
 }
 
-void AmqpChannel::declare_queue(const char * queue_name, bool passive) {
-    const bool exclusive=false;
-    const bool auto_delete=false;
+void AmqpChannel::declare_queue(const char * queue_name, bool passive,
+                                bool exclusive, bool auto_delete,
+                                bool nowait) {
     amqp_connection_state_t conn = parent->get_connection();
     // Declare a queue
     amqp_queue_declare_t args;
@@ -431,8 +755,13 @@ void AmqpChannel::declare_queue(const char * queue_name, bool passive) {
     args.durable = 0;
     args.exclusive = exclusive ? 1 : 0;
     args.auto_delete = auto_delete ? 1 : 0;
-    args.nowait = 0;
+    args.nowait = nowait ? 1 : 0;
     args.arguments = AMQP_EMPTY_TABLE;
+    if (nowait) {
+        send_method(AMQP_QUEUE_DECLARE_METHOD, &args,
+                    AmqpException::DECLARE_QUEUE_FAILURE);
+        return;
+    }
     amqp_method_number_t number = AMQP_QUEUE_DECLARE_OK_METHOD;
     amqp_rpc_reply_t reply = amqp_simple_rpc(conn, channel_number,
                                             AMQP_QUEUE_DECLARE_METHOD,
@@ -445,43 +774,99 @@ void AmqpChannel::declare_queue(const char * queue_name, bool passive) {
     }
 }
 
-AmqpQueueMessagePtr AmqpChannel::get_message(const char * queue_name) {
-    AmqpQueueMessagePtr no;
-
+void AmqpChannel::consume(const char * queue_name,
+                          unsigned short prefetch_count) {
+    if (consumer_tags.find(queue_name) != consumer_tags.end()) {
+        return;
+    }
     amqp_connection_state_t conn = parent->get_connection();
+    // RabbitMQ applies the limit to each consumer started after this, so
+    // it only needs to be set once.
+    if (!consuming && prefetch_count > 0) {
+        parent->log.debug("Setting prefetch count of channel #%d to %d.",
+                          channel_number, (int) prefetch_count);
+        amqp_basic_qos(conn, channel_number, 0, prefetch_count, 0);
+        check(amqp_get_rpc_reply(conn), AmqpException::SET_QOS_FAILED);
+    }
+    // The queue name doubles as the consumer tag, which is what deliveries
+    // are labeled with.
     amqp_basic_consume(conn, channel_number,
                        amqp_cstring_bytes(queue_name),
-                       AMQP_EMPTY_BYTES,
+                       amqp_cstring_bytes(queue_name),
                        1, 0, 0, AMQP_EMPTY_TABLE);
-
     amqp_check(amqp_get_rpc_reply(conn), AmqpException::CONSUME);
-    // use select to not block
-    amqp_frame_t frame;
+    consumer_tags.insert(queue_name);
+    consuming = true;
+}
 
-    //
-    amqp_maybe_release_buffers(conn);
-    int result = amqp_simple_wait_frame(conn, &frame);
+bool AmqpChannel::has_buffered_data() {
+    amqp_connection_state_t conn = parent->get_connection();
+    return !deliveries.empty() || amqp_frames_enqueued(conn)
+           || amqp_data_in_buffer(conn);
+}
 
-    AmqpQueueMessagePtr rtn;
+AmqpQueueMessagePtr AmqpChannel::get_message(const char * queue_name) {
+    consume(queue_name);
 
-    if (result < 0) {
+    AmqpQueueMessagePtr rtn;
+    if (!deliveries.empty()) {
+        rtn = deliveries.front();
+        deliveries.pop_front();
         return rtn;
     }
-    if (frame.payload.method.id != AMQP_BASIC_DELIVER_METHOD) {
+
+    amqp_connection_state_t conn = parent->get_connection();
+    // This invalidates the body of the last zero copy message.
+    amqp_maybe_release_buffers(conn);
+    rtn = read_message(zero_copy);
+
+    // Whatever the broker pushed ahead of time because of the prefetch
+    // window is already sitting in our buffers, so pull it in now rather
+    // than going back to the socket for each message. These are copied as
+    // they will outlive the next call to amqp_maybe_release_buffers.
+    while (amqp_frames_enqueued(conn) || amqp_data_in_buffer(conn)) {
+        AmqpQueueMessagePtr next = read_message(false);
+        if (next) {
+            deliveries.push_back(next);
+        }
+    }
+    return rtn;
+}
+
+AmqpQueueMessagePtr AmqpChannel::read_message(bool allow_zero_copy) {
+    amqp_frame_t frame;
+    // Heartbeats are let through so that being woken by one doesn't leave
+    // the caller stuck here waiting for a real message.
+    parent->wait_frame(frame, true);
+
+    AmqpQueueMessagePtr rtn;
+
+    if (frame.frame_type != AMQP_FRAME_METHOD
+        || frame.payload.method.id != AMQP_BASIC_DELIVER_METHOD
+        || frame.channel != channel_number) {
+        parent->dispatch_frame(frame);
         return rtn;
     }
+    return read_delivery(frame, allow_zero_copy);
+}
+
+AmqpQueueMessagePtr AmqpChannel::read_delivery(const amqp_frame_t & method,
+                                               bool allow_zero_copy) {
+    amqp_frame_t frame;
+    AmqpQueueMessagePtr rtn;
+
     amqp_basic_deliver_t * decoded = (amqp_basic_deliver_t *)
-                                     frame.payload.method.decoded;
+                                     method.payload.method.decoded;
     rtn.reset(new AmqpQueueMessage());
+    rtn->consumer_tag.append((char *)decoded->consumer_tag.bytes,
+                             (size_t) decoded->consumer_tag.len);
     rtn->delivery_tag = decoded->delivery_tag;
     rtn->exchange.append((char *)decoded->exchange.bytes,
                   (size_t) decoded->exchange.len);
     rtn->routing_key.append((char *)decoded->routing_key.bytes,
                      (size_t) decoded->routing_key.len);
 
-    if (amqp_simple_wait_frame(conn, &frame) < 0) {
-        return rtn;
-    }
+    wait_channel_frame(frame);
 
     if (frame.frame_type != AMQP_FRAME_HEADER) {
         throw AmqpException(AmqpException::HEADER_EXPECTED);
@@ -492,14 +877,23 @@ AmqpQueueMessagePtr AmqpChannel::get_message(const char * queue_name) {
         rtn->content_type.append((char *) properties->content_type.bytes,
                                  (size_t) properties->content_type.len);
     }
+    if (properties->_flags & AMQP_BASIC_CONTENT_ENCODING_FLAG) {
+        rtn->content_encoding.append(
+            (char *) properties->content_encoding.bytes,
+            (size_t) properties->content_encoding.len);
+    }
+    if (properties->_flags & AMQP_BASIC_EXPIRATION_FLAG) {
+        rtn->expiration.append((char *) properties->expiration.bytes,
+                               (size_t) properties->expiration.len);
+    }
+    if (properties->_flags & AMQP_BASIC_TIMESTAMP_FLAG) {
+        rtn->timestamp = properties->timestamp;
+    }
 
     size_t body_target = frame.payload.properties.body_size;
     size_t body_received = 0;
     while (body_received < body_target) {
-        result = amqp_simple_wait_frame(conn, &frame);
-		if (result < 0) {
-		  throw AmqpException(AmqpException::WAIT_FRAME_FAILED);
-		}
+        wait_channel_frame(frame);
 		if (frame.frame_type != AMQP_FRAME_BODY) {
 		    throw AmqpException(AmqpException::BODY_EXPECTED);
 		}
@@ -507,13 +901,122 @@ AmqpQueueMessagePtr AmqpChannel::get_message(const char * queue_name) {
 		if (body_received > body_target) {
 		    throw AmqpException(AmqpException::BODY_LARGER);
 		}
-		//TODO: Is it safe to assume these are normal chars?
+		if (allow_zero_copy && body_received == body_target
+		    && rtn->message.empty()) {
+		    // The whole body came in one frame, so just point at it.
+		    rtn->body_bytes = (const char *) frame.payload.body_fragment.bytes;
+		    rtn->body_bytes_length = frame.payload.body_fragment.len;
+		    break;
+		}
+		if (rtn->message.empty()) {
+		    rtn->message.reserve(body_target);
+		}
 		rtn->message.append((char *) frame.payload.body_fragment.bytes,
                       		(size_t) frame.payload.body_fragment.len);
     }
+    if (rtn->content_encoding == DEFLATE) {
+        std::string inflated;
+        const size_t frame_max = parent->client_memory > 0 ?
+            parent->client_memory : DEFAULT_FRAME_MAX;
+        if (inflate_body(rtn->body(), rtn->body_length(),
+                         frame_max * MAX_INFLATED_FRAMES, inflated)) {
+            rtn->body_bytes = 0;
+            rtn->body_bytes_length = 0;
+            rtn->content_encoding.clear();
+            rtn->message.swap(inflated);
+        } else {
+            // Leave it to whoever parses the body to reject it, so it's
+            // dealt with like any other garbage.
+            parent->log.error2("Could not inflate message with delivery tag "
+                               "%d.", rtn->delivery_tag);
+        }
+    }
+    // As with inflating, a bad body is left for whoever reads it to turn
+    // away.
+    rtn->valid_utf8 = nova::utils::is_valid_utf8(rtn->body(),
+                                                 rtn->body_length());
+    if (!rtn->valid_utf8) {
+        parent->log.error2("Message with delivery tag %d is not valid UTF-8.",
+                           rtn->delivery_tag);
+    }
     return rtn;
 }
 
+void AmqpChannel::enable_confirms() {
+    if (confirms_enabled) {
+        return;
+    }
+    amqp_connection_state_t conn = parent->get_connection();
+    amqp_confirm_select_t args;
+    args.nowait = 0;
+    amqp_method_number_t number = AMQP_CONFIRM_SELECT_OK_METHOD;
+    amqp_rpc_reply_t reply = amqp_simple_rpc(conn, channel_number,
+                                             AMQP_CONFIRM_SELECT_METHOD,
+                                             &number,
+                                             &args);
+    check(reply, AmqpException::CONFIRM_SELECT_FAILED);
+    confirms_enabled = true;
+    next_publish_tag = 1;
+}
+
+void AmqpChannel::on_confirm(uint64_t delivery_tag, bool multiple,
+                             bool nack) {
+    std::set<uint64_t>::iterator end = multiple
+        ? unconfirmed.upper_bound(delivery_tag)
+        : unconfirmed.find(delivery_tag);
+    if (!multiple && end != unconfirmed.end()) {
+        end ++;
+    }
+    std::set<uint64_t>::iterator begin = multiple
+        ? unconfirmed.begin()
+        : unconfirmed.find(delivery_tag);
+    if (begin == unconfirmed.end()) {
+        return;
+    }
+    if (nack) {
+        parent->log.error2("Broker could not take message #%lu on channel "
+                           "#%d.", (unsigned long) delivery_tag,
+                           channel_number);
+        publish_nacked = true;
+    }
+    unconfirmed.erase(begin, end);
+}
+
+void AmqpChannel::queue_message(const char * exchange_name,
+                                const char * routing_key,
+                                const char * messagebody) {
+    AmqpOutgoingMessage msg;
+    msg.exchange = exchange_name;
+    msg.routing_key = routing_key;
+    msg.body = messagebody;
+    outgoing.push_back(msg);
+}
+
+void AmqpChannel::flush() {
+    if (outgoing.empty()) {
+        return;
+    }
+    // Corking the socket makes the kernel hold the frames of every queued
+    // message and send them together, rather than a packet per frame.
+    int sockfd = parent->sockfd;
+    int cork = 1;
+    setsockopt(sockfd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+    try {
+        BOOST_FOREACH(const AmqpOutgoingMessage & msg, outgoing) {
+            publish(msg.exchange.c_str(), msg.routing_key.c_str(),
+                    msg.body.c_str());
+        }
+    } catch(const AmqpException & ae) {
+        outgoing.clear();
+        cork = 0;
+        setsockopt(sockfd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+        throw;
+    }
+    outgoing.clear();
+    cork = 0;
+    setsockopt(sockfd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+}
+
 void AmqpChannel::publish(const char * exchange_name,
                           const char * routing_key, const char * messagebody) {
     amqp_connection_state_t conn = parent->get_connection();
@@ -524,6 +1027,15 @@ void AmqpChannel::publish(const char * exchange_name,
     props.content_type = amqp_cstring_bytes("application/json"); //text/text");
     props.content_encoding = amqp_cstring_bytes("UTF-8");
     props.delivery_mode = 2; /* persistent delivery mode */
+    amqp_bytes_t body = amqp_cstring_bytes(messagebody);
+    std::string deflated;
+    if (compression_threshold > 0 && body.len >= compression_threshold
+        && deflate_body(messagebody, body.len, deflated)
+        && deflated.size() < body.len) {
+        props.content_encoding = amqp_cstring_bytes(DEFLATE);
+        body.bytes = &deflated[0];
+        body.len = deflated.size();
+    }
     int result = amqp_basic_publish(conn,
                     channel_number,
                     amqp_cstring_bytes(exchange_name),
@@ -531,10 +1043,47 @@ void AmqpChannel::publish(const char * exchange_name,
                     1,
                     0,
                     &props,
-                    amqp_cstring_bytes(messagebody));
+                    body);
     if (result < 0) {
         throw AmqpException(AmqpException::PUBLISH_FAILURE);
     }
+    if (confirms_enabled) {
+        unconfirmed.insert(next_publish_tag ++);
+    }
+}
+
+void AmqpChannel::wait_for_confirms() {
+    while (!unconfirmed.empty()) {
+        if (!is_open) {
+            unconfirmed.clear();
+            throw AmqpException(AmqpException::CHANNEL_CLOSED_BY_BROKER);
+        }
+        amqp_frame_t frame;
+        parent->wait_frame(frame);
+        parent->dispatch_frame(frame);
+    }
+    if (publish_nacked) {
+        publish_nacked = false;
+        throw AmqpException(AmqpException::PUBLISH_NOT_CONFIRMED);
+    }
+}
+
+void AmqpChannel::wait_channel_frame(amqp_frame_t & frame) {
+    while (true) {
+        parent->wait_frame(frame);
+        if (frame.channel == channel_number) {
+            return;
+        }
+        parent->dispatch_frame(frame);
+    }
+}
+
+void AmqpChannel::send_method(amqp_method_number_t method, void * args,
+                              const AmqpException::Code & code) {
+    if (amqp_send_method(parent->get_connection(), channel_number, method,
+                         args) < 0) {
+        _throw(code);
+    }
 }
 
 void AmqpChannel::_throw(const AmqpException::Code & code) {
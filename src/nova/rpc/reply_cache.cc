@@ -0,0 +1,156 @@
+#include "nova/rpc/reply_cache.h"
+
+#include <boost/foreach.hpp>
+#include <fcntl.h>
+#include <fstream>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using boost::optional;
+using std::string;
+
+namespace nova { namespace rpc {
+
+namespace {
+    /* Each line of the file is a msg_id, a tab, and the reply. Replies are
+     * JSON, in which newlines and tabs only ever appear escaped. */
+    const char SEPARATOR = '\t';
+
+    bool fits_on_a_line(const string & text) {
+        return text.find('\n') == string::npos;
+    }
+
+    /* Opens path for writing so only the agent's user can read it, as
+     * replies hold whatever the guest sent back. Files made before this
+     * was done are closed up too. */
+    FILE * open_private(const string & path, int flags) {
+        const int fd = open(path.c_str(), O_WRONLY | O_CREAT | flags, 0600);
+        if (fd < 0) {
+            return 0;
+        }
+        if (fchmod(fd, 0600) != 0) {
+            ::close(fd);
+            return 0;
+        }
+        FILE * file = fdopen(fd, "w");
+        if (file == 0) {
+            ::close(fd);
+        }
+        return file;
+    }
+
+    bool write_line(FILE * file, const string & msg_id, const string & reply) {
+        return fwrite(msg_id.data(), 1, msg_id.size(), file) == msg_id.size()
+               && fputc(SEPARATOR, file) != EOF
+               && fwrite(reply.data(), 1, reply.size(), file) == reply.size()
+               && fputc('\n', file) != EOF;
+    }
+}
+
+ReplyCache::ReplyCache(size_t capacity, const string & file_path)
+: capacity(capacity),
+  file_path(file_path),
+  file_lines(0),
+  log(),
+  order(),
+  replies()
+{
+    if (!file_path.empty()) {
+        load();
+    }
+}
+
+void ReplyCache::append_to_file(const string & msg_id, const string & reply) {
+    FILE * file = open_private(file_path, O_APPEND);
+    bool saved = file != 0 && write_line(file, msg_id, reply);
+    if (file != 0 && fclose(file) != 0) {
+        saved = false;
+    }
+    if (!saved) {
+        log.error2("Could not save reply for %s to %s.", msg_id.c_str(),
+                   file_path.c_str());
+    }
+    file_lines ++;
+}
+
+optional<string> ReplyCache::get(const string & msg_id) const {
+    std::map<string, string>::const_iterator itr = replies.find(msg_id);
+    if (itr == replies.end()) {
+        return boost::none;
+    }
+    return itr->second;
+}
+
+void ReplyCache::load() {
+    std::ifstream file(file_path.c_str());
+    string line;
+    while(std::getline(file, line)) {
+        file_lines ++;
+        size_t separator = line.find(SEPARATOR);
+        if (separator == string::npos) {
+            // Likely cut short by a crash.
+            continue;
+        }
+        string msg_id = line.substr(0, separator);
+        if (replies.find(msg_id) == replies.end()) {
+            order.push_back(msg_id);
+        }
+        replies[msg_id] = line.substr(separator + 1);
+        while (order.size() > capacity) {
+            replies.erase(order.front());
+            order.pop_front();
+        }
+    }
+    log.info2("Loaded %d cached replies from %s.", (int) replies.size(),
+              file_path.c_str());
+}
+
+void ReplyCache::put(const string & msg_id, const string & reply) {
+    if (capacity == 0 || replies.find(msg_id) != replies.end()) {
+        return;
+    }
+    order.push_back(msg_id);
+    replies[msg_id] = reply;
+    while (order.size() > capacity) {
+        replies.erase(order.front());
+        order.pop_front();
+    }
+    if (file_path.empty()) {
+        return;
+    }
+    if (!fits_on_a_line(msg_id) || !fits_on_a_line(reply)
+        || msg_id.find(SEPARATOR) != string::npos) {
+        log.error2("Reply for %s can't be saved to the file.", msg_id.c_str());
+        return;
+    }
+    if (file_lines >= capacity * 2) {
+        rewrite_file();
+    } else {
+        append_to_file(msg_id, reply);
+    }
+}
+
+void ReplyCache::rewrite_file() {
+    const string temp_path = file_path + ".tmp";
+    FILE * file = open_private(temp_path, O_TRUNC);
+    bool written = file != 0;
+    BOOST_FOREACH(const string & msg_id, order) {
+        written = written && write_line(file, msg_id, replies[msg_id]);
+    }
+    if (file != 0 && fclose(file) != 0) {
+        written = false;
+    }
+    if (!written) {
+        log.error2("Could not write %s.", temp_path.c_str());
+        return;
+    }
+    // Renaming means a crash part way through leaves the old file whole.
+    if (rename(temp_path.c_str(), file_path.c_str()) != 0) {
+        log.error2("Could not replace %s.", file_path.c_str());
+        return;
+    }
+    file_lines = order.size();
+}
+
+} }  // end namespace
@@ -0,0 +1,91 @@
+#include "nova/rpc/topology.h"
+#include "nova/rpc/amqp.h"
+
+#include <boost/foreach.hpp>
+
+
+namespace nova { namespace rpc {
+
+AmqpTopology::AmqpTopology()
+: bindings(), exchanges(), queues()
+{
+}
+
+void AmqpTopology::add_binding(const char * queue_name,
+                               const char * exchange_name,
+                               const char * routing_key) {
+    Binding binding;
+    binding.exchange_name = exchange_name;
+    binding.queue_name = queue_name;
+    binding.routing_key = routing_key;
+    bindings.push_back(binding);
+}
+
+void AmqpTopology::add_exchange(const char * exchange_name, const char * type,
+                                bool passive) {
+    BOOST_FOREACH(const Exchange & exchange, exchanges) {
+        if (exchange.name == exchange_name) {
+            return;
+        }
+    }
+    Exchange exchange;
+    exchange.name = exchange_name;
+    exchange.passive = passive;
+    exchange.type = type;
+    exchanges.push_back(exchange);
+}
+
+void AmqpTopology::add_queue(const char * queue_name, bool passive,
+                             bool exclusive, bool auto_delete) {
+    BOOST_FOREACH(const Queue & queue, queues) {
+        if (queue.name == queue_name) {
+            return;
+        }
+    }
+    Queue queue;
+    queue.auto_delete = auto_delete;
+    queue.exclusive = exclusive;
+    queue.name = queue_name;
+    queue.passive = passive;
+    queues.push_back(queue);
+}
+
+void AmqpTopology::clear() {
+    bindings.clear();
+    exchanges.clear();
+    queues.clear();
+}
+
+void AmqpTopology::replay(AmqpConnectionPtr connection) const {
+    const bool nowait = true;
+    AmqpChannelPtr channel = connection->new_channel();
+    // Order matters: bindings need both of the things they join.
+    BOOST_FOREACH(const Exchange & exchange, exchanges) {
+        channel->declare_exchange(exchange.name.c_str(), exchange.type.c_str(),
+                                  exchange.passive, nowait);
+    }
+    BOOST_FOREACH(const Queue & queue, queues) {
+        channel->declare_queue(queue.name.c_str(), queue.passive,
+                               queue.exclusive, queue.auto_delete, nowait);
+    }
+    BOOST_FOREACH(const Binding & binding, bindings) {
+        channel->bind_queue_to_exchange(binding.queue_name.c_str(),
+                                        binding.exchange_name.c_str(),
+                                        binding.routing_key.c_str(), nowait);
+    }
+    // None of the above waits for the broker, so finish with something
+    // that does. If anything failed the broker has closed the channel and
+    // sends that in place of the reply, which throws.
+    if (!queues.empty()) {
+        const Queue & last = queues.back();
+        channel->declare_queue(last.name.c_str(), true, last.exclusive,
+                               last.auto_delete);
+    } else if (!exchanges.empty()) {
+        const Exchange & last = exchanges.back();
+        channel->declare_exchange(last.name.c_str(), last.type.c_str(),
+                                  true);
+    }
+    channel->close();
+}
+
+} }  // end namespace
@@ -62,6 +62,8 @@ const char * IOException::what() const throw() {
     switch(code) {
         case ACCESS_DENIED:
             return "Access denied.";
+        case EVENT_LOOP_ERROR:
+            return "Error waiting on events.";
         case READ_ERROR:
             return "Read error.";
         case SIGNAL_HANDLER_DESTROY_ERROR:
@@ -97,78 +99,55 @@ const char * TimeOutException::what() const throw() {
  *- Timer
  *---------------------------------------------------------------------------*/
 
-Timer::Timer(double seconds) : log() {
-    set_interrupt_handler();
-    // Initialize timer.
-    itimerspec value;
-    //TODO(tim.simpson): Valgrind thinks id is not initialized.
-    // However even if you use memset on it this error will not go away.
-    // http://stackoverflow.com/questions/6122594/timer-create-gives-memory-leaks-issue-syscall-param-timer-createevp-points-to
-    // ;_;
-    checkEqual0(log, timer_create(CLOCK_REALTIME, NULL, &id),
-                IOException::TIMER_ENABLE_ERROR);
-    value.it_value = timespec_from_seconds(seconds);
-    value.it_interval = timespec_from_seconds(0.0);  // Not periodic.
-    time_out_occurred() = false;
-    // 0 for relative time.
-    checkEqual0(log, timer_settime(id, 0, &value, NULL),
-                IOException::TIMER_ENABLE_ERROR);
-}
+namespace {
 
-Timer::~Timer() {
-    checkEqual0(log, timer_delete(id),
-                IOException::TIMER_DISABLE_ERROR);
-    time_out_occurred() = false;
-    remove_interrupt_handler();
-}
+    // Each thread gets its own deadline, so a Timer in one worker can't
+    // interrupt what another is doing.
+    __thread bool deadline_set = false;
+    __thread timespec deadline;
 
-void Timer::interrupt(int signal_number, siginfo_t * info,
-                             void * context) {
-    Log log;
-    log.error("Interruptin'");
-    time_out_occurred() = true;
-    remove_interrupt_handler();
-    //raise(SIGALRM);
-    //signal(SIGALRM, SIG_IGN);
-}
+    timespec now() {
+        timespec time;
+        clock_gettime(CLOCK_MONOTONIC, &time);
+        return time;
+    }
 
-void Timer::remove_interrupt_handler() {
-    // Unblock all signals. The alarm may happen right now.
-    sigset_t blocked_signals;
-    sigemptyset(&blocked_signals);         /* Block SIGINT */
-    sigaddset(&blocked_signals, SIGALRM);
-    sigprocmask(SIGALRM, &blocked_signals, NULL);
-
-    // Remove signal handler
-    struct sigaction action;
-    action.sa_flags = SA_RESETHAND;
-    action.sa_sigaction = NULL;
-    if ((sigemptyset(&action.sa_mask) == -1) ||
-        (sigaction(SIGALRM, &action, NULL) == -1)) {
-        throw IOException(IOException::SIGNAL_HANDLER_DESTROY_ERROR);
+    bool is_earlier(const timespec & a, const timespec & b) {
+        return a.tv_sec < b.tv_sec
+            || (a.tv_sec == b.tv_sec && a.tv_nsec < b.tv_nsec);
     }
+
 }
 
-void Timer::set_interrupt_handler() {
-    // Block the very signal we're generating so nothing catches it.
-    sigset_t blocked_signals;
-    sigemptyset(&blocked_signals);         /* Block SIGINT */
-    sigaddset(&blocked_signals, SIGALRM);
-    sigprocmask(SIGALRM, &blocked_signals, NULL);
-
-    struct sigaction action;
-    action.sa_handler = SIG_IGN;
-    action.sa_flags = SA_SIGINFO;
-    action.sa_sigaction = interrupt;
-    if ((sigemptyset(&action.sa_mask) == -1) ||
-        (sigaction(SIGALRM, &action, NULL) == -1)) {
-        throw IOException(IOException::SIGNAL_HANDLER_INITIALIZE_ERROR);
+Timer::Timer(double seconds)
+: had_deadline(deadline_set), previous_deadline(deadline)
+{
+    timespec from_now = timespec_from_seconds(seconds);
+    timespec new_deadline = now();
+    new_deadline.tv_sec += from_now.tv_sec;
+    new_deadline.tv_nsec += from_now.tv_nsec;
+    if (new_deadline.tv_nsec >= 1000000000L) {
+        new_deadline.tv_sec ++;
+        new_deadline.tv_nsec -= 1000000000L;
+    }
+    if (!deadline_set || is_earlier(new_deadline, deadline)) {
+        deadline = new_deadline;
     }
+    deadline_set = true;
 }
 
-bool & Timer::time_out_occurred() {
-    static bool time_out(false);
-    return time_out;
+Timer::~Timer() {
+    deadline_set = had_deadline;
+    deadline = previous_deadline;
+}
+
+optional<double> Timer::remaining() {
+    if (!deadline_set) {
+        return boost::none;
+    }
+    timespec current = now();
+    return (deadline.tv_sec - current.tv_sec)
+           + (deadline.tv_nsec - current.tv_nsec) / 1000000000.0;
 }
 
 
@@ -203,37 +182,48 @@ size_t read_with_throw(Log & log, int fd, char * const buf, size_t count) {
 }
 
 // Throws exceptions if errors are detected.
-// Also unblocks time out signals before proceeding and throws
-// ProcessTimeOutExceptions if they happen.
+// Throws TimeOutException if the current thread's Timer runs out first.
 int select_with_throw(int nfds, fd_set * readfds, fd_set * writefds,
                       fd_set * errorfds, optional<double> seconds) {
     Log log;
-    timespec time_out = timespec_from_seconds(!seconds ? 0.0 : seconds.get());
-    sigset_t empty_set;
-    sigemptyset(&empty_set);
-    // Unblock all signals for the duration of select.
-    //log.debug("Before pselect");
-    int ready = -1;
-    while(ready < 0)
-    {
-        ready = pselect(nfds, readfds, writefds, errorfds,
-                            (!seconds ? NULL: &time_out), &empty_set);
-        //log.debug("after pselect");
-        if (ready < 0) {
-            if (errno == EINTR) {
-                if (Timer::time_out_occurred()) {
-                    throw TimeOutException();
-                } else {
-                    log.error("pselect was interrupted, restarting.");
-                }
-            } else {
-                log.error2("Select returned < 0. errno = %d: %s\n EINTR=%d",
-                           errno, strerror(errno), EINTR);
-                throw IOException(IOException::GENERAL);
+    // select leaves these undefined if interrupted, so keep the originals.
+    fd_set original_sets[3];
+    fd_set * sets[3] = { readfds, writefds, errorfds };
+    for (int i = 0; i < 3; i ++) {
+        if (sets[i] != NULL) {
+            original_sets[i] = *sets[i];
+        }
+    }
+    while(true) {
+        optional<double> remaining = Timer::remaining();
+        if (remaining && remaining.get() <= 0.0) {
+            throw TimeOutException();
+        }
+        const bool deadline_first = remaining
+            && (!seconds || remaining.get() < seconds.get());
+        optional<double> wait_time = deadline_first ? remaining : seconds;
+        timespec time_out = timespec_from_seconds(
+            !wait_time ? 0.0 : wait_time.get());
+        int ready = pselect(nfds, readfds, writefds, errorfds,
+                            (!wait_time ? NULL: &time_out), NULL);
+        if (ready == 0 && deadline_first) {
+            throw TimeOutException();
+        }
+        if (ready >= 0) {
+            return ready;
+        }
+        if (errno != EINTR) {
+            log.error2("Select returned < 0. errno = %d: %s\n EINTR=%d",
+                       errno, strerror(errno), EINTR);
+            throw IOException(IOException::GENERAL);
+        }
+        log.error("pselect was interrupted, restarting.");
+        for (int i = 0; i < 3; i ++) {
+            if (sets[i] != NULL) {
+                *sets[i] = original_sets[i];
             }
         }
     }
-    return ready;
 }
 
 } } }  // end nova::utils::io
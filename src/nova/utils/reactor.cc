@@ -0,0 +1,201 @@
+#include "nova/utils/reactor.h"
+
+#include <errno.h>
+#include "nova/utils/io.h"
+#include <stdint.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+using boost::optional;
+using nova::utils::io::IOException;
+
+namespace nova { namespace utils {
+
+namespace {
+
+    const int MAX_EVENTS = 16;
+
+    timespec timespec_from_seconds(double seconds) {
+        timespec time;
+        time.tv_sec = (time_t) seconds;
+        time.tv_nsec = (long) ((seconds - time.tv_sec) * 1000000000L);
+        return time;
+    }
+
+}
+
+Reactor::Reactor()
+: epoll_fd(-1), entries(), log(), signal_fd(-1), signal_handlers(),
+  stopped(false)
+{
+    sigemptyset(&signals);
+    epoll_fd = epoll_create(MAX_EVENTS);
+    if (epoll_fd < 0) {
+        log.error2("Could not create epoll fd: %s", strerror(errno));
+        throw IOException(IOException::EVENT_LOOP_ERROR);
+    }
+}
+
+Reactor::~Reactor() {
+    for (std::map<int, Entry>::iterator itr = entries.begin();
+         itr != entries.end(); itr ++) {
+        if (itr->second.kind != READER) {
+            close(itr->first);
+        }
+    }
+    close(epoll_fd);
+}
+
+void Reactor::add_reader(int fd, Callback callback) {
+    if (entries.find(fd) != entries.end()) {
+        unregister_fd(fd);
+    }
+    register_fd(fd, READER, callback);
+}
+
+void Reactor::add_signal_handler(int signal_number, Callback callback) {
+    sigaddset(&signals, signal_number);
+    if (sigprocmask(SIG_BLOCK, &signals, NULL) < 0) {
+        throw IOException(IOException::SIGNAL_HANDLER_INITIALIZE_ERROR);
+    }
+    // Given an existing fd, signalfd just changes the signals it reads.
+    int fd = signalfd(signal_fd, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (fd < 0) {
+        log.error2("Could not create signalfd: %s", strerror(errno));
+        throw IOException(IOException::SIGNAL_HANDLER_INITIALIZE_ERROR);
+    }
+    if (signal_fd < 0) {
+        signal_fd = fd;
+        register_fd(signal_fd, SIGNAL, Callback());
+    }
+    signal_handlers[signal_number] = callback;
+}
+
+int Reactor::add_timer(double first_delay, double interval,
+                       Callback callback) {
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0) {
+        log.error2("Could not create timerfd: %s", strerror(errno));
+        throw IOException(IOException::TIMER_ENABLE_ERROR);
+    }
+    itimerspec value;
+    value.it_value = timespec_from_seconds(first_delay);
+    if (value.it_value.tv_sec == 0 && value.it_value.tv_nsec == 0) {
+        // All zeroes would disarm it.
+        value.it_value.tv_nsec = 1;
+    }
+    value.it_interval = timespec_from_seconds(interval);
+    if (timerfd_settime(fd, 0, &value, NULL) < 0) {
+        close(fd);
+        throw IOException(IOException::TIMER_ENABLE_ERROR);
+    }
+    try {
+        register_fd(fd, TIMER, callback);
+    } catch(const IOException & ioe) {
+        close(fd);
+        throw;
+    }
+    return fd;
+}
+
+void Reactor::handle_signals() {
+    signalfd_siginfo info;
+    while(read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+        std::map<int, Callback>::iterator itr
+            = signal_handlers.find((int) info.ssi_signo);
+        if (itr != signal_handlers.end()) {
+            // Copied, as the callback may replace itself.
+            Callback callback = itr->second;
+            callback();
+        }
+    }
+}
+
+void Reactor::register_fd(int fd, Kind kind, Callback callback) {
+    epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        log.error2("Could not watch fd %d: %s", fd, strerror(errno));
+        throw IOException(IOException::EVENT_LOOP_ERROR);
+    }
+    Entry entry;
+    entry.callback = callback;
+    entry.kind = kind;
+    entries[fd] = entry;
+}
+
+void Reactor::remove_reader(int fd) {
+    unregister_fd(fd);
+}
+
+void Reactor::remove_timer(int id) {
+    if (unregister_fd(id)) {
+        close(id);
+    }
+}
+
+void Reactor::run() {
+    stopped = false;
+    while(!stopped) {
+        run_once();
+    }
+}
+
+int Reactor::run_once(optional<double> seconds) {
+    epoll_event events[MAX_EVENTS];
+    int timeout = !seconds ? -1 : (int) (seconds.get() * 1000);
+    int count = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+    if (count < 0) {
+        if (errno == EINTR) {
+            return 0;
+        }
+        log.error2("epoll_wait failed: %s", strerror(errno));
+        throw IOException(IOException::EVENT_LOOP_ERROR);
+    }
+    int called = 0;
+    for (int i = 0; i < count; i ++) {
+        // An earlier callback may have removed this one.
+        std::map<int, Entry>::iterator itr = entries.find(events[i].data.fd);
+        if (itr == entries.end()) {
+            continue;
+        }
+        Entry entry = itr->second;
+        if (entry.kind == SIGNAL) {
+            handle_signals();
+        } else {
+            if (entry.kind == TIMER) {
+                uint64_t expirations;
+                if (read(itr->first, &expirations, sizeof(expirations)) < 0) {
+                    // Somebody else already took it.
+                    continue;
+                }
+            }
+            entry.callback();
+        }
+        called ++;
+    }
+    return called;
+}
+
+void Reactor::stop() {
+    stopped = true;
+}
+
+bool Reactor::unregister_fd(int fd) {
+    if (entries.erase(fd) == 0) {
+        return false;
+    }
+    // Closing an fd removes it from epoll, so that isn't worth a warning.
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL) < 0
+        && errno != EBADF && errno != ENOENT) {
+        log.error2("Could not stop watching fd %d: %s", fd, strerror(errno));
+    }
+    return true;
+}
+
+} }  // end nova::utils
@@ -0,0 +1,213 @@
+#include "nova/utils/text.h"
+
+// The vector versions are compiled for their instruction sets function by
+// function, so the rest of the build needn't assume the CPU has them.
+#if (defined(__x86_64__) || defined(__i386__)) \
+    && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+    #define NOVA_TEXT_SIMD
+    #include <immintrin.h>
+#endif
+
+using std::vector;
+
+namespace nova { namespace utils {
+
+namespace {
+
+    inline bool is_continuation(unsigned char c) {
+        return (c & 0xC0) == 0x80;
+    }
+
+    inline bool needs_json_escape(unsigned char c) {
+        return c < 0x20 || c == '"' || c == '\\';
+    }
+
+    /* Length of the multibyte sequence starting at s if it's valid, or
+     * zero. */
+    size_t valid_sequence_length(const unsigned char * s,
+                                 const unsigned char * end) {
+        const unsigned char c = s[0];
+        const size_t left = end - s;
+        if (c >= 0xC2 && c <= 0xDF) {
+            return left >= 2 && is_continuation(s[1]) ? 2 : 0;
+        } else if (c >= 0xE0 && c <= 0xEF) {
+            if (left < 3 || !is_continuation(s[1])
+                || !is_continuation(s[2])) {
+                return 0;
+            }
+            if ((c == 0xE0 && s[1] < 0xA0)          // Overlong
+                || (c == 0xED && s[1] >= 0xA0)) {   // Surrogate
+                return 0;
+            }
+            return 3;
+        } else if (c >= 0xF0 && c <= 0xF4) {
+            if (left < 4 || !is_continuation(s[1])
+                || !is_continuation(s[2]) || !is_continuation(s[3])) {
+                return 0;
+            }
+            if ((c == 0xF0 && s[1] < 0x90)          // Overlong
+                || (c == 0xF4 && s[1] >= 0x90)) {   // Past U+10FFFF
+                return 0;
+            }
+            return 4;
+        }
+        return 0;
+    }
+
+    size_t scalar_find_json_escape(const char * text, size_t length) {
+        for (size_t i = 0; i < length; i ++) {
+            if (needs_json_escape((unsigned char) text[i])) {
+                return i;
+            }
+        }
+        return length;
+    }
+
+    bool scalar_is_valid_utf8(const char * text, size_t length) {
+        const unsigned char * s = (const unsigned char *) text;
+        const unsigned char * const end = s + length;
+        while (s < end) {
+            if (*s < 0x80) {
+                s ++;
+                continue;
+            }
+            const size_t sequence = valid_sequence_length(s, end);
+            if (sequence == 0) {
+                return false;
+            }
+            s += sequence;
+        }
+        return true;
+    }
+
+#ifdef NOVA_TEXT_SIMD
+
+    /* The vector versions look at a block at a time and hand anything
+     * interesting, and whatever is left over at the end, to the scalar
+     * code. The AVX2 ones don't fall back to SSE2, since mixing the two
+     * encodings stalls some CPUs. UTF-8 is only vectorized for runs of
+     * ASCII, which is nearly all of what Nova sends. */
+
+    __attribute__((target("sse2")))
+    size_t sse2_find_json_escape(const char * text, size_t length) {
+        const __m128i quote = _mm_set1_epi8('"');
+        const __m128i backslash = _mm_set1_epi8('\\');
+        const __m128i control = _mm_set1_epi8(0x1F);
+        size_t i = 0;
+        for (; i + 16 <= length; i += 16) {
+            const __m128i block =
+                _mm_loadu_si128((const __m128i *) (text + i));
+            // max(c, 0x1F) == 0x1F only when c <= 0x1F, unsigned.
+            const __m128i hits = _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(block, quote),
+                             _mm_cmpeq_epi8(block, backslash)),
+                _mm_cmpeq_epi8(_mm_max_epu8(block, control), control));
+            const int mask = _mm_movemask_epi8(hits);
+            if (mask != 0) {
+                return i + __builtin_ctz(mask);
+            }
+        }
+        return i + scalar_find_json_escape(text + i, length - i);
+    }
+
+    __attribute__((target("sse2")))
+    bool sse2_is_valid_utf8(const char * text, size_t length) {
+        const unsigned char * s = (const unsigned char *) text;
+        const unsigned char * const end = s + length;
+        while (end - s >= 16) {
+            const int mask =
+                _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) s));
+            if (mask == 0) {
+                s += 16;
+                continue;
+            }
+            s += __builtin_ctz(mask);
+            const size_t sequence = valid_sequence_length(s, end);
+            if (sequence == 0) {
+                return false;
+            }
+            s += sequence;
+        }
+        return scalar_is_valid_utf8((const char *) s, end - s);
+    }
+
+    __attribute__((target("avx2")))
+    size_t avx2_find_json_escape(const char * text, size_t length) {
+        const __m256i quote = _mm256_set1_epi8('"');
+        const __m256i backslash = _mm256_set1_epi8('\\');
+        const __m256i control = _mm256_set1_epi8(0x1F);
+        size_t i = 0;
+        for (; i + 32 <= length; i += 32) {
+            const __m256i block =
+                _mm256_loadu_si256((const __m256i *) (text + i));
+            const __m256i hits = _mm256_or_si256(
+                _mm256_or_si256(_mm256_cmpeq_epi8(block, quote),
+                                _mm256_cmpeq_epi8(block, backslash)),
+                _mm256_cmpeq_epi8(_mm256_max_epu8(block, control), control));
+            const unsigned int mask =
+                (unsigned int) _mm256_movemask_epi8(hits);
+            if (mask != 0) {
+                return i + __builtin_ctz(mask);
+            }
+        }
+        return i + scalar_find_json_escape(text + i, length - i);
+    }
+
+    __attribute__((target("avx2")))
+    bool avx2_is_valid_utf8(const char * text, size_t length) {
+        const unsigned char * s = (const unsigned char *) text;
+        const unsigned char * const end = s + length;
+        while (end - s >= 32) {
+            const unsigned int mask = (unsigned int)
+                _mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *) s));
+            if (mask == 0) {
+                s += 32;
+                continue;
+            }
+            s += __builtin_ctz(mask);
+            const size_t sequence = valid_sequence_length(s, end);
+            if (sequence == 0) {
+                return false;
+            }
+            s += sequence;
+        }
+        return scalar_is_valid_utf8((const char *) s, end - s);
+    }
+
+#endif
+
+    vector<TextScanner> find_scanners() {
+        vector<TextScanner> scanners;
+        TextScanner scalar = { "scalar", scalar_find_json_escape,
+                               scalar_is_valid_utf8 };
+        scanners.push_back(scalar);
+        #ifdef NOVA_TEXT_SIMD
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("sse2")) {
+                TextScanner sse2 = { "sse2", sse2_find_json_escape,
+                                     sse2_is_valid_utf8 };
+                scanners.push_back(sse2);
+                if (__builtin_cpu_supports("avx2")) {
+                    TextScanner avx2 = { "avx2", avx2_find_json_escape,
+                                         avx2_is_valid_utf8 };
+                    scanners.push_back(avx2);
+                }
+            }
+        #endif
+        return scanners;
+    }
+
+} // end anonymous namespace
+
+
+const vector<TextScanner> & available_text_scanners() {
+    static const vector<TextScanner> scanners = find_scanners();
+    return scanners;
+}
+
+const TextScanner & text_scanner() {
+    static const TextScanner & best = available_text_scanners().back();
+    return best;
+}
+
+} }  // end namespace
@@ -3,7 +3,9 @@
 #include "nova/guest/apt.h"
 #include "nova/ConfigFile.h"
 #include "nova/flags.h"
+#include <boost/bind.hpp>
 #include <boost/format.hpp>
+#include "nova/guest/dispatcher.h"
 #include "nova/guest/guest.h"
 #include "nova/guest/GuestException.h"
 #include <boost/lexical_cast.hpp>
@@ -17,6 +19,9 @@
 #include <sstream>
 #include <boost/thread.hpp>
 #include "nova/guest/utils.h"
+#include "nova/utils/reactor.h"
+#include <signal.h>
+#include <vector>
 
 
 /* In release mode, all errors should be caught so the guest will not die.
@@ -28,7 +33,6 @@
      } catch(const std::exception & e) { \
         log.error2("Error in " name "! : %s", e.what()); \
      }
-#define CATCH_RPC_METHOD_ERRORS
 ////////#endif
 
 using nova::db::ApiPtr;
@@ -45,6 +49,7 @@ using namespace nova::guest::mysql;
 using nova::db::NewService;
 using namespace nova::rpc;
 using nova::db::ServicePtr;
+using nova::utils::Reactor;
 using std::string;
 
 
@@ -54,60 +59,59 @@ const char PERIODIC_MESSAGE [] =
     "    'args':{}"
     "}";
 
-static bool quit;
-
-/* This runs in a different thread and just sends messages to the queue,
- * which cause the periodic_tasks to run. This keeps us from having to ensure
- * everything else is thread-safe. */
+/* Runs the periodic tasks and state reports on a lane of their own, one at a
+ * time. If a timer fires while its last run hasn't started yet, the fire is
+ * skipped rather than queued, so a slow update can't pile up work behind it.
+ * State reports use their own connection to the Nova DB since the status
+ * updater's is used by the workers. */
 //TODO(tim.simpson): Rename this to nova::service::Service.
 class PeriodicTasker {
 
 private:
+    boost::thread lane;
+    boost::mutex lane_mutex;
     Log log;
     JsonObject message;
-    MySqlConnectionPtr nova_db;
     string nova_db_name;
+    bool periodic_pending;
+    MySqlConnectionPtr report_db;
+    bool report_pending;
     NewService service_key;
     MySqlNovaUpdaterPtr status_updater;
+    bool stopping;
+    boost::condition_variable work_available;
 
 public:
-    PeriodicTasker(MySqlConnectionPtr nova_db, string nova_db_name,
+    PeriodicTasker(MySqlConnectionPtr report_db, string nova_db_name,
                    MySqlNovaUpdaterPtr status_updater, NewService service_key)
-      : log(),
+      : lane(),
+        lane_mutex(),
+        log(),
         message(PERIODIC_MESSAGE),
-        nova_db(nova_db),
         nova_db_name(nova_db_name),
+        periodic_pending(false),
+        report_db(report_db),
+        report_pending(false),
         service_key(service_key),
-        status_updater(status_updater)
+        status_updater(status_updater),
+        stopping(false),
+        work_available()
     {
+        lane = boost::thread(boost::bind(&PeriodicTasker::run, this));
     }
 
-    void ensure_db() {
-        nova_db->ensure();
-        nova_db->use_database(nova_db_name.c_str());
-    }
-
-    void loop(unsigned long periodic_interval, unsigned long report_interval) {
-        unsigned long next_periodic_task = periodic_interval;
-        unsigned long next_reporting = report_interval;
-        while(!quit) {
-            unsigned long wait_time = next_periodic_task < next_reporting ?
-                next_periodic_task : next_reporting;
-            log.info2("Waiting for %lu seconds...", wait_time);
-            boost::posix_time::seconds time(wait_time);
-            boost::this_thread::sleep(time);
-            next_periodic_task -= wait_time;
-            next_reporting -= wait_time;
-
-            if (next_periodic_task <= 0) {
-                next_periodic_task += periodic_interval;
-                periodic_tasks();
-            }
-            if (next_reporting <= 0) {
-                next_reporting += report_interval;
-                report_state();
-            }
+    ~PeriodicTasker() {
+        {
+            boost::lock_guard<boost::mutex> lock(lane_mutex);
+            stopping = true;
         }
+        work_available.notify_one();
+        lane.join();
+    }
+
+    void ensure_db() {
+        report_db->ensure();
+        report_db->use_database(nova_db_name.c_str());
     }
 
     void periodic_tasks() {
@@ -120,12 +124,160 @@ public:
     void report_state() {
         START_THREAD_TASK();
             ensure_db();
-            ApiPtr api = nova::db::create_api(nova_db, nova_db_name);
+            ApiPtr api = nova::db::create_api(report_db, nova_db_name);
             ServicePtr service = api->service_create(service_key);
             service->report_count ++;
             api->service_update(*service);
         END_THREAD_TASK("report_state()");
     }
+
+    /* Called by the reactor's timers. */
+    void request_periodic_tasks() {
+        request(periodic_pending, "periodic_tasks()");
+    }
+
+    void request_report_state() {
+        request(report_pending, "report_state()");
+    }
+
+private:
+    void request(bool & pending, const char * name) {
+        {
+            boost::lock_guard<boost::mutex> lock(lane_mutex);
+            if (pending) {
+                log.info2("Skipping %s, the last one has not run yet.", name);
+                return;
+            }
+            pending = true;
+        }
+        work_available.notify_one();
+    }
+
+    void run() {
+        boost::unique_lock<boost::mutex> lock(lane_mutex);
+        while (!stopping) {
+            if (report_pending) {
+                report_pending = false;
+                lock.unlock();
+                report_state();
+                lock.lock();
+            } else if (periodic_pending) {
+                periodic_pending = false;
+                lock.unlock();
+                periodic_tasks();
+                lock.lock();
+            } else {
+                work_available.wait(lock);
+            }
+        }
+    }
+};
+
+
+/* Everything to do with AMQP happens on the main thread, driven by the
+ * reactor. Methods run on the dispatcher's workers; when they finish the
+ * results come back here to be acknowledged and replied to. */
+class MessageLoop {
+
+private:
+    std::vector<Dispatcher::Completion> completed;
+    Dispatcher & dispatcher;
+    int heartbeat_timer;
+    Log log;
+    Reactor & reactor;
+    ResilentReceiver & receiver;
+    unsigned long watched_generation;
+    int watched_socket;
+
+public:
+    MessageLoop(Reactor & reactor, ResilentReceiver & receiver,
+                Dispatcher & dispatcher, int heartbeat)
+      : completed(),
+        dispatcher(dispatcher),
+        heartbeat_timer(-1),
+        log(),
+        reactor(reactor),
+        receiver(receiver),
+        watched_generation(receiver.get_connection_generation()),
+        watched_socket(receiver.get_socket_fd())
+    {
+        reactor.add_reader(watched_socket,
+                           boost::bind(&MessageLoop::on_socket_ready, this));
+        reactor.add_reader(dispatcher.get_completion_fd(),
+                           boost::bind(&MessageLoop::on_completions, this));
+        if (heartbeat > 0) {
+            // Nothing else touches the connection while no messages come,
+            // so heartbeats have to be kept up from here.
+            heartbeat_timer = reactor.add_timer(heartbeat / 2.0,
+                heartbeat / 2.0, boost::bind(&MessageLoop::on_heartbeat, this));
+        }
+    }
+
+    ~MessageLoop() {
+        if (heartbeat_timer >= 0) {
+            reactor.remove_timer(heartbeat_timer);
+        }
+        reactor.remove_reader(watched_socket);
+        reactor.remove_reader(dispatcher.get_completion_fd());
+    }
+
+    void on_completions() {
+        dispatcher.take_completions(completed);
+        for (size_t i = 0; i < completed.size(); i ++) {
+            receiver.finish_message(completed[i].input, completed[i].output);
+        }
+        completed.clear();
+        // Deliveries may have been read while waiting on publisher confirms.
+        read_buffered_messages();
+    }
+
+    void on_heartbeat() {
+        receiver.service_heartbeat();
+        read_buffered_messages();
+    }
+
+    void on_socket_ready() {
+        read_message();
+        read_buffered_messages();
+    }
+
+    void read_buffered_messages() {
+        while(watch_current_socket() && receiver.has_buffered_messages()) {
+            read_message();
+        }
+    }
+
+    void read_message() {
+        optional<GuestInput> input = receiver.read_message();
+        if (input) {
+            log.info2("method=%s", input->method_name.c_str());
+            try {
+                dispatcher.dispatch(input.get());
+            } catch(const std::exception & e) {
+                // It still has to be finished, or the receiver holds on to
+                // any copies of it.
+                log.error2("Could not dispatch %s: %s",
+                           input->method_name.c_str(), e.what());
+                GuestOutput output;
+                output.failure = string(e.what());
+                receiver.finish_message(input.get(), output);
+            }
+        }
+    }
+
+    /* If the receiver reconnected, starts watching the new socket. Returns
+     * false if it did, as the old connection's buffers are gone too. */
+    bool watch_current_socket() {
+        if (receiver.get_connection_generation() == watched_generation) {
+            return true;
+        }
+        reactor.remove_reader(watched_socket);
+        watched_generation = receiver.get_connection_generation();
+        watched_socket = receiver.get_socket_fd();
+        reactor.add_reader(watched_socket,
+                           boost::bind(&MessageLoop::on_socket_ready, this));
+        return false;
+    }
 };
 
 
@@ -137,7 +289,6 @@ AmqpConnectionPtr make_amqp_connection(FlagValues & flags) {
 }
 
 int main(int argc, char* argv[]) {
-    quit = false;
     Log log;
 
     // Initialize MySQL libraries. This should be done before spawning threads.
@@ -152,18 +303,36 @@ int main(int argc, char* argv[]) {
         /* Grab flag values. */
         FlagValues flags(FlagMap::create_from_args(argc, argv, true));
 
+        /* Create the event loop. Signals must be set up before any threads
+         * start so that none of them get the signals instead. */
+        Reactor reactor;
+        reactor.add_signal_handler(SIGINT, boost::bind(&Reactor::stop,
+                                                       &reactor));
+        reactor.add_signal_handler(SIGTERM, boost::bind(&Reactor::stop,
+                                                        &reactor));
+        // Sent by logrotate once it has moved the file aside.
+        reactor.add_signal_handler(SIGHUP, boost::bind(&Log::reopen_file));
+
+        /* Move writing logs off the threads doing the work. */
+        if (flags.log_async()) {
+            LogConfig log_config;
+            log_config.file = flags.log_file();
+            log_config.queue_size = flags.log_queue_size();
+            Log::start_async(log_config);
+        }
+
         /* Create connection to Nova database. */
         MySqlConnectionPtr nova_db(new MySqlConnection(
             flags.nova_sql_host(), flags.nova_sql_user(),
             flags.nova_sql_password()));
 
         /* Create JSON message handlers. */
-        const int handler_count = 2;
-        MessageHandlerPtr handlers[handler_count];
+        std::vector<MessageHandlerPtr> handlers;
 
         /* Create Apt Guest */
         AptGuest apt_worker(flags.apt_use_sudo());
-        handlers[0].reset(new AptMessageHandler(&apt_worker));
+        handlers.push_back(MessageHandlerPtr(
+            new AptMessageHandler(&apt_worker)));
 
         /* Create MySQL updater. */
         MySqlNovaUpdaterPtr mysql_status_updater(new MySqlNovaUpdater(
@@ -175,7 +344,8 @@ int main(int argc, char* argv[]) {
         MySqlMessageHandlerConfig mysql_config;
         mysql_config.apt = &apt_worker;
         mysql_config.sql_updater = mysql_status_updater;
-        handlers[1].reset(new MySqlMessageHandler(mysql_config));
+        handlers.push_back(MessageHandlerPtr(
+            new MySqlMessageHandler(mysql_config)));
 
         /* Set host value. */
         string actual_host = nova::guest::utils::get_host_name();
@@ -187,60 +357,90 @@ int main(int argc, char* argv[]) {
         service_key.binary = "nova-guest";
         service_key.host = host;
         service_key.topic = "guest";  // Real nova takes binary after "nova-".
-        PeriodicTasker tasker(nova_db, flags.nova_sql_database(),
+        MySqlConnectionPtr report_db(new MySqlConnection(
+            flags.nova_sql_host(), flags.nova_sql_user(),
+            flags.nova_sql_password()));
+        PeriodicTasker tasker(report_db, flags.nova_sql_database(),
                               mysql_status_updater, service_key);
 
         /* Create AMQP connection. */
-        string topic = "guest.";
+        const char * const shared_topic = "guest";
+        string topic = shared_topic;
+        topic += ".";
         topic += nova::guest::utils::get_host_name();
 
-        quit = false;
-
-        /* Start periodic task / report thread. */
-        boost::thread workerThread(&PeriodicTasker::loop, &tasker,
-                                   flags.periodic_interval(),
-                                   flags.report_interval());
-
         /* Create receiver. */
+        ReceiverConfig receiver_config;
+        receiver_config.compression_threshold =
+            flags.rabbit_compression_threshold();
+        receiver_config.heartbeat = flags.rabbit_heartbeat();
+        receiver_config.max_reconnect_wait_time =
+            flags.rabbit_max_reconnect_wait_time();
+        std::stringstream budgets(flags.guest_method_time_budgets());
+        string budget;
+        while (std::getline(budgets, budget, ',')) {
+            size_t equals = budget.find('=');
+            if (equals != string::npos) {
+                receiver_config.method_time_budgets[budget.substr(0, equals)]
+                    = atof(budget.substr(equals + 1).c_str());
+            }
+        }
+        receiver_config.prefetch_count = flags.rabbit_prefetch_count();
+        receiver_config.publisher_confirms = flags.rabbit_publisher_confirms();
+        receiver_config.reply_cache_path = flags.reply_cache_path();
+        receiver_config.reply_cache_size = flags.reply_cache_size();
+        receiver_config.time_budget = flags.guest_message_time_budget();
+        if (flags.rabbit_listen_to_topic()) {
+            receiver_config.shared_topic = shared_topic;
+        }
+        if (flags.rabbit_listen_to_fanout()) {
+            receiver_config.fanout_exchange = string(shared_topic) + "_fanout";
+        }
+        if (flags.rabbit_listen_to_priority()) {
+            receiver_config.priority_topic = topic + ".priority";
+        }
         ResilentReceiver receiver(flags.rabbit_host(), flags.rabbit_port(),
             flags.rabbit_userid(), flags.rabbit_password(),
             flags.rabbit_client_memory(), topic.c_str(),
-            flags.control_exchange(),  flags.rabbit_reconnect_wait_time());
-
-        while(!quit) {
-            GuestInput input = receiver.next_message();
-            log.info2("method=%s", input.method_name.c_str());
-
-            GuestOutput output;
-
-            #ifdef CATCH_RPC_METHOD_ERRORS
-            try {
-            #endif
-                for (int i = 0; i < handler_count && !output.result; i ++) {
-                    output.result = handlers[i]->handle_message(input);
-                }
-                if (!output.result) {
-                    throw GuestException(GuestException::NO_SUCH_METHOD);
-                }
-                output.failure = boost::none;
-            #ifdef CATCH_RPC_METHOD_ERRORS
-            } catch(const std::exception & e) {
-                log.error2("Error running method %s : %s",
-                           input.method_name.c_str(), e.what());
-                log.error(e.what());
-                output.result.reset();
-                output.failure = e.what();
+            flags.control_exchange(),  flags.rabbit_reconnect_wait_time(),
+            receiver_config);
+
+        /* Create dispatcher. */
+        Dispatcher dispatcher(handlers, flags.guest_worker_count());
+        // These only read, so they can run alongside anything, and a burst
+        // of identical ones only needs to run once.
+        const char * const shared_methods[] = {
+            "is_root_enabled", "list_databases", "list_users", "version", 0
+        };
+        for (const char * const * itr = shared_methods; *itr != 0; itr ++) {
+            dispatcher.set_concurrency_class(*itr, Dispatcher::SHARED);
+            dispatcher.set_single_flight(*itr);
+        }
+        std::stringstream priority_methods(flags.guest_priority_methods());
+        string method_name;
+        while (std::getline(priority_methods, method_name, ',')) {
+            if (!method_name.empty()) {
+                dispatcher.set_high_priority(method_name.c_str());
             }
-            #endif
-
-            receiver.finish_message(output);
         }
+
+        /* Start periodic tasks. */
+        reactor.add_timer(flags.periodic_interval(), flags.periodic_interval(),
+            boost::bind(&PeriodicTasker::request_periodic_tasks, &tasker));
+        reactor.add_timer(flags.report_interval(), flags.report_interval(),
+            boost::bind(&PeriodicTasker::request_report_state, &tasker));
+
+        MessageLoop message_loop(reactor, receiver, dispatcher,
+                                 receiver_config.heartbeat);
+        reactor.run();
+        log.info("Shutting down.");
 #ifndef _DEBUG
     } catch (const std::exception & e) {
         log.error2("Error: %s", e.what());
     }
 #endif
 
+    Log::stop_async();
     MySqlConnection::shut_down();
     return 0;
 }
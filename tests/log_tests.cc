@@ -1,6 +1,15 @@
 #define BOOST_TEST_MODULE ConfigFile_Tests
 #include <boost/test/unit_test.hpp>
 #include "nova/Log.h"
+#include <boost/bind.hpp>
+#include <fstream>
+#include <map>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <boost/thread.hpp>
+#include <vector>
 
 
 using nova::Log;
@@ -42,3 +51,166 @@ BOOST_AUTO_TEST_CASE(test_log_info2)
 
     log.info2("this is %s big test", biggest.c_str());
 }
+
+namespace {
+
+    const char * LOG_FILE = "log_tests.log";
+
+    /* Starts logging asynchronously to a fresh file. */
+    void start_async(size_t queue_size = 512) {
+        remove(LOG_FILE);
+        nova::LogConfig config;
+        config.file = LOG_FILE;
+        config.queue_size = queue_size;
+        Log::start_async(config);
+    }
+
+    /* Stops logging asynchronously and returns what was written, without
+     * the time and level in front of each line. */
+    std::vector<std::string> stop_async() {
+        Log::stop_async();
+        std::vector<std::string> lines;
+        std::ifstream file(LOG_FILE);
+        std::string line;
+        while (std::getline(file, line)) {
+            // "YYYY-MM-DD HH:MM:SS.uuuuuu LEVEL "
+            const size_t level_end = line.find(' ', 27);
+            BOOST_REQUIRE(level_end != std::string::npos);
+            lines.push_back(line.substr(level_end + 1));
+        }
+        remove(LOG_FILE);
+        return lines;
+    }
+
+    /* The size of the file, or -1 if there isn't one. */
+    long file_size(const char * path) {
+        struct stat info;
+        return stat(path, &info) == 0 ? (long) info.st_size : -1;
+    }
+
+    void log_many(int count) {
+        Log log;
+        for (int i = 0; i < count; i ++) {
+            log.info2("message %d", i);
+        }
+    }
+
+}
+
+BOOST_AUTO_TEST_CASE(async_formats_like_printf)
+{
+    Log log;
+    start_async();
+    const char not_terminated[] = { 'a', 'b', 'c', 'd' };
+    log.info2("%s %d %lu %.2f %08x [%.*s] %5s%% %c %s", "str", -42,
+              (unsigned long) 4000000000UL, 3.14159, 0xbeefu, 3,
+              not_terminated, "pad", 'z', (const char *) 0);
+    log.error2("%-4d|%*d|%.3s|%hhu", 7, 6, 21, "truncated", 257);
+    log.info("plain");
+    std::vector<std::string> lines = stop_async();
+    BOOST_REQUIRE_EQUAL(lines.size(), (size_t) 3);
+    BOOST_CHECK_EQUAL(lines[0], "str -42 4000000000 3.14 0000beef [abc]   "
+                                "pad% z (null)");
+    BOOST_CHECK_EQUAL(lines[1], "7   |    21|tru|1");
+    BOOST_CHECK_EQUAL(lines[2], "plain");
+}
+
+BOOST_AUTO_TEST_CASE(async_copies_strings_when_logging)
+{
+    Log log;
+    start_async();
+    char buffer[] = "before";
+    std::string big(300, 'x');
+    log.info2("%s %s", buffer, big.c_str());
+    strcpy(buffer, "after");
+    big.assign(300, 'y');
+    std::vector<std::string> lines = stop_async();
+    BOOST_REQUIRE_EQUAL(lines.size(), (size_t) 1);
+    BOOST_CHECK_EQUAL(lines[0], "before " + std::string(300, 'x'));
+}
+
+BOOST_AUTO_TEST_CASE(async_cuts_off_long_messages)
+{
+    Log log;
+    start_async();
+    log.info2("%s", std::string(4096, 'a').c_str());
+    std::vector<std::string> lines = stop_async();
+    BOOST_REQUIRE_EQUAL(lines.size(), (size_t) 1);
+    BOOST_CHECK_EQUAL(lines[0], std::string(1023, 'a'));
+}
+
+BOOST_AUTO_TEST_CASE(async_writes_every_thread_in_order)
+{
+    start_async(4096);
+    boost::thread_group threads;
+    for (int i = 0; i < 4; i ++) {
+        threads.create_thread(boost::bind(log_many, 1000));
+    }
+    threads.join_all();
+    const unsigned long dropped = Log::get_dropped_count();
+    std::vector<std::string> lines = stop_async();
+    BOOST_CHECK_EQUAL(dropped, 0ul);
+    BOOST_REQUIRE_EQUAL(lines.size(), (size_t) 4000);
+    // Each thread's messages come out in the order it logged them.
+    std::map<std::string, int> seen;
+    for (size_t i = 0; i < lines.size(); i ++) {
+        const int number = atoi(lines[i].c_str() + strlen("message "));
+        seen[lines[i]] ++;
+        BOOST_CHECK(number >= 0 && number < 1000);
+    }
+    BOOST_CHECK_EQUAL(seen.size(), (size_t) 1000);
+    BOOST_CHECK_EQUAL(seen["message 0"], 4);
+    BOOST_CHECK_EQUAL(seen["message 999"], 4);
+}
+
+BOOST_AUTO_TEST_CASE(async_drops_when_the_queue_is_full)
+{
+    const unsigned long dropped_before = Log::get_dropped_count();
+    start_async(2);
+    const int count = 20000;
+    log_many(count);
+    const unsigned long dropped = Log::get_dropped_count() - dropped_before;
+    std::vector<std::string> lines = stop_async();
+    BOOST_CHECK(dropped > 0);
+    size_t written = 0;
+    for (size_t i = 0; i < lines.size(); i ++) {
+        if (lines[i].compare(0, 8, "message ") == 0) {
+            written ++;
+        } else {
+            BOOST_CHECK_EQUAL(lines[i].compare(0, 8, "Dropped "), 0);
+        }
+    }
+    BOOST_CHECK_EQUAL(written + dropped, (size_t) count);
+}
+
+BOOST_AUTO_TEST_CASE(async_reopens_the_file_when_asked)
+{
+    Log log;
+    start_async();
+    log.info("before");
+    // Waits for the writer as logrotate would, by the file growing.
+    for (int i = 0; i < 100 && file_size(LOG_FILE) == 0; i ++) {
+        boost::this_thread::sleep(boost::posix_time::milliseconds(20));
+    }
+    const std::string rotated = std::string(LOG_FILE) + ".1";
+    BOOST_REQUIRE_EQUAL(rename(LOG_FILE, rotated.c_str()), 0);
+    Log::reopen_file();
+    for (int i = 0; i < 100 && file_size(LOG_FILE) < 0; i ++) {
+        boost::this_thread::sleep(boost::posix_time::milliseconds(20));
+    }
+    log.info("after");
+    std::vector<std::string> lines = stop_async();
+    BOOST_REQUIRE_EQUAL(lines.size(), (size_t) 1);
+    BOOST_CHECK_EQUAL(lines[0], "after");
+    BOOST_CHECK(file_size(rotated.c_str()) > 0);
+    remove(rotated.c_str());
+}
+
+BOOST_AUTO_TEST_CASE(stopping_async_goes_back_to_syslog)
+{
+    Log log;
+    start_async();
+    stop_async();
+    Log::stop_async();
+    log.info2("this %s synchronous", "is");
+}
@@ -0,0 +1,262 @@
+#define BOOST_TEST_MODULE dispatcher_tests
+#include <boost/test/unit_test.hpp>
+
+#include <boost/bind.hpp>
+#include "nova/guest/dispatcher.h"
+#include "nova/json.h"
+#include <sys/select.h>
+#include <time.h>
+#include <string>
+#include <vector>
+
+using namespace nova;
+using namespace nova::guest;
+using std::string;
+using std::vector;
+
+
+/**---------------------------------------------------------------------------
+ *- Helpers
+ *---------------------------------------------------------------------------*/
+
+/** Handles "block" by waiting until released, and "echo" and "probe"
+ *  right away. */
+class BlockingHandler : public MessageHandler {
+
+public:
+    BlockingHandler() : blocked(0), released(false) {
+    }
+
+    virtual JsonDataPtr handle_message(const GuestInput & input) {
+        if (input.method_name == "block") {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            blocked ++;
+            changed.notify_all();
+            while(!released) {
+                changed.wait(lock);
+            }
+        } else if (input.method_name != "echo"
+                   && input.method_name != "probe") {
+            return JsonDataPtr();
+        }
+        return JsonDataPtr(new JsonObject("{}"));
+    }
+
+    void release() {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        released = true;
+        changed.notify_all();
+    }
+
+    void wait_until_blocked(int count) {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while(blocked < count) {
+            changed.wait(lock);
+        }
+    }
+
+    int blocked_count() {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        return blocked;
+    }
+
+private:
+    int blocked;
+    boost::condition_variable changed;
+    boost::mutex mutex;
+    bool released;
+};
+
+GuestInput make_input(const char * method_name, int delivery_tag) {
+    GuestInput input;
+    input.method_name = method_name;
+    input.delivery_tag = delivery_tag;
+    return input;
+}
+
+/** Waits on the completion fd until there are count completions. */
+vector<Dispatcher::Completion> wait_for(Dispatcher & dispatcher, size_t count) {
+    vector<Dispatcher::Completion> completed;
+    while(completed.size() < count) {
+        fd_set read_fds;
+        FD_ZERO(&read_fds);
+        FD_SET(dispatcher.get_completion_fd(), &read_fds);
+        select(dispatcher.get_completion_fd() + 1, &read_fds, 0, 0, 0);
+        dispatcher.take_completions(completed);
+    }
+    return completed;
+}
+
+void set_flag(bool * flag) {
+    *flag = true;
+}
+
+struct DispatcherFixture {
+    boost::shared_ptr<BlockingHandler> handler;
+    vector<MessageHandlerPtr> handlers;
+
+    DispatcherFixture() : handler(new BlockingHandler()) {
+        handlers.push_back(handler);
+    }
+};
+
+
+/**---------------------------------------------------------------------------
+ *- Tests
+ *---------------------------------------------------------------------------*/
+
+BOOST_FIXTURE_TEST_CASE(shared_methods_are_not_held_up, DispatcherFixture)
+{
+    Dispatcher dispatcher(handlers, 2);
+    dispatcher.set_concurrency_class("echo", Dispatcher::SHARED);
+
+    dispatcher.dispatch(make_input("block", 1));
+    handler->wait_until_blocked(1);
+    dispatcher.dispatch(make_input("echo", 2));
+
+    vector<Dispatcher::Completion> completed = wait_for(dispatcher, 1);
+    BOOST_REQUIRE_EQUAL(completed.size(), 1u);
+    BOOST_CHECK_EQUAL(completed[0].input.delivery_tag, 2);
+    BOOST_CHECK(!completed[0].output.failure);
+    BOOST_CHECK_EQUAL(dispatcher.get_outstanding_count(), 1u);
+
+    handler->release();
+    completed = wait_for(dispatcher, 1);
+    BOOST_CHECK_EQUAL(completed[0].input.delivery_tag, 1);
+    BOOST_CHECK_EQUAL(dispatcher.get_outstanding_count(), 0u);
+}
+
+BOOST_FIXTURE_TEST_CASE(exclusive_methods_run_one_at_a_time, DispatcherFixture)
+{
+    Dispatcher dispatcher(handlers, 3);
+
+    dispatcher.dispatch(make_input("block", 1));
+    dispatcher.dispatch(make_input("block", 2));
+    dispatcher.dispatch(make_input("echo", 3));
+    handler->wait_until_blocked(1);
+
+    // Give the idle workers a chance to do something they shouldn't.
+    boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+    BOOST_CHECK_EQUAL(handler->blocked_count(), 1);
+
+    handler->release();
+    vector<Dispatcher::Completion> completed = wait_for(dispatcher, 3);
+    BOOST_REQUIRE_EQUAL(completed.size(), 3u);
+    BOOST_CHECK_EQUAL(completed[0].input.delivery_tag, 1);
+    BOOST_CHECK_EQUAL(completed[1].input.delivery_tag, 2);
+    BOOST_CHECK_EQUAL(completed[2].input.delivery_tag, 3);
+}
+
+BOOST_FIXTURE_TEST_CASE(high_priority_messages_go_first, DispatcherFixture)
+{
+    Dispatcher dispatcher(handlers, 1);
+    dispatcher.set_high_priority("probe");
+
+    dispatcher.dispatch(make_input("block", 1));
+    handler->wait_until_blocked(1);
+    dispatcher.dispatch(make_input("echo", 2));
+    dispatcher.dispatch(make_input("echo", 3));
+    dispatcher.dispatch(make_input("probe", 4));
+    GuestInput flagged = make_input("echo", 5);
+    flagged.high_priority = true;
+    dispatcher.dispatch(flagged);
+
+    handler->release();
+    vector<Dispatcher::Completion> completed = wait_for(dispatcher, 5);
+    BOOST_REQUIRE_EQUAL(completed.size(), 5u);
+    BOOST_CHECK_EQUAL(completed[0].input.delivery_tag, 1);
+    BOOST_CHECK_EQUAL(completed[1].input.delivery_tag, 4);
+    BOOST_CHECK_EQUAL(completed[2].input.delivery_tag, 5);
+    BOOST_CHECK_EQUAL(completed[3].input.delivery_tag, 2);
+    BOOST_CHECK_EQUAL(completed[4].input.delivery_tag, 3);
+}
+
+BOOST_FIXTURE_TEST_CASE(expired_messages_are_not_run, DispatcherFixture)
+{
+    Dispatcher dispatcher(handlers, 1);
+    GuestInput expired = make_input("block", 1);
+    expired.deadline = time(0) - 10.0;
+    dispatcher.dispatch(expired);
+    GuestInput current = make_input("echo", 2);
+    current.deadline = time(0) + 60.0;
+    dispatcher.dispatch(current);
+
+    vector<Dispatcher::Completion> completed = wait_for(dispatcher, 2);
+    BOOST_REQUIRE_EQUAL(completed.size(), 2u);
+    BOOST_CHECK_EQUAL(handler->blocked_count(), 0);
+    BOOST_CHECK_EQUAL(completed[0].input.delivery_tag, 1);
+    BOOST_CHECK(!completed[0].output.result);
+    BOOST_REQUIRE(!!completed[0].output.failure);
+    BOOST_CHECK_EQUAL(completed[0].output.failure.get(),
+                      "The message expired before it could be run.");
+    BOOST_CHECK_EQUAL(completed[1].input.delivery_tag, 2);
+    BOOST_CHECK(!completed[1].output.failure);
+}
+
+BOOST_FIXTURE_TEST_CASE(identical_reads_share_one_run, DispatcherFixture)
+{
+    Dispatcher dispatcher(handlers, 3);
+    dispatcher.set_concurrency_class("block", Dispatcher::SHARED);
+    dispatcher.set_single_flight("block");
+
+    GuestInput first = make_input("block", 1);
+    first.args_text = "{ 'name':'a', 'limit':10 }";
+    dispatcher.dispatch(first);
+    handler->wait_until_blocked(1);
+    GuestInput same = make_input("block", 2);
+    same.args_text = "{ 'limit':10, 'name':'a' }";
+    dispatcher.dispatch(same);
+    GuestInput different = make_input("block", 3);
+    different.args_text = "{ 'name':'b', 'limit':10 }";
+    dispatcher.dispatch(different);
+    handler->wait_until_blocked(2);
+
+    // Give the idle worker a chance to do something it shouldn't.
+    boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+    BOOST_CHECK_EQUAL(handler->blocked_count(), 2);
+
+    handler->release();
+    vector<Dispatcher::Completion> completed = wait_for(dispatcher, 3);
+    BOOST_REQUIRE_EQUAL(completed.size(), 3u);
+    int tags = 0;
+    for (size_t i = 0; i < completed.size(); i ++) {
+        BOOST_CHECK(!completed[i].output.failure);
+        tags |= 1 << completed[i].input.delivery_tag;
+    }
+    BOOST_CHECK_EQUAL(tags, 2 | 4 | 8);
+    BOOST_CHECK_EQUAL(dispatcher.get_outstanding_count(), 0u);
+
+    // Once finished, the same message runs again.
+    dispatcher.dispatch(first);
+    wait_for(dispatcher, 1);
+    BOOST_CHECK_EQUAL(handler->blocked_count(), 3);
+}
+
+BOOST_FIXTURE_TEST_CASE(unknown_methods_fail, DispatcherFixture)
+{
+    Dispatcher dispatcher(handlers, 1);
+    dispatcher.dispatch(make_input("nonexistent", 7));
+
+    vector<Dispatcher::Completion> completed = wait_for(dispatcher, 1);
+    BOOST_REQUIRE_EQUAL(completed.size(), 1u);
+    BOOST_CHECK_EQUAL(completed[0].input.delivery_tag, 7);
+    BOOST_CHECK(!completed[0].output.result);
+    BOOST_CHECK(!!completed[0].output.failure);
+}
+
+BOOST_FIXTURE_TEST_CASE(tasks_run_beside_exclusive_methods, DispatcherFixture)
+{
+    Dispatcher dispatcher(handlers, 2);
+    dispatcher.dispatch(make_input("block", 1));
+    handler->wait_until_blocked(1);
+
+    bool ran = false;
+    dispatcher.post(boost::bind(set_flag, &ran));
+    for (int i = 0; i < 100 && !ran; i ++) {
+        boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+    }
+    BOOST_CHECK(ran);
+
+    handler->release();
+    wait_for(dispatcher, 1);
+}
@@ -0,0 +1,134 @@
+#define BOOST_TEST_MODULE dom_tests
+#include <boost/test/unit_test.hpp>
+
+#include <boost/format.hpp>
+#include "nova/json/dom.h"
+#include <string>
+#include <string.h>
+
+using boost::format;
+using nova::JsonException;
+using namespace nova::json;
+using std::string;
+
+
+// Asserts the given bit of code throws a JsonException with the given code.
+#define CHECK_JSON_EXCEPTION(statement, ex_code) try { \
+        statement ; \
+        BOOST_FAIL("Should have thrown."); \
+    } catch(const JsonException & je) { \
+        BOOST_CHECK_EQUAL(JsonException::code_to_string(je.code), \
+            JsonException::code_to_string(JsonException::ex_code)); \
+    }
+
+
+/**---------------------------------------------------------------------------
+ *- Tests
+ *---------------------------------------------------------------------------*/
+
+BOOST_AUTO_TEST_CASE(values_of_every_type)
+{
+    DocumentPtr doc = Document::parse(
+        "{ \"a\":[1, -2.5, true, false, null], \"s\":\"text\", \"o\":{} }");
+    Value root = doc->root();
+    BOOST_CHECK_EQUAL(root.get_type(), OBJECT);
+    BOOST_CHECK_EQUAL(root.size(), 3u);
+    BOOST_CHECK_EQUAL(root.key_at(0), "a");
+    BOOST_CHECK_EQUAL(root.key_at(2), "o");
+
+    Value a = root.get("a");
+    BOOST_CHECK_EQUAL(a.size(), 5u);
+    BOOST_CHECK_EQUAL(a.at(0).get_int(), 1);
+    BOOST_CHECK_EQUAL(a.at(0).get_double(), 1.0);
+    BOOST_CHECK_EQUAL(a.at(1).get_double(), -2.5);
+    BOOST_CHECK(a.at(2).get_bool());
+    BOOST_CHECK(!a.at(3).get_bool());
+    BOOST_CHECK(a.at(4).is_null());
+    BOOST_CHECK(!a.at(4).is_missing());
+
+    BOOST_CHECK_EQUAL(root.get("s").get_string(), "text");
+    BOOST_CHECK_EQUAL(root.get("s").size(), 4u);
+    BOOST_CHECK_EQUAL(root.value_at(2).get_type(), OBJECT);
+    BOOST_CHECK_EQUAL(root.value_at(2).size(), 0u);
+}
+
+BOOST_AUTO_TEST_CASE(missing_and_wrong_values)
+{
+    DocumentPtr doc = Document::parse("{\"list\":[1]}");
+    Value root = doc->root();
+    BOOST_CHECK(root.find("nope").is_missing());
+    BOOST_CHECK(root.find("nope").is_null());
+    CHECK_JSON_EXCEPTION(root.get("nope"), KEY_ERROR);
+    CHECK_JSON_EXCEPTION(root.get("list").at(1), INDEX_ERROR);
+    CHECK_JSON_EXCEPTION(root.get("list").get_string(), TYPE_ERROR_NOT_STRING);
+    CHECK_JSON_EXCEPTION(root.at(0), TYPE_ERROR_NOT_ARRAY);
+}
+
+BOOST_AUTO_TEST_CASE(strings_are_unescaped)
+{
+    DocumentPtr doc = Document::parse(
+        "[\"a\\\"b\\\\c\\/\\n\", \"\\u00e9\\u20ac\", \"\\ud83d\\ude00\", "
+        "\"nul\\u0000in\"]");
+    Value root = doc->root();
+    BOOST_CHECK_EQUAL(root.at(0).get_string(), "a\"b\\c/\n");
+    BOOST_CHECK_EQUAL(root.at(1).get_string(), "\xc3\xa9\xe2\x82\xac");
+    BOOST_CHECK_EQUAL(root.at(2).get_string(), "\xf0\x9f\x98\x80");
+    BOOST_CHECK_EQUAL(root.at(3).size(), 6u);
+    BOOST_CHECK(memcmp(root.at(3).get_string(), "nul\0in", 6) == 0);
+}
+
+BOOST_AUTO_TEST_CASE(only_part_of_a_buffer_is_read)
+{
+    const char buffer[] = "[1,2]garbage";
+    DocumentPtr doc = Document::parse(buffer, 5);
+    BOOST_CHECK_EQUAL(doc->root().size(), 2u);
+}
+
+BOOST_AUTO_TEST_CASE(malformed_text_is_refused)
+{
+    const char * bad[] = { "", "{", "[1,]", "{\"a\" 1}", "tru", "01",
+                           "\"tab\tinside\"", "[1] 2", "{'a\":1}", "-",
+                           "\"\\x\"", "1.", 0 };
+    for (int i = 0; bad[i] != 0; i ++) {
+        BOOST_TEST_MESSAGE(bad[i]);
+        CHECK_JSON_EXCEPTION(Document::parse(bad[i], strlen(bad[i])),
+                             CTOR_ARGUMENT_IS_NOT_JSON_STRING);
+    }
+    string deep(1000, '[');
+    deep += string(1000, ']');
+    CHECK_JSON_EXCEPTION(Document::parse(deep),
+                         CTOR_ARGUMENT_IS_NOT_JSON_STRING);
+}
+
+BOOST_AUTO_TEST_CASE(a_large_batch_fits_in_a_few_chunks)
+{
+    string text = "{\"method\":\"create_user\",\"args\":{\"users\":[";
+    const int USERS = 2000;
+    for (int i = 0; i < USERS; i ++) {
+        if (i > 0) {
+            text += ",";
+        }
+        text += str(format("{\"_name\":\"user%d\",\"_password\":\"pw%d\","
+                           "\"_databases\":[{\"_name\":\"db%d\"}]}")
+                    % i % i % i);
+    }
+    text += "]}}";
+    DocumentPtr doc = Document::parse(text);
+    Value users = doc->root().get("args").get("users");
+    BOOST_CHECK_EQUAL(users.size(), (size_t) USERS);
+    BOOST_CHECK_EQUAL(users.at(USERS - 1).get("_databases").at(0)
+                      .get("_name").get_string(), "db1999");
+    BOOST_CHECK(doc->get_arena().get_chunk_count() <= 2u);
+}
+
+BOOST_AUTO_TEST_CASE(arena_grows_for_large_allocations)
+{
+    Arena arena(64);
+    BOOST_CHECK_EQUAL(arena.get_chunk_count(), 0u);
+    char * small = (char *) arena.allocate(3);
+    char * next = (char *) arena.allocate(1);
+    BOOST_CHECK_EQUAL(next - small, 8);
+    arena.allocate(1000);
+    BOOST_CHECK_EQUAL(arena.get_chunk_count(), 2u);
+    BOOST_CHECK_EQUAL(arena.get_bytes_used(), 8u + 8u + 1000u);
+}
@@ -0,0 +1,207 @@
+#define BOOST_TEST_MODULE sax_tests
+#include <boost/test/unit_test.hpp>
+
+#include <boost/format.hpp>
+#include "nova/json/sax.h"
+#include <string>
+#include <string.h>
+
+using boost::format;
+using nova::JsonException;
+using namespace nova::json;
+using std::string;
+
+
+// Asserts the given bit of code throws a JsonException with the given code.
+#define CHECK_JSON_EXCEPTION(statement, ex_code) try { \
+        statement ; \
+        BOOST_FAIL("Should have thrown."); \
+    } catch(const JsonException & je) { \
+        BOOST_CHECK_EQUAL(JsonException::code_to_string(je.code), \
+            JsonException::code_to_string(JsonException::ex_code)); \
+    }
+
+
+/**---------------------------------------------------------------------------
+ *- Helpers
+ *---------------------------------------------------------------------------*/
+
+/* Writes down every event as text, skipping or taking raw any key that
+ * starts with "skip" or "raw". */
+struct Recorder : public SaxHandler {
+    string events;
+    const char * text;
+    bool views_in_text;
+
+    Recorder(const char * text = 0)
+    : events(), text(text), views_in_text(true) {
+    }
+
+    void note(const string & event) {
+        if (!events.empty()) {
+            events += " ";
+        }
+        events += event;
+    }
+
+    void note_view(const StringView & view) {
+        if (text != 0 && (view.data < text
+                          || view.data >= text + strlen(text))) {
+            views_in_text = false;
+        }
+    }
+
+    virtual bool begin_array() { note("["); return true; }
+
+    virtual bool begin_object() { note("{"); return true; }
+
+    virtual bool bool_value(bool value) {
+        note(value ? "true" : "false");
+        return true;
+    }
+
+    virtual bool double_value(double value) {
+        note(str(format("d%g") % value));
+        return true;
+    }
+
+    virtual bool end_array() { note("]"); return true; }
+
+    virtual bool end_object() { note("}"); return true; }
+
+    virtual bool int_value(long long value) {
+        note(str(format("i%d") % value));
+        return true;
+    }
+
+    virtual KeyAction key(const StringView & name) {
+        note_view(name);
+        note("k:" + name.str());
+        if (name.starts_with("skip")) {
+            return SKIP;
+        } else if (name.starts_with("raw")) {
+            return RAW;
+        } else if (name == "stop") {
+            return STOP;
+        }
+        return READ;
+    }
+
+    virtual bool null_value() { note("null"); return true; }
+
+    virtual bool raw_value(const StringView & text) {
+        note("raw:" + text.str());
+        return true;
+    }
+
+    virtual bool string_value(const StringView & value) {
+        note_view(value);
+        note("s:" + value.str());
+        return value != "halt";
+    }
+};
+
+string events_of(const char * text) {
+    Recorder recorder;
+    SaxParser parser;
+    parser.parse(text, strlen(text), recorder);
+    return recorder.events;
+}
+
+
+/**---------------------------------------------------------------------------
+ *- Tests
+ *---------------------------------------------------------------------------*/
+
+BOOST_AUTO_TEST_CASE(events_come_in_order)
+{
+    BOOST_CHECK_EQUAL(events_of(
+        "{ \"a\": [1, -2, 2.5e1, true, false, null], \"b\" : {} }"),
+        "{ k:a [ i1 i-2 d25 true false null ] k:b { } }");
+    BOOST_CHECK_EQUAL(events_of(" \"alone\" "), "s:alone");
+    BOOST_CHECK_EQUAL(events_of("[]"), "[ ]");
+    BOOST_CHECK_EQUAL(events_of("12345678901234567890"), "d1.23457e+19");
+}
+
+BOOST_AUTO_TEST_CASE(plain_strings_point_into_the_text)
+{
+    const char * text = "{\"key\":\"value\"}";
+    Recorder recorder(text);
+    SaxParser parser;
+    parser.parse(text, strlen(text), recorder);
+    BOOST_CHECK(recorder.views_in_text);
+
+    const char * escaped = "[\"tab\\there\", \"\\u00e9\"]";
+    Recorder unescaped(escaped);
+    parser.parse(escaped, strlen(escaped), unescaped);
+    BOOST_CHECK(!unescaped.views_in_text);
+    BOOST_CHECK_EQUAL(unescaped.events, "[ s:tab\there s:\xc3\xa9 ]");
+}
+
+BOOST_AUTO_TEST_CASE(skipped_values_are_not_reported)
+{
+    BOOST_CHECK_EQUAL(events_of(
+        "{\"skip_me\":{\"x\":[1,\"]}\\\"\",{}]}, \"skip2\":-1.5e3,"
+        " \"kept\":1}"),
+        "{ k:skip_me k:skip2 k:kept i1 }");
+}
+
+BOOST_AUTO_TEST_CASE(raw_values_are_handed_over_as_text)
+{
+    BOOST_CHECK_EQUAL(events_of(
+        "{\"raw\": {\"a\": [1, 2]} , \"raw2\":\"s\", \"raw3\":null}"),
+        "{ k:raw raw:{\"a\": [1, 2]} k:raw2 raw:\"s\" k:raw3 raw:null }");
+}
+
+BOOST_AUTO_TEST_CASE(handler_can_stop_early)
+{
+    Recorder recorder;
+    SaxParser parser;
+    const char * stopped = "{\"a\":1, \"stop\":2, \"b\":3";
+    BOOST_CHECK(!parser.parse(stopped, strlen(stopped), recorder));
+    BOOST_CHECK_EQUAL(recorder.events, "{ k:a i1 k:stop");
+
+    Recorder halted;
+    const char * halting = "[\"halt\", garbage";
+    BOOST_CHECK(!parser.parse(halting, strlen(halting), halted));
+    BOOST_CHECK_EQUAL(halted.events, "[ s:halt");
+}
+
+BOOST_AUTO_TEST_CASE(malformed_text_is_refused)
+{
+    const char * bad[] = { "", "{", "[1,]", "{\"a\" 1}", "tru", "01",
+                           "\"tab\tinside\"", "[1] 2", "{'a\":1}", "-",
+                           "\"\\x\"", "1.", "{\"skip\":[1}", "{\"skip\":}",
+                           "{\"raw\":\"open}", 0 };
+    for (int i = 0; bad[i] != 0; i ++) {
+        BOOST_TEST_MESSAGE(bad[i]);
+        CHECK_JSON_EXCEPTION(events_of(bad[i]),
+                             CTOR_ARGUMENT_IS_NOT_JSON_STRING);
+    }
+    string deep(1000, '[');
+    deep += string(1000, ']');
+    CHECK_JSON_EXCEPTION(events_of(deep.c_str()),
+                         CTOR_ARGUMENT_IS_NOT_JSON_STRING);
+}
+
+BOOST_AUTO_TEST_CASE(single_quotes_are_read_like_json_c)
+{
+    BOOST_CHECK_EQUAL(events_of(
+        "{ 'method':'list_users', 'a \\'b\\'':'say \"hi\"' }"),
+        "{ k:method s:list_users k:a 'b' s:say \"hi\" }");
+    BOOST_CHECK_EQUAL(events_of(
+        "{'skip':{'x':['}]\\'']}, 'raw':{'y':'['}, 'z':1}"),
+        "{ k:skip k:raw raw:{'y':'['} k:z i1 }");
+}
+
+BOOST_AUTO_TEST_CASE(views_compare_with_text)
+{
+    const char * text = "method_name";
+    StringView view(text, 6);
+    BOOST_CHECK(view == "method");
+    BOOST_CHECK(view != "method_name");
+    BOOST_CHECK(view != "meth");
+    BOOST_CHECK(view.starts_with("meth"));
+    BOOST_CHECK(!view.starts_with("method_"));
+    BOOST_CHECK_EQUAL(view.str(), "method");
+}
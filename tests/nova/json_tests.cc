@@ -13,6 +13,7 @@ using nova::JsonDataPtr;
 using nova::JsonException;
 using nova::JsonObject;
 using nova::JsonObjectPtr;
+using nova::JsonWriter;
 using std::string;
 
 
@@ -96,6 +97,18 @@ void test_object(JsonObject & object) {
  *- JsonData Tests
  *---------------------------------------------------------------------------*/
 
+BOOST_AUTO_TEST_CASE(canonical_strings_sort_keys)
+{
+    JsonObject first("{ 'b':[ 1, { 'd':null, 'c':'x' } ], 'a':true }");
+    JsonObject second("{'a' : true, 'b' : [1, {'c':'x', 'd':null}]}");
+    BOOST_CHECK_EQUAL(first.to_canonical_string(),
+                      "{\"a\":true,\"b\":[1,{\"c\":\"x\",\"d\":null}]}");
+    BOOST_CHECK_EQUAL(first.to_canonical_string(),
+                      second.to_canonical_string());
+    BOOST_CHECK(JsonObject("{ 'a':1 }").to_canonical_string()
+                != JsonObject("{ 'a':2 }").to_canonical_string());
+}
+
 BOOST_AUTO_TEST_CASE(from_boolean)
 {
     BOOST_CHECK_EQUAL(JsonData::from_boolean(false)->to_string(), "false");
@@ -113,6 +126,13 @@ BOOST_AUTO_TEST_CASE(from_null)
     BOOST_CHECK_EQUAL(JsonData::from_null()->to_string(), "null");
 }
 
+BOOST_AUTO_TEST_CASE(from_raw)
+{
+    JsonDataPtr raw = JsonData::from_raw("{ \"b\":1, \"a\":[] }");
+    BOOST_CHECK_EQUAL(raw->to_string(), "{ \"b\":1, \"a\":[] }");
+    BOOST_CHECK_EQUAL(raw->to_canonical_string(), "{\"a\":[],\"b\":1}");
+}
+
 BOOST_AUTO_TEST_CASE(from_string)
 {
     BOOST_CHECK_EQUAL(JsonData::from_string("hello")->to_string(), "\"hello\"");
@@ -226,6 +246,16 @@ BOOST_AUTO_TEST_CASE(creating_malformed_object)
                          CTOR_ARGUMENT_NOT_OBJECT);
 }
 
+BOOST_AUTO_TEST_CASE(creating_object_from_part_of_a_buffer)
+{
+    const char buffer[] = "{ 'string':'abcde', 'int':42 }{ 'more':'junk' }";
+    JsonObject object(buffer, 30);
+    test_object(object);
+
+    CHECK_JSON_EXCEPTION({ JsonObject object(buffer, 12); },
+                         CTOR_ARGUMENT_IS_NOT_JSON_STRING);
+}
+
 BOOST_AUTO_TEST_CASE(getting_arrays_from_inside_an_object)
 {
     JsonObject object(json_tokener_parse(
@@ -253,3 +283,72 @@ BOOST_AUTO_TEST_CASE(getting_values_from_inside_an_object)
     CHECK_JSON_EXCEPTION({ object.get_object("type"); },
                      TYPE_ERROR_NOT_OBJECT);
 }
+
+BOOST_AUTO_TEST_CASE(try_get_does_not_throw)
+{
+    JsonObject object("{ 'name':'bob', 'count':3, 'list':[1], 'none':null }");
+    string name;
+    BOOST_CHECK(object.try_get_string("name", name));
+    BOOST_CHECK_EQUAL(name, "bob");
+    int count = 0;
+    BOOST_CHECK(object.try_get_int("count", count));
+    BOOST_CHECK_EQUAL(count, 3);
+    JsonArrayPtr list;
+    BOOST_CHECK(object.try_get_array("list", list));
+    BOOST_CHECK_EQUAL(list->get_int(0), 1);
+
+    BOOST_CHECK(!object.try_get_string("count", name));
+    BOOST_CHECK_EQUAL(name, "bob");
+    BOOST_CHECK(!object.try_get_int("missing", count));
+    BOOST_CHECK(!object.try_get_string("none", name));
+    JsonObjectPtr inner;
+    BOOST_CHECK(!object.try_get_object("list", inner));
+    BOOST_CHECK(!inner);
+}
+
+
+/**---------------------------------------------------------------------------
+ *- JsonWriter Tests
+ *---------------------------------------------------------------------------*/
+
+BOOST_AUTO_TEST_CASE(writer_adds_commas_where_needed)
+{
+    JsonWriter writer;
+    writer.begin_array();
+    writer.begin_object();
+    writer.key("name");
+    writer.value("a");
+    writer.key("password");
+    writer.value(boost::optional<string>());
+    writer.key("list");
+    writer.begin_array();
+    writer.value(1);
+    writer.value(true);
+    writer.end_array();
+    writer.end_object();
+    writer.begin_object();
+    writer.end_object();
+    writer.end_array();
+    BOOST_CHECK_EQUAL(writer.str(),
+        "[{\"name\":\"a\",\"password\":null,\"list\":[1,true]},{}]");
+
+    JsonArray array(writer.to_json_data()->to_string());
+    BOOST_CHECK_EQUAL(array.get_length(), 2);
+    BOOST_CHECK_EQUAL(array.get_object(0)->get_string("name"),
+                      string("a"));
+
+    writer.clear();
+    writer.begin_array();
+    writer.end_array();
+    BOOST_CHECK_EQUAL(writer.str(), "[]");
+}
+
+BOOST_AUTO_TEST_CASE(writer_escapes_strings)
+{
+    JsonWriter writer;
+    writer.value(string("quote\" slash\\ tab\t nl\n bell\x07 caf\xc3\xa9"));
+    BOOST_CHECK_EQUAL(writer.str(),
+        "\"quote\\\" slash\\\\ tab\\t nl\\n bell\\u0007 caf\xc3\xa9\"");
+    BOOST_CHECK_EQUAL(JsonData::json_string("a\"b"), "\"a\\\"b\"");
+}
+
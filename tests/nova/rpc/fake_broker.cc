@@ -0,0 +1,1099 @@
+#include "fake_broker.h"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sstream>
+#include <stdexcept>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+using std::string;
+using std::vector;
+
+namespace nova { namespace rpc {
+
+namespace {
+
+    /* Frame types. */
+    const uint8_t FRAME_METHOD = 1;
+    const uint8_t FRAME_HEADER = 2;
+    const uint8_t FRAME_BODY = 3;
+    const uint8_t FRAME_HEARTBEAT = 8;
+    const uint8_t FRAME_END = 0xCE;
+
+    /* Method ids, with the class in the top half. */
+    const uint32_t CONNECTION_START = 0x000A000A;
+    const uint32_t CONNECTION_START_OK = 0x000A000B;
+    const uint32_t CONNECTION_TUNE = 0x000A001E;
+    const uint32_t CONNECTION_TUNE_OK = 0x000A001F;
+    const uint32_t CONNECTION_OPEN = 0x000A0028;
+    const uint32_t CONNECTION_OPEN_OK = 0x000A0029;
+    const uint32_t CONNECTION_CLOSE = 0x000A0032;
+    const uint32_t CONNECTION_CLOSE_OK = 0x000A0033;
+    const uint32_t CHANNEL_OPEN = 0x0014000A;
+    const uint32_t CHANNEL_OPEN_OK = 0x0014000B;
+    const uint32_t CHANNEL_CLOSE = 0x00140028;
+    const uint32_t CHANNEL_CLOSE_OK = 0x00140029;
+    const uint32_t EXCHANGE_DECLARE = 0x0028000A;
+    const uint32_t EXCHANGE_DECLARE_OK = 0x0028000B;
+    const uint32_t QUEUE_DECLARE = 0x0032000A;
+    const uint32_t QUEUE_DECLARE_OK = 0x0032000B;
+    const uint32_t QUEUE_BIND = 0x00320014;
+    const uint32_t QUEUE_BIND_OK = 0x00320015;
+    const uint32_t BASIC_QOS = 0x003C000A;
+    const uint32_t BASIC_QOS_OK = 0x003C000B;
+    const uint32_t BASIC_CONSUME = 0x003C0014;
+    const uint32_t BASIC_CONSUME_OK = 0x003C0015;
+    const uint32_t BASIC_CANCEL = 0x003C001E;
+    const uint32_t BASIC_CANCEL_OK = 0x003C001F;
+    const uint32_t BASIC_PUBLISH = 0x003C0028;
+    const uint32_t BASIC_DELIVER = 0x003C003C;
+    const uint32_t BASIC_ACK = 0x003C0050;
+    const uint32_t BASIC_REJECT = 0x003C005A;
+    const uint32_t BASIC_NACK = 0x003C0078;
+    const uint32_t CONFIRM_SELECT = 0x0055000A;
+    const uint32_t CONFIRM_SELECT_OK = 0x0055000B;
+
+    /* Reply codes. */
+    const uint16_t NOT_FOUND = 404;
+    const uint16_t RESOURCE_LOCKED = 405;
+    const uint16_t PRECONDITION_FAILED = 406;
+    const uint16_t CHANNEL_ERROR = 504;
+
+    const char PROTOCOL_HEADER[] = { 'A', 'M', 'Q', 'P', 0, 0, 9, 1 };
+
+    /* What we offer in connection.tune. Zero channel max means no limit. */
+    const uint32_t FRAME_MAX = 131072;
+
+    double now() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+    }
+
+    void set_non_blocking(int fd) {
+        int flags = fcntl(fd, F_GETFL, 0);
+        if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+            throw std::runtime_error("Could not make socket non-blocking.");
+        }
+    }
+
+    /* Pulls fields out of a frame payload in network order. */
+    class Reader {
+    public:
+        Reader(const string & data) : data(data), position(0) {
+        }
+
+        uint8_t octet() {
+            need(1);
+            return (uint8_t) data[position ++];
+        }
+
+        uint16_t short_int() {
+            uint16_t value = octet();
+            return (value << 8) | octet();
+        }
+
+        uint32_t long_int() {
+            uint32_t value = short_int();
+            return (value << 16) | short_int();
+        }
+
+        uint64_t long_long_int() {
+            uint64_t value = long_int();
+            return (value << 32) | long_int();
+        }
+
+        string short_string() {
+            size_t length = octet();
+            return take(length);
+        }
+
+        string long_string() {
+            size_t length = long_int();
+            return take(length);
+        }
+
+        /* Tables aren't looked at, only stepped over. */
+        void skip_table() {
+            long_string();
+        }
+
+    private:
+        const string & data;
+        size_t position;
+
+        void need(size_t length) {
+            if (data.size() - position < length) {
+                throw std::runtime_error("Frame ended early.");
+            }
+        }
+
+        string take(size_t length) {
+            need(length);
+            string value = data.substr(position, length);
+            position += length;
+            return value;
+        }
+    };
+
+    /* Builds a frame payload in network order. */
+    class Writer {
+    public:
+        Writer & octet(uint8_t value) {
+            data += (char) value;
+            return *this;
+        }
+
+        Writer & short_int(uint16_t value) {
+            return octet(value >> 8).octet(value & 0xFF);
+        }
+
+        Writer & long_int(uint32_t value) {
+            return short_int(value >> 16).short_int(value & 0xFFFF);
+        }
+
+        Writer & long_long_int(uint64_t value) {
+            return long_int(value >> 32).long_int(value & 0xFFFFFFFF);
+        }
+
+        Writer & short_string(const string & value) {
+            octet(std::min(value.size(), (size_t) 255));
+            data.append(value, 0, 255);
+            return *this;
+        }
+
+        Writer & long_string(const string & value) {
+            long_int(value.size());
+            data += value;
+            return *this;
+        }
+
+        Writer & empty_table() {
+            return long_int(0);
+        }
+
+        inline const string & str() const {
+            return data;
+        }
+
+    private:
+        string data;
+    };
+
+    vector<string> split_words(const string & key) {
+        vector<string> words;
+        size_t start = 0;
+        while(true) {
+            size_t dot = key.find('.', start);
+            words.push_back(key.substr(start, dot - start));
+            if (dot == string::npos) {
+                return words;
+            }
+            start = dot + 1;
+        }
+    }
+
+    bool topic_matches(const vector<string> & pattern, size_t p,
+                       const vector<string> & words, size_t w) {
+        if (p == pattern.size()) {
+            return w == words.size();
+        }
+        if (pattern[p] == "#") {
+            // Zero or more words.
+            for (size_t skip = w; skip <= words.size(); skip ++) {
+                if (topic_matches(pattern, p + 1, words, skip)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+        if (w == words.size()) {
+            return false;
+        }
+        return (pattern[p] == "*" || pattern[p] == words[w])
+               && topic_matches(pattern, p + 1, words, w + 1);
+    }
+
+    bool topic_matches(const string & binding_key, const string & routing_key) {
+        return topic_matches(split_words(binding_key), 0,
+                             split_words(routing_key), 0);
+    }
+
+}
+
+
+/**---------------------------------------------------------------------------
+ *- FakeBroker
+ *---------------------------------------------------------------------------*/
+
+FakeBroker::FakeBroker()
+: connections(),
+  drop_requested(false),
+  exchanges(),
+  frozen(false),
+  listen_fd(-1),
+  mutex(),
+  next_consumer_number(1),
+  next_queue_number(1),
+  port(0),
+  queues(),
+  stopping(false),
+  thread()
+{
+    // RabbitMQ always has these.
+    exchanges[""].type = "direct";
+    exchanges["amq.direct"].type = "direct";
+    exchanges["amq.fanout"].type = "fanout";
+    exchanges["amq.topic"].type = "topic";
+
+    if (pipe(wake_pipe) < 0) {
+        throw std::runtime_error("Could not create pipe.");
+    }
+    listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = 0;
+    socklen_t length = sizeof(address);
+    if (listen_fd < 0
+        || bind(listen_fd, (struct sockaddr *) &address, sizeof(address)) < 0
+        || listen(listen_fd, 64) < 0
+        || getsockname(listen_fd, (struct sockaddr *) &address, &length) < 0) {
+        if (listen_fd >= 0) {
+            ::close(listen_fd);
+        }
+        ::close(wake_pipe[0]);
+        ::close(wake_pipe[1]);
+        throw std::runtime_error("Could not listen on localhost.");
+    }
+    port = ntohs(address.sin_port);
+    set_non_blocking(listen_fd);
+    set_non_blocking(wake_pipe[0]);
+    set_non_blocking(wake_pipe[1]);
+    thread = boost::thread(boost::bind(&FakeBroker::loop, this));
+}
+
+FakeBroker::~FakeBroker() {
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake();
+    thread.join();
+    BOOST_FOREACH(Connection * connection, connections) {
+        close_connection(connection);
+        delete connection;
+    }
+    ::close(listen_fd);
+    ::close(wake_pipe[0]);
+    ::close(wake_pipe[1]);
+}
+
+void FakeBroker::accept_connection() {
+    int fd = accept(listen_fd, 0, 0);
+    if (fd < 0) {
+        return;
+    }
+    set_non_blocking(fd);
+    Connection * connection = new Connection();
+    connection->closing = false;
+    connection->fd = fd;
+    connection->frame_max = FRAME_MAX;
+    connection->heartbeat = 0;
+    connection->last_sent = now();
+    connection->saw_protocol_header = false;
+    connections.push_back(connection);
+}
+
+void FakeBroker::bind_queue(Channel * channel, const string & payload) {
+    Reader reader(payload);
+    reader.short_int();
+    string queue_name = reader.short_string();
+    string exchange_name = reader.short_string();
+    string routing_key = reader.short_string();
+    bool nowait = (reader.octet() & 1) != 0;
+    reader.skip_table();
+    if (queues.find(queue_name) == queues.end()) {
+        fail_channel(channel, NOT_FOUND, "NOT_FOUND - no queue", QUEUE_BIND);
+        return;
+    }
+    if (exchanges.find(exchange_name) == exchanges.end()
+        || exchange_name.empty()) {
+        fail_channel(channel, NOT_FOUND, "NOT_FOUND - no exchange",
+                     QUEUE_BIND);
+        return;
+    }
+    vector<Binding> & bindings = exchanges[exchange_name].bindings;
+    bool exists = false;
+    BOOST_FOREACH(const Binding & binding, bindings) {
+        exists = exists || (binding.queue_name == queue_name
+                            && binding.routing_key == routing_key);
+    }
+    if (!exists) {
+        Binding binding;
+        binding.queue_name = queue_name;
+        binding.routing_key = routing_key;
+        bindings.push_back(binding);
+    }
+    if (!nowait) {
+        send_method(channel->connection, channel->number, QUEUE_BIND_OK, "");
+    }
+}
+
+void FakeBroker::close_channel(Channel * channel) {
+    // Stop delivering to it.
+    for (std::map<string, Queue>::iterator itr = queues.begin();
+         itr != queues.end(); itr ++) {
+        std::list<Consumer> & consumers = itr->second.consumers;
+        for (std::list<Consumer>::iterator c = consumers.begin();
+             c != consumers.end();) {
+            if (c->channel == channel) {
+                c = consumers.erase(c);
+            } else {
+                c ++;
+            }
+        }
+    }
+    // Put what it never acknowledged back at the front of the line, oldest
+    // first.
+    for (std::map<uint64_t, Unacked>::reverse_iterator itr
+            = channel->unacked.rbegin();
+         itr != channel->unacked.rend(); itr ++) {
+        std::map<string, Queue>::iterator queue
+            = queues.find(itr->second.queue_name);
+        if (queue != queues.end()) {
+            itr->second.message.redelivered = true;
+            queue->second.messages.push_front(itr->second.message);
+        }
+    }
+    channel->connection->channels.erase(channel->number);
+    delete channel;
+}
+
+void FakeBroker::close_connection(Connection * connection) {
+    if (connection->fd < 0) {
+        return;
+    }
+    while(!connection->channels.empty()) {
+        close_channel(connection->channels.begin()->second);
+    }
+    for (std::map<string, Queue>::iterator itr = queues.begin();
+         itr != queues.end();) {
+        if (itr->second.owner == connection) {
+            queues.erase(itr ++);
+        } else {
+            itr ++;
+        }
+    }
+    ::close(connection->fd);
+    connection->fd = -1;
+}
+
+void FakeBroker::consume(Channel * channel, const string & payload) {
+    Reader reader(payload);
+    reader.short_int();
+    string queue_name = reader.short_string();
+    string tag = reader.short_string();
+    uint8_t bits = reader.octet();
+    bool no_ack = (bits & 2) != 0;
+    bool nowait = (bits & 8) != 0;
+    reader.skip_table();
+    std::map<string, Queue>::iterator queue = queues.find(queue_name);
+    if (queue == queues.end()) {
+        fail_channel(channel, NOT_FOUND, "NOT_FOUND - no queue",
+                     BASIC_CONSUME);
+        return;
+    }
+    if (tag.empty()) {
+        std::stringstream generated;
+        generated << "amq.ctag-" << next_consumer_number ++;
+        tag = generated.str();
+    }
+    Consumer consumer;
+    consumer.channel = channel;
+    consumer.no_ack = no_ack;
+    consumer.tag = tag;
+    queue->second.consumers.push_back(consumer);
+    if (!nowait) {
+        send_method(channel->connection, channel->number, BASIC_CONSUME_OK,
+                    Writer().short_string(tag).str());
+    }
+    deliver(queue_name);
+}
+
+void FakeBroker::declare_exchange(Channel * channel, const string & payload) {
+    Reader reader(payload);
+    reader.short_int();
+    string name = reader.short_string();
+    string type = reader.short_string();
+    uint8_t bits = reader.octet();
+    bool passive = (bits & 1) != 0;
+    bool nowait = (bits & 16) != 0;
+    reader.skip_table();
+    std::map<string, Exchange>::iterator itr = exchanges.find(name);
+    if (passive && itr == exchanges.end()) {
+        fail_channel(channel, NOT_FOUND, "NOT_FOUND - no exchange",
+                     EXCHANGE_DECLARE);
+        return;
+    }
+    if (!passive && itr != exchanges.end() && itr->second.type != type) {
+        fail_channel(channel, PRECONDITION_FAILED,
+                     "PRECONDITION_FAILED - inequivalent arg 'type'",
+                     EXCHANGE_DECLARE);
+        return;
+    }
+    if (type != "direct" && type != "fanout" && type != "topic"
+        && !passive) {
+        fail_channel(channel, PRECONDITION_FAILED,
+                     "PRECONDITION_FAILED - unsupported exchange type",
+                     EXCHANGE_DECLARE);
+        return;
+    }
+    if (itr == exchanges.end()) {
+        exchanges[name].type = type;
+    }
+    if (!nowait) {
+        send_method(channel->connection, channel->number, EXCHANGE_DECLARE_OK,
+                    "");
+    }
+}
+
+void FakeBroker::declare_queue(Channel * channel, const string & payload) {
+    Reader reader(payload);
+    reader.short_int();
+    string name = reader.short_string();
+    uint8_t bits = reader.octet();
+    bool passive = (bits & 1) != 0;
+    bool exclusive = (bits & 4) != 0;
+    bool nowait = (bits & 16) != 0;
+    reader.skip_table();
+    if (name.empty()) {
+        std::stringstream generated;
+        generated << "amq.gen-" << next_queue_number ++;
+        name = generated.str();
+    }
+    std::map<string, Queue>::iterator itr = queues.find(name);
+    if (passive && itr == queues.end()) {
+        fail_channel(channel, NOT_FOUND, "NOT_FOUND - no queue",
+                     QUEUE_DECLARE);
+        return;
+    }
+    if (itr != queues.end() && itr->second.owner != 0
+        && itr->second.owner != channel->connection) {
+        fail_channel(channel, RESOURCE_LOCKED,
+                     "RESOURCE_LOCKED - exclusive queue", QUEUE_DECLARE);
+        return;
+    }
+    if (itr == queues.end()) {
+        Queue & queue = queues[name];
+        queue.owner = exclusive ? channel->connection : 0;
+        itr = queues.find(name);
+    }
+    if (!nowait) {
+        send_method(channel->connection, channel->number, QUEUE_DECLARE_OK,
+                    Writer().short_string(name)
+                            .long_int(itr->second.messages.size())
+                            .long_int(itr->second.consumers.size()).str());
+    }
+}
+
+void FakeBroker::deliver(const string & queue_name) {
+    std::map<string, Queue>::iterator itr = queues.find(queue_name);
+    if (itr == queues.end()) {
+        return;
+    }
+    Queue & queue = itr->second;
+    while(!queue.messages.empty()) {
+        // Round robin: take the first consumer with room in its window and
+        // send it to the back of the line.
+        std::list<Consumer>::iterator consumer = queue.consumers.begin();
+        while(consumer != queue.consumers.end()) {
+            Channel * channel = consumer->channel;
+            if (consumer->no_ack || channel->prefetch_count == 0
+                || channel->unacked.size() < channel->prefetch_count) {
+                break;
+            }
+            consumer ++;
+        }
+        if (consumer == queue.consumers.end()) {
+            return;
+        }
+        Consumer chosen = *consumer;
+        queue.consumers.erase(consumer);
+        queue.consumers.push_back(chosen);
+
+        Message message = queue.messages.front();
+        queue.messages.pop_front();
+        Channel * channel = chosen.channel;
+        uint64_t tag = channel->next_delivery_tag ++;
+        if (!chosen.no_ack) {
+            Unacked & unacked = channel->unacked[tag];
+            unacked.message = message;
+            unacked.queue_name = queue_name;
+        }
+
+        Connection * connection = channel->connection;
+        send_method(connection, channel->number, BASIC_DELIVER,
+                    Writer().short_string(chosen.tag)
+                            .long_long_int(tag)
+                            .octet(message.redelivered ? 1 : 0)
+                            .short_string(message.exchange)
+                            .short_string(message.routing_key).str());
+        send_frame(connection, FRAME_HEADER, channel->number, message.header);
+        const size_t chunk = connection->frame_max - 8;
+        for (size_t sent = 0; sent < message.body.size(); sent += chunk) {
+            send_frame(connection, FRAME_BODY, channel->number,
+                       message.body.substr(sent, chunk));
+        }
+    }
+}
+
+void FakeBroker::deliver_all() {
+    for (std::map<string, Queue>::iterator itr = queues.begin();
+         itr != queues.end(); itr ++) {
+        deliver(itr->first);
+    }
+}
+
+void FakeBroker::drop_connections() {
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        drop_requested = true;
+    }
+    wake();
+}
+
+void FakeBroker::fail_channel(Channel * channel, uint16_t code,
+                              const char * text, uint32_t method) {
+    Connection * connection = channel->connection;
+    int number = channel->number;
+    send_method(connection, number, CHANNEL_CLOSE,
+                Writer().short_int(code).short_string(text)
+                        .short_int(method >> 16).short_int(method & 0xFFFF)
+                        .str());
+    close_channel(channel);
+    connection->closing_channels.insert(number);
+}
+
+void FakeBroker::finish_delivery(Channel * channel, uint64_t delivery_tag,
+                                 bool multiple, bool requeue) {
+    std::map<uint64_t, Unacked> & unacked = channel->unacked;
+    std::map<uint64_t, Unacked>::iterator first = multiple ? unacked.begin()
+                                                 : unacked.find(delivery_tag);
+    std::map<uint64_t, Unacked>::iterator last
+        = unacked.upper_bound(delivery_tag);
+    if (first == unacked.end() || first->first > delivery_tag) {
+        if (!(multiple && delivery_tag == 0)) {
+            fail_channel(channel, PRECONDITION_FAILED,
+                         "PRECONDITION_FAILED - unknown delivery tag",
+                         BASIC_ACK);
+            return;
+        }
+        // Zero with multiple means everything.
+        last = unacked.end();
+    }
+    if (requeue) {
+        std::map<uint64_t, Unacked>::iterator itr = last;
+        while(itr != first) {
+            itr --;
+            std::map<string, Queue>::iterator queue
+                = queues.find(itr->second.queue_name);
+            if (queue != queues.end()) {
+                itr->second.message.redelivered = true;
+                queue->second.messages.push_front(itr->second.message);
+            }
+        }
+    }
+    unacked.erase(first, last);
+    // Room has opened up in the window.
+    deliver_all();
+}
+
+size_t FakeBroker::get_connection_count() {
+    boost::lock_guard<boost::mutex> lock(mutex);
+    size_t count = 0;
+    BOOST_FOREACH(Connection * connection, connections) {
+        if (connection->fd >= 0) {
+            count ++;
+        }
+    }
+    return count;
+}
+
+size_t FakeBroker::get_message_count(const char * queue_name) {
+    boost::lock_guard<boost::mutex> lock(mutex);
+    std::map<string, Queue>::iterator itr = queues.find(queue_name);
+    return itr == queues.end() ? 0 : itr->second.messages.size();
+}
+
+void FakeBroker::handle_body(Channel * channel, const string & payload) {
+    if (!channel->publishing) {
+        fail_channel(channel, CHANNEL_ERROR, "CHANNEL_ERROR - unexpected body",
+                     0);
+        return;
+    }
+    channel->publishing_message.body += payload;
+    if (channel->publishing_message.body.size() >= channel->publishing_size) {
+        publish(channel);
+    }
+}
+
+void FakeBroker::handle_channel_method(Channel * channel, uint32_t method,
+                                       const string & payload) {
+    Connection * connection = channel->connection;
+    Reader reader(payload);
+    switch(method) {
+        case CHANNEL_CLOSE: {
+            int number = channel->number;
+            close_channel(channel);
+            send_method(connection, number, CHANNEL_CLOSE_OK, "");
+            deliver_all();
+            break;
+        }
+        case EXCHANGE_DECLARE:
+            declare_exchange(channel, payload);
+            break;
+        case QUEUE_DECLARE:
+            declare_queue(channel, payload);
+            break;
+        case QUEUE_BIND:
+            bind_queue(channel, payload);
+            break;
+        case BASIC_QOS:
+            reader.long_int();
+            channel->prefetch_count = reader.short_int();
+            send_method(connection, channel->number, BASIC_QOS_OK, "");
+            break;
+        case BASIC_CONSUME:
+            consume(channel, payload);
+            break;
+        case BASIC_CANCEL: {
+            string tag = reader.short_string();
+            bool nowait = (reader.octet() & 1) != 0;
+            for (std::map<string, Queue>::iterator itr = queues.begin();
+                 itr != queues.end(); itr ++) {
+                std::list<Consumer> & consumers = itr->second.consumers;
+                for (std::list<Consumer>::iterator c = consumers.begin();
+                     c != consumers.end(); c ++) {
+                    if (c->channel == channel && c->tag == tag) {
+                        consumers.erase(c);
+                        break;
+                    }
+                }
+            }
+            if (!nowait) {
+                send_method(connection, channel->number, BASIC_CANCEL_OK,
+                            Writer().short_string(tag).str());
+            }
+            break;
+        }
+        case BASIC_PUBLISH: {
+            reader.short_int();
+            Message & message = channel->publishing_message;
+            message.body.clear();
+            message.exchange = reader.short_string();
+            message.header.clear();
+            message.redelivered = false;
+            message.routing_key = reader.short_string();
+            if (exchanges.find(message.exchange) == exchanges.end()) {
+                fail_channel(channel, NOT_FOUND, "NOT_FOUND - no exchange",
+                             BASIC_PUBLISH);
+                return;
+            }
+            channel->publishing = true;
+            break;
+        }
+        case BASIC_ACK: {
+            uint64_t tag = reader.long_long_int();
+            bool multiple = (reader.octet() & 1) != 0;
+            finish_delivery(channel, tag, multiple, false);
+            break;
+        }
+        case BASIC_REJECT: {
+            uint64_t tag = reader.long_long_int();
+            bool requeue = (reader.octet() & 1) != 0;
+            finish_delivery(channel, tag, false, requeue);
+            break;
+        }
+        case BASIC_NACK: {
+            uint64_t tag = reader.long_long_int();
+            uint8_t bits = reader.octet();
+            finish_delivery(channel, tag, (bits & 1) != 0, (bits & 2) != 0);
+            break;
+        }
+        case CONFIRM_SELECT: {
+            bool nowait = (reader.octet() & 1) != 0;
+            if (!channel->confirms) {
+                channel->confirms = true;
+                channel->next_publish_tag = 1;
+            }
+            if (!nowait) {
+                send_method(connection, channel->number, CONFIRM_SELECT_OK,
+                            "");
+            }
+            break;
+        }
+        default:
+            fail_channel(channel, CHANNEL_ERROR,
+                         "COMMAND_INVALID - not supported by the fake broker",
+                         method);
+    }
+}
+
+void FakeBroker::handle_header(Channel * channel, const string & payload) {
+    if (!channel->publishing || !channel->publishing_message.header.empty()) {
+        fail_channel(channel, CHANNEL_ERROR,
+                     "CHANNEL_ERROR - unexpected header", 0);
+        return;
+    }
+    Reader reader(payload);
+    reader.short_int();
+    reader.short_int();
+    channel->publishing_size = reader.long_long_int();
+    channel->publishing_message.header = payload;
+    if (channel->publishing_size == 0) {
+        publish(channel);
+    }
+}
+
+void FakeBroker::handle_input(Connection * connection) {
+    string & input = connection->input;
+    if (!connection->saw_protocol_header) {
+        if (input.size() < sizeof(PROTOCOL_HEADER)) {
+            return;
+        }
+        if (input.compare(0, sizeof(PROTOCOL_HEADER),
+                          string(PROTOCOL_HEADER, sizeof(PROTOCOL_HEADER)))
+            != 0) {
+            // The spec says to answer with the version we do speak.
+            connection->output.append(PROTOCOL_HEADER,
+                                      sizeof(PROTOCOL_HEADER));
+            connection->closing = true;
+            input.clear();
+            return;
+        }
+        input.erase(0, sizeof(PROTOCOL_HEADER));
+        connection->saw_protocol_header = true;
+        send_method(connection, 0, CONNECTION_START,
+                    Writer().octet(0).octet(9).empty_table()
+                            .long_string("PLAIN").long_string("en_US").str());
+    }
+    size_t position = 0;
+    while(connection->fd >= 0 && !connection->closing
+          && input.size() - position >= 7) {
+        const uint8_t * bytes = (const uint8_t *) input.data() + position;
+        uint8_t type = bytes[0];
+        int channel_number = (bytes[1] << 8) | bytes[2];
+        uint32_t size = ((uint32_t) bytes[3] << 24) | (bytes[4] << 16)
+                        | (bytes[5] << 8) | bytes[6];
+        if (size > connection->frame_max) {
+            throw std::runtime_error("Frame too large.");
+        }
+        if (input.size() - position < size + 8) {
+            break;
+        }
+        if (bytes[7 + size] != FRAME_END) {
+            throw std::runtime_error("Bad frame end.");
+        }
+        string payload = input.substr(position + 7, size);
+        position += size + 8;
+
+        if (type == FRAME_HEARTBEAT) {
+            continue;
+        }
+        if (connection->closing_channels.count(channel_number) > 0) {
+            if (type == FRAME_METHOD && payload.size() >= 4
+                && Reader(payload).long_int() == CHANNEL_CLOSE_OK) {
+                connection->closing_channels.erase(channel_number);
+            }
+            continue;
+        }
+        std::map<int, Channel *>::iterator itr
+            = connection->channels.find(channel_number);
+        Channel * channel = itr == connection->channels.end() ? 0
+                                                              : itr->second;
+        if (type == FRAME_METHOD) {
+            handle_method(connection, channel_number, payload);
+        } else if (channel == 0) {
+            throw std::runtime_error("Content for a channel that isn't open.");
+        } else if (type == FRAME_HEADER) {
+            handle_header(channel, payload);
+        } else if (type == FRAME_BODY) {
+            handle_body(channel, payload);
+        }
+    }
+    input.erase(0, position);
+}
+
+void FakeBroker::handle_method(Connection * connection, int channel_number,
+                               const string & payload) {
+    Reader reader(payload);
+    uint32_t method = reader.long_int();
+    string args = payload.substr(4);
+    Reader arg_reader(args);
+    switch(method) {
+        case CONNECTION_START_OK:
+            send_method(connection, 0, CONNECTION_TUNE,
+                        Writer().short_int(0).long_int(FRAME_MAX)
+                                .short_int(0).str());
+            return;
+        case CONNECTION_TUNE_OK:
+            arg_reader.short_int();
+            connection->frame_max = arg_reader.long_int();
+            if (connection->frame_max == 0 || connection->frame_max > FRAME_MAX) {
+                connection->frame_max = FRAME_MAX;
+            }
+            connection->heartbeat = arg_reader.short_int();
+            return;
+        case CONNECTION_OPEN:
+            send_method(connection, 0, CONNECTION_OPEN_OK,
+                        Writer().short_string("").str());
+            return;
+        case CONNECTION_CLOSE:
+            send_method(connection, 0, CONNECTION_CLOSE_OK, "");
+            connection->closing = true;
+            return;
+        case CONNECTION_CLOSE_OK:
+            close_connection(connection);
+            return;
+        case CHANNEL_OPEN: {
+            if (connection->channels.count(channel_number) > 0) {
+                throw std::runtime_error("Channel opened twice.");
+            }
+            Channel * channel = new Channel();
+            channel->confirms = false;
+            channel->connection = connection;
+            channel->next_delivery_tag = 1;
+            channel->next_publish_tag = 1;
+            channel->number = channel_number;
+            channel->prefetch_count = 0;
+            channel->publishing = false;
+            channel->publishing_size = 0;
+            connection->channels[channel_number] = channel;
+            send_method(connection, channel_number, CHANNEL_OPEN_OK,
+                        Writer().long_string("").str());
+            return;
+        }
+        case CHANNEL_CLOSE_OK:
+            return;
+    }
+    std::map<int, Channel *>::iterator itr
+        = connection->channels.find(channel_number);
+    if (itr == connection->channels.end()) {
+        throw std::runtime_error("Method for a channel that isn't open.");
+    }
+    handle_channel_method(itr->second, method, args);
+}
+
+void FakeBroker::loop() {
+    while(true) {
+        vector<struct pollfd> fds;
+        vector<Connection *> polled;
+        bool heartbeats = false;
+        {
+            boost::lock_guard<boost::mutex> lock(mutex);
+            if (stopping) {
+                return;
+            }
+            struct pollfd fd;
+            fd.fd = wake_pipe[0];
+            fd.events = POLLIN;
+            fds.push_back(fd);
+            fd.fd = listen_fd;
+            fds.push_back(fd);
+            if (!frozen) {
+                BOOST_FOREACH(Connection * connection, connections) {
+                    fd.fd = connection->fd;
+                    fd.events = POLLIN;
+                    if (!connection->output.empty()) {
+                        fd.events |= POLLOUT;
+                    }
+                    fds.push_back(fd);
+                    polled.push_back(connection);
+                    heartbeats = heartbeats || connection->heartbeat > 0;
+                }
+            }
+        }
+
+        poll(&fds[0], fds.size(), heartbeats ? 250 : -1);
+
+        boost::lock_guard<boost::mutex> lock(mutex);
+        char buffer[64];
+        while(read(wake_pipe[0], buffer, sizeof(buffer)) > 0) {
+        }
+        // Dropping first leaves alone anyone who connected after asking.
+        if (drop_requested) {
+            drop_requested = false;
+            BOOST_FOREACH(Connection * connection, connections) {
+                close_connection(connection);
+            }
+        }
+        if (fds[1].revents & POLLIN) {
+            accept_connection();
+        }
+        if (!frozen) {
+            for (size_t i = 0; i < polled.size(); i ++) {
+                if (fds[i + 2].revents != 0 && polled[i]->fd >= 0) {
+                    read_from(polled[i]);
+                }
+            }
+            send_heartbeats();
+            BOOST_FOREACH(Connection * connection, connections) {
+                write_to(connection);
+            }
+        }
+        for (std::list<Connection *>::iterator itr = connections.begin();
+             itr != connections.end();) {
+            if ((*itr)->fd < 0) {
+                delete *itr;
+                itr = connections.erase(itr);
+            } else {
+                itr ++;
+            }
+        }
+    }
+}
+
+void FakeBroker::publish(Channel * channel) {
+    Message message = channel->publishing_message;
+    channel->publishing = false;
+    channel->publishing_message = Message();
+    route(message);
+    if (channel->confirms) {
+        // Everything lives in memory, so once routed it's as safe as it
+        // will ever be.
+        send_method(channel->connection, channel->number, BASIC_ACK,
+                    Writer().long_long_int(channel->next_publish_tag ++)
+                            .octet(0).str());
+    }
+}
+
+void FakeBroker::read_from(Connection * connection) {
+    char buffer[16384];
+    while(true) {
+        ssize_t count = recv(connection->fd, buffer, sizeof(buffer), 0);
+        if (count > 0) {
+            connection->input.append(buffer, count);
+            continue;
+        }
+        if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        close_connection(connection);
+        return;
+    }
+    try {
+        handle_input(connection);
+    } catch(const std::exception & e) {
+        // A real broker would send connection.close first, but none of
+        // the clients this is for expect to see that.
+        close_connection(connection);
+    }
+}
+
+void FakeBroker::route(Message & message) {
+    std::set<string> targets;
+    if (message.exchange.empty()) {
+        if (queues.find(message.routing_key) != queues.end()) {
+            targets.insert(message.routing_key);
+        }
+    } else {
+        const Exchange & exchange = exchanges[message.exchange];
+        BOOST_FOREACH(const Binding & binding, exchange.bindings) {
+            if (exchange.type == "fanout"
+                || (exchange.type == "direct"
+                    && binding.routing_key == message.routing_key)
+                || (exchange.type == "topic"
+                    && topic_matches(binding.routing_key,
+                                     message.routing_key))) {
+                targets.insert(binding.queue_name);
+            }
+        }
+    }
+    BOOST_FOREACH(const string & queue_name, targets) {
+        std::map<string, Queue>::iterator queue = queues.find(queue_name);
+        if (queue != queues.end()) {
+            queue->second.messages.push_back(message);
+            deliver(queue_name);
+        }
+    }
+}
+
+void FakeBroker::send_frame(Connection * connection, uint8_t type,
+                            int channel_number, const string & payload) {
+    Writer header;
+    header.octet(type).short_int(channel_number).long_int(payload.size());
+    connection->output += header.str();
+    connection->output += payload;
+    connection->output += (char) FRAME_END;
+}
+
+void FakeBroker::send_heartbeats() {
+    double time = now();
+    BOOST_FOREACH(Connection * connection, connections) {
+        if (connection->fd >= 0 && connection->heartbeat > 0
+            && time - connection->last_sent >= connection->heartbeat / 2.0) {
+            send_frame(connection, FRAME_HEARTBEAT, 0, "");
+        }
+    }
+}
+
+void FakeBroker::send_method(Connection * connection, int channel_number,
+                             uint32_t method, const string & args) {
+    send_frame(connection, FRAME_METHOD, channel_number,
+               Writer().long_int(method).str() + args);
+}
+
+void FakeBroker::set_frozen(bool value) {
+    {
+        boost::lock_guard<boost::mutex> lock(mutex);
+        frozen = value;
+    }
+    wake();
+}
+
+void FakeBroker::wake() {
+    if (write(wake_pipe[1], "!", 1) < 0) {
+        // The pipe's full, so the thread will wake up anyway.
+    }
+}
+
+void FakeBroker::write_to(Connection * connection) {
+    string & output = connection->output;
+    while(connection->fd >= 0 && !output.empty()) {
+        ssize_t count = send(connection->fd, output.data(), output.size(),
+                             MSG_NOSIGNAL);
+        if (count > 0) {
+            output.erase(0, count);
+            connection->last_sent = now();
+            continue;
+        }
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        close_connection(connection);
+        return;
+    }
+    if (connection->closing && connection->fd >= 0) {
+        close_connection(connection);
+    }
+}
+
+} }  // end namespace
@@ -0,0 +1,227 @@
+#ifndef __NOVA_RPC_FAKE_BROKER_H
+#define __NOVA_RPC_FAKE_BROKER_H
+
+#include <boost/thread.hpp>
+#include <deque>
+#include <list>
+#include <map>
+#include <set>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace nova { namespace rpc {
+
+    /** A stand-in for RabbitMQ which speaks just enough AMQP 0-9-1 for
+     *  the guest: connections, channels, exchanges (direct, topic and
+     *  fanout), queues, bindings, basic.qos / consume / publish / ack and
+     *  publisher confirms. It listens on a free port of 127.0.0.1 and runs
+     *  on a thread of its own, so tests and benchmarks can drive the real
+     *  librabbitmq code with nothing else installed.
+     *
+     *  Everything is kept in memory, so durable means nothing, and login
+     *  accepts anyone. Exclusive queues go away with their connection. */
+    class FakeBroker {
+
+        public:
+            FakeBroker();
+
+            ~FakeBroker();
+
+            /** Drops every client connection on the floor without a word,
+             *  as though the network went away. Unacknowledged messages
+             *  go back to their queues. */
+            void drop_connections();
+
+            /** The number of clients connected right now. */
+            size_t get_connection_count();
+
+            /** The number of messages waiting in the queue, not counting
+             *  those delivered but not yet acknowledged. Zero if there is
+             *  no such queue. */
+            size_t get_message_count(const char * queue_name);
+
+            /** The port to connect to on 127.0.0.1. */
+            inline int get_port() const {
+                return port;
+            }
+
+            /** While true the broker stops reading from or writing to its
+             *  clients, without closing anything, like a host that's hung
+             *  or unplugged. New connections are still accepted by the
+             *  kernel but go unanswered. */
+            void set_frozen(bool value);
+
+        private:
+            struct Channel;
+            struct Connection;
+            struct Queue;
+
+            struct Message {
+                std::string body;
+                std::string exchange;
+                // The content header frame's payload, passed on untouched.
+                std::string header;
+                bool redelivered;
+                std::string routing_key;
+            };
+
+            struct Consumer {
+                Channel * channel;
+                bool no_ack;
+                std::string tag;
+            };
+
+            struct Unacked {
+                Message message;
+                std::string queue_name;
+            };
+
+            struct Channel {
+                bool confirms;
+                Connection * connection;
+                std::map<uint64_t, Unacked> unacked;
+                uint64_t next_delivery_tag;
+                uint64_t next_publish_tag;
+                int number;
+                uint16_t prefetch_count;
+                // A publish waiting on its content header and body.
+                bool publishing;
+                Message publishing_message;
+                uint64_t publishing_size;
+            };
+
+            struct Connection {
+                std::map<int, Channel *> channels;
+                // Channels we closed which the client hasn't answered yet.
+                // Anything sent on them meanwhile is thrown away.
+                std::set<int> closing_channels;
+                // Set once connection.close-ok is queued; the socket is
+                // shut when it's been written.
+                bool closing;
+                // Set to -1 once closed, and reaped at the end of a turn.
+                int fd;
+                uint32_t frame_max;
+                int heartbeat;
+                std::string input;
+                double last_sent;
+                std::string output;
+                bool saw_protocol_header;
+            };
+
+            struct Binding {
+                std::string queue_name;
+                std::string routing_key;
+            };
+
+            struct Exchange {
+                std::vector<Binding> bindings;
+                std::string type;
+            };
+
+            struct Queue {
+                std::list<Consumer> consumers;
+                std::deque<Message> messages;
+                // For exclusive queues, which go away with the connection.
+                Connection * owner;
+            };
+
+            std::list<Connection *> connections;
+
+            // Set by drop_connections for the broker thread to act on.
+            bool drop_requested;
+
+            std::map<std::string, Exchange> exchanges;
+
+            bool frozen;
+
+            int listen_fd;
+
+            // Guards everything touched by both the broker thread and the
+            // public methods.
+            boost::mutex mutex;
+
+            int next_consumer_number;
+
+            int next_queue_number;
+
+            int port;
+
+            std::map<std::string, Queue> queues;
+
+            bool stopping;
+
+            boost::thread thread;
+
+            // Written to wake the broker thread up.
+            int wake_pipe[2];
+
+            void accept_connection();
+
+            void bind_queue(Channel * channel, const std::string & payload);
+
+            /* Forgets the channel, handing its unacknowledged messages
+             * back to their queues. */
+            void close_channel(Channel * channel);
+
+            void close_connection(Connection * connection);
+
+            void consume(Channel * channel, const std::string & payload);
+
+            void declare_exchange(Channel * channel,
+                                  const std::string & payload);
+
+            void declare_queue(Channel * channel, const std::string & payload);
+
+            /* Sends as much of the queue's messages as its consumers'
+             * prefetch windows allow. */
+            void deliver(const std::string & queue_name);
+
+            void deliver_all();
+
+            /* Closes the channel from the broker's end with an error, as
+             * RabbitMQ does when for instance a passive declare fails. */
+            void fail_channel(Channel * channel, uint16_t code,
+                              const char * text, uint32_t method);
+
+            /* Settles one delivery, or all up to it if multiple is set.
+             * Unless requeue is set the messages are gone for good. */
+            void finish_delivery(Channel * channel, uint64_t delivery_tag,
+                                 bool multiple, bool requeue);
+
+            void handle_body(Channel * channel, const std::string & payload);
+
+            void handle_channel_method(Channel * channel, uint32_t method,
+                                       const std::string & payload);
+
+            void handle_header(Channel * channel, const std::string & payload);
+
+            void handle_input(Connection * connection);
+
+            void handle_method(Connection * connection, int channel_number,
+                               const std::string & payload);
+
+            void loop();
+
+            void publish(Channel * channel);
+
+            void read_from(Connection * connection);
+
+            void route(Message & message);
+
+            void send_frame(Connection * connection, uint8_t type,
+                            int channel_number, const std::string & payload);
+
+            void send_heartbeats();
+
+            void send_method(Connection * connection, int channel_number,
+                             uint32_t method, const std::string & args);
+
+            void wake();
+
+            void write_to(Connection * connection);
+    };
+
+} }  // end namespace
+
+#endif
@@ -0,0 +1,496 @@
+#define BOOST_TEST_MODULE fake_broker_tests
+#include <boost/test/unit_test.hpp>
+
+#include "fake_broker.h"
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include "nova/rpc/amqp.h"
+#include <poll.h>
+#include "nova/rpc/receiver.h"
+#include "nova/rpc/sender.h"
+#include "nova/rpc/topology.h"
+#include <string>
+
+using nova::JsonData;
+using namespace nova::guest;
+using namespace nova::rpc;
+using std::string;
+
+
+/**---------------------------------------------------------------------------
+ *- Helpers
+ *---------------------------------------------------------------------------*/
+
+const char * const HOST = "127.0.0.1";
+const char * const TOPIC = "guest.host";
+
+AmqpConnectionPtr connect(FakeBroker & broker, int heartbeat=0) {
+    return AmqpConnection::create(HOST, broker.get_port(), "guest", "guest",
+                                  131072, heartbeat);
+}
+
+/** Sets up an exchange and queue named after the msg_id, the way Nova does
+ *  to wait on a reply. */
+void declare_reply_queue(AmqpConnectionPtr connection, const char * msg_id) {
+    connection->attempt_declare_exchange(msg_id, "direct");
+    connection->attempt_declare_queue(msg_id);
+    connection->new_channel()->bind_queue_to_exchange(msg_id, msg_id, msg_id);
+}
+
+GuestOutput null_result() {
+    GuestOutput output;
+    output.failure = boost::none;
+    output.result = JsonData::from_null();
+    return output;
+}
+
+void publish(AmqpConnectionPtr connection, const char * body) {
+    AmqpChannelPtr channel = connection->acquire_channel();
+    channel->publish("nova", TOPIC, body);
+    connection->release_channel(channel);
+}
+
+void unfreeze_later(FakeBroker * broker, int seconds) {
+    boost::this_thread::sleep(boost::posix_time::seconds(seconds));
+    broker->set_frozen(false);
+}
+
+/** Waits on the receiver's socket until it has a new connection, as the
+ *  daemon's reactor does after a reset. */
+void wait_for_reconnect(ResilentReceiver & receiver) {
+    const unsigned long reconnects = receiver.get_reconnects();
+    while (receiver.get_reconnects() == reconnects) {
+        struct pollfd poll_fd;
+        poll_fd.fd = receiver.get_socket_fd();
+        poll_fd.events = POLLIN;
+        poll(&poll_fd, 1, -1);
+        BOOST_REQUIRE(!receiver.read_message());
+    }
+}
+
+
+/**---------------------------------------------------------------------------
+ *- Tests
+ *---------------------------------------------------------------------------*/
+
+BOOST_AUTO_TEST_CASE(messages_are_received_and_replied_to)
+{
+    FakeBroker broker;
+    AmqpConnectionPtr connection = connect(broker);
+    ReceiverConfig config;
+    config.publisher_confirms = true;
+    Receiver receiver(connection, TOPIC, "nova", config);
+
+    AmqpConnectionPtr client = connect(broker);
+    declare_reply_queue(client, "reply_1");
+    publish(client, "{ 'method':'list_users', '_msg_id':'reply_1' }");
+
+    GuestInput input = receiver.next_message();
+    BOOST_CHECK_EQUAL(input.method_name, "list_users");
+    BOOST_REQUIRE(!!input.msg_id);
+    BOOST_CHECK_EQUAL(input.msg_id.get(), "reply_1");
+    receiver.finish_message(input, null_result());
+    BOOST_CHECK_EQUAL(broker.get_message_count(TOPIC), 0u);
+
+    AmqpChannelPtr replies = client->new_channel();
+    AmqpQueueMessagePtr reply = replies->get_message("reply_1");
+    BOOST_REQUIRE(!!reply);
+    string body(reply->body(), reply->body_length());
+    BOOST_CHECK(body.find("\"result\"") != string::npos);
+    // Followed by the empty "roger" message.
+    reply = replies->get_message("reply_1");
+    BOOST_REQUIRE(!!reply);
+}
+
+BOOST_AUTO_TEST_CASE(large_bodies_are_compressed_both_ways)
+{
+    FakeBroker broker;
+    AmqpConnectionPtr connection = connect(broker);
+    ReceiverConfig config;
+    config.compression_threshold = 64;
+    Receiver receiver(connection, TOPIC, "nova", config);
+
+    AmqpConnectionPtr client = connect(broker);
+    declare_reply_queue(client, "reply_2");
+    string request = "{ 'method':'create_database', '_msg_id':'reply_2', "
+                     "'args':{ 'name':'";
+    request += string(1000, 'a');
+    request += "' } }";
+    AmqpChannelPtr channel = client->new_channel();
+    channel->set_compression_threshold(64);
+    channel->publish("nova", TOPIC, request.c_str());
+
+    GuestInput input = receiver.next_message();
+    BOOST_CHECK_EQUAL(input.method_name, "create_database");
+    BOOST_CHECK_EQUAL(input.args_text,
+                      "{ 'name':'" + string(1000, 'a') + "' }");
+    GuestOutput output;
+    output.failure = boost::none;
+    output.result = JsonData::from_string(string(1000, 'b').c_str());
+    receiver.finish_message(input, output);
+
+    AmqpQueueMessagePtr reply = client->new_channel()->get_message("reply_2");
+    BOOST_REQUIRE(!!reply);
+    BOOST_CHECK(reply->content_encoding.empty());
+    string body(reply->body(), reply->body_length());
+    BOOST_CHECK(body.find(string(1000, 'b')) != string::npos);
+}
+
+BOOST_AUTO_TEST_CASE(bodies_inflating_past_the_limit_are_refused)
+{
+    FakeBroker broker;
+    // With 4k frames nothing may inflate past 4 MB.
+    AmqpConnectionPtr connection = AmqpConnection::create(HOST,
+        broker.get_port(), "guest", "guest", 4096, 0);
+    Receiver receiver(connection, TOPIC, "nova");
+
+    AmqpConnectionPtr client = connect(broker);
+    declare_reply_queue(client, "reply_bomb");
+    string request = "{ 'method':'create_database', '_msg_id':'reply_bomb', "
+                     "'args':{ 'name':'";
+    request += string(8 * 1024 * 1024, 'a');
+    request += "' } }";
+    AmqpChannelPtr channel = client->new_channel();
+    channel->set_compression_threshold(64);
+    channel->publish("nova", TOPIC, request.c_str());
+    publish(client, "{ 'method':'list_databases' }");
+
+    GuestInput input = receiver.next_message();
+    BOOST_CHECK_EQUAL(input.method_name, "list_databases");
+    receiver.finish_message(input, null_result());
+
+    AmqpChannelPtr replies = client->new_channel();
+    AmqpQueueMessagePtr reply = replies->get_message("reply_bomb");
+    BOOST_REQUIRE(!!reply);
+    string body(reply->body(), reply->body_length());
+    BOOST_CHECK(body.find("malformed") != string::npos);
+}
+
+BOOST_AUTO_TEST_CASE(malformed_messages_are_answered_and_acknowledged)
+{
+    FakeBroker broker;
+    AmqpConnectionPtr connection = connect(broker);
+    Receiver receiver(connection, TOPIC, "nova");
+
+    AmqpConnectionPtr client = connect(broker);
+    declare_reply_queue(client, "reply_bad");
+    publish(client, "{ '_msg_id':'reply_bad', 'method':[1] }");
+    publish(client, "{ '_msg_id':'reply_bad', 'method':'list_users'");
+    publish(client, "{ '_msg_id':'reply_bad', 'method':'list_\xff' }");
+    publish(client, "{ '_msg_id':'reply_bad', 'method':'list_users', "
+                    "'args':[] }");
+    publish(client, "{ 'method':'list_databases' }");
+
+    // The bad ones are passed over on the way to the good one.
+    GuestInput input = receiver.next_message();
+    BOOST_CHECK_EQUAL(input.method_name, "list_databases");
+    receiver.finish_message(input, null_result());
+    BOOST_CHECK_EQUAL(broker.get_message_count(TOPIC), 0u);
+
+    AmqpChannelPtr replies = client->new_channel();
+    for (int i = 0; i < 4; i ++) {
+        AmqpQueueMessagePtr reply = replies->get_message("reply_bad");
+        BOOST_REQUIRE(!!reply);
+        string body(reply->body(), reply->body_length());
+        BOOST_CHECK(body.find("malformed") != string::npos);
+        // Followed by the empty "roger" message.
+        BOOST_REQUIRE(!!replies->get_message("reply_bad"));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(missing_reply_exchange_only_loses_the_reply)
+{
+    FakeBroker broker;
+    AmqpConnectionPtr connection = connect(broker);
+    ReceiverConfig config;
+    config.publisher_confirms = true;
+    Receiver receiver(connection, TOPIC, "nova", config);
+
+    AmqpConnectionPtr client = connect(broker);
+    declare_reply_queue(client, "reply_kept");
+    publish(client, "{ 'method':'list_users', '_msg_id':'reply_gone' }");
+    publish(client, "{ 'method':'list_users', '_msg_id':'reply_kept' }");
+
+    // The broker closes the reply channel, which mustn't throw.
+    GuestInput input = receiver.next_message();
+    BOOST_CHECK_EQUAL(input.msg_id.get(), "reply_gone");
+    receiver.finish_message(input, null_result());
+
+    // The same connection carries on.
+    input = receiver.next_message();
+    BOOST_CHECK_EQUAL(input.msg_id.get(), "reply_kept");
+    receiver.finish_message(input, null_result());
+    BOOST_CHECK_EQUAL(broker.get_message_count(TOPIC), 0u);
+
+    AmqpChannelPtr replies = client->new_channel();
+    BOOST_REQUIRE(!!replies->get_message("reply_kept"));
+}
+
+BOOST_AUTO_TEST_CASE(each_connection_gets_its_own_fanout_queue)
+{
+    FakeBroker broker;
+    ReceiverConfig config;
+    config.fanout_exchange = "guest_fanout";
+    // The old connection is still around, as it is when the broker hasn't
+    // noticed a lost one yet, and holds on to its exclusive queue.
+    AmqpConnectionPtr old_connection = connect(broker);
+    Receiver old_receiver(old_connection, TOPIC, "nova", config);
+    AmqpConnectionPtr connection = connect(broker);
+    Receiver receiver(connection, TOPIC, "nova", config);
+
+    AmqpConnectionPtr client = connect(broker);
+    AmqpChannelPtr channel = client->new_channel();
+    channel->publish("guest_fanout", "", "{ 'method':'list_users' }");
+    GuestInput input = receiver.next_message();
+    BOOST_CHECK_EQUAL(input.method_name, "list_users");
+    receiver.finish_message(input, null_result());
+}
+
+BOOST_AUTO_TEST_CASE(a_topology_that_fails_to_replay_is_declared_again)
+{
+    FakeBroker broker;
+    AmqpConnectionPtr connection = connect(broker);
+    // The exchange is only checked for, and isn't there.
+    AmqpTopology topology;
+    topology.add_exchange("missing", "topic", true);
+    topology.add_queue(TOPIC, false, false, false);
+    topology.add_binding(TOPIC, "missing", TOPIC);
+    Receiver receiver(connection, TOPIC, "nova", ReceiverConfig(), &topology);
+
+    AmqpConnectionPtr client = connect(broker);
+    publish(client, "{ 'method':'list_users' }");
+    GuestInput input = receiver.next_message();
+    BOOST_CHECK_EQUAL(input.method_name, "list_users");
+}
+
+BOOST_AUTO_TEST_CASE(unacknowledged_messages_are_redelivered)
+{
+    FakeBroker broker;
+    {
+        AmqpConnectionPtr connection = connect(broker);
+        Receiver receiver(connection, TOPIC, "nova");
+        publish(connection, "{ 'method':'list_users' }");
+        GuestInput input = receiver.next_message();
+        BOOST_CHECK_EQUAL(input.method_name, "list_users");
+        // Gone without finishing the message.
+    }
+    BOOST_CHECK_EQUAL(broker.get_message_count(TOPIC), 1u);
+
+    AmqpConnectionPtr connection = connect(broker);
+    Receiver receiver(connection, TOPIC, "nova");
+    GuestInput input = receiver.next_message();
+    BOOST_CHECK_EQUAL(input.method_name, "list_users");
+    receiver.finish_message(input, null_result());
+}
+
+BOOST_AUTO_TEST_CASE(resilent_receiver_reconnects_after_connections_drop)
+{
+    FakeBroker broker;
+    ResilentReceiver receiver(HOST, broker.get_port(), "guest", "guest",
+                              131072, TOPIC, "nova", 0);
+    BOOST_CHECK_EQUAL(broker.get_connection_count(), 1u);
+
+    broker.drop_connections();
+    AmqpConnectionPtr client = connect(broker);
+    publish(client, "{ 'method':'list_databases' }");
+
+    GuestInput input = receiver.next_message();
+    BOOST_CHECK_EQUAL(input.method_name, "list_databases");
+    BOOST_CHECK_EQUAL(receiver.get_reconnects(), 1u);
+    receiver.finish_message(input, null_result());
+}
+
+BOOST_AUTO_TEST_CASE(reconnecting_does_not_hold_up_the_caller)
+{
+    FakeBroker broker;
+    ResilentReceiver receiver(HOST, broker.get_port(), "guest", "guest",
+                              131072, TOPIC, "nova", 30);
+    unsigned long generation = receiver.get_connection_generation();
+
+    broker.drop_connections();
+    boost::posix_time::ptime start =
+        boost::posix_time::microsec_clock::universal_time();
+    BOOST_CHECK(!receiver.read_message());
+    BOOST_CHECK(!receiver.read_message());
+    boost::posix_time::time_duration taken =
+        boost::posix_time::microsec_clock::universal_time() - start;
+    BOOST_CHECK(taken.total_seconds() < 1);
+    // The caller watches the reconnect pipe in the meantime.
+    BOOST_CHECK(receiver.get_connection_generation() != generation);
+}
+
+BOOST_AUTO_TEST_CASE(missed_heartbeats_are_noticed)
+{
+    FakeBroker broker;
+    ReceiverConfig config;
+    config.heartbeat = 1;
+    ResilentReceiver receiver(HOST, broker.get_port(), "guest", "guest",
+                              131072, TOPIC, "nova", 0, config);
+    unsigned long generation = receiver.get_connection_generation();
+
+    // Without heartbeats this would wait forever on the hung broker.
+    broker.set_frozen(true);
+    boost::thread thaw(boost::bind(unfreeze_later, &broker, 3));
+    BOOST_CHECK(!receiver.read_message());
+    thaw.join();
+    wait_for_reconnect(receiver);
+    BOOST_CHECK_EQUAL(receiver.get_reconnects(), 1u);
+    BOOST_CHECK(receiver.get_connection_generation() != generation);
+}
+
+BOOST_AUTO_TEST_CASE(redelivered_messages_are_not_run_twice)
+{
+    FakeBroker broker;
+    ReceiverConfig config;
+    config.reply_cache_size = 4;
+    ResilentReceiver receiver(HOST, broker.get_port(), "guest", "guest",
+                              131072, TOPIC, "nova", 0, config);
+    {
+        AmqpConnectionPtr client = connect(broker);
+        declare_reply_queue(client, "reply_3");
+        publish(client, "{ 'method':'list_users', '_msg_id':'reply_3' }");
+    }
+    GuestInput input = receiver.next_message();
+
+    // The broker hands the message out again while it's still being run.
+    broker.drop_connections();
+    BOOST_CHECK(!receiver.read_message());
+    wait_for_reconnect(receiver);
+    BOOST_CHECK_EQUAL(receiver.get_reconnects(), 1u);
+    BOOST_CHECK(!receiver.read_message());
+    receiver.finish_message(input, null_result());
+    BOOST_CHECK_EQUAL(broker.get_message_count(TOPIC), 0u);
+    // The result and the empty "roger" message, sent once.
+    BOOST_CHECK_EQUAL(broker.get_message_count("reply_3"), 2u);
+
+    // Once finished, the reply comes straight from the cache.
+    AmqpConnectionPtr client = connect(broker);
+    publish(client, "{ 'method':'list_users', '_msg_id':'reply_3' }");
+    BOOST_CHECK(!receiver.read_message());
+    BOOST_CHECK_EQUAL(broker.get_message_count(TOPIC), 0u);
+    BOOST_CHECK_EQUAL(broker.get_message_count("reply_3"), 4u);
+}
+
+BOOST_AUTO_TEST_CASE(replies_holding_credentials_are_not_cached)
+{
+    FakeBroker broker;
+    ReceiverConfig config;
+    config.reply_cache_size = 4;
+    ResilentReceiver receiver(HOST, broker.get_port(), "guest", "guest",
+                              131072, TOPIC, "nova", 0, config);
+    AmqpConnectionPtr client = connect(broker);
+    declare_reply_queue(client, "reply_4");
+    publish(client, "{ 'method':'enable_root', '_msg_id':'reply_4' }");
+    GuestInput input = receiver.next_message();
+    GuestOutput output;
+    output.failure = boost::none;
+    output.result = JsonData::from_string("{'password':'secret'}");
+    receiver.finish_message(input, output);
+
+    // So the copy is run again rather than answered.
+    publish(client, "{ 'method':'enable_root', '_msg_id':'reply_4' }");
+    input = receiver.next_message();
+    BOOST_CHECK_EQUAL(input.method_name, "enable_root");
+    receiver.finish_message(input, null_result());
+}
+
+BOOST_AUTO_TEST_CASE(async_sender_publishes_in_the_background)
+{
+    FakeBroker broker;
+    SenderConfig config;
+    config.async = true;
+    config.batch_size = 8;
+    config.overflow_policy = SenderConfig::BLOCK;
+    config.queue_capacity = 16;
+    {
+        Sender sender(connect(broker), "notifications", config);
+        for (int i = 0; i < 100; i ++) {
+            sender.send("{ 'event':'status' }");
+        }
+        BOOST_CHECK_EQUAL(sender.get_queued_count(), 100u);
+        BOOST_CHECK_EQUAL(sender.get_dropped_count(), 0u);
+        // Everything queued is published before the sender goes away.
+    }
+    BOOST_CHECK_EQUAL(broker.get_message_count("notifications"), 100u);
+}
+
+BOOST_AUTO_TEST_CASE(async_sender_drops_the_oldest_when_full)
+{
+    FakeBroker broker;
+    SenderConfig config;
+    config.async = true;
+    config.overflow_policy = SenderConfig::DROP_OLDEST;
+    config.queue_capacity = 4;
+    boost::thread thaw;
+    {
+        Sender sender(connect(broker), "notifications", config);
+        // Once the socket fills up nothing more can be published.
+        broker.set_frozen(true);
+        thaw = boost::thread(boost::bind(unfreeze_later, &broker, 1));
+        for (int i = 0; i < 10000; i ++) {
+            sender.send("{ 'event':'status' }");
+        }
+        BOOST_CHECK_EQUAL(sender.get_queued_count(), 10000u);
+        BOOST_CHECK(sender.get_dropped_count() > 0);
+    }
+    thaw.join();
+    BOOST_CHECK(broker.get_message_count("notifications") < 10000u);
+}
+
+BOOST_AUTO_TEST_CASE(async_sender_gives_up_on_a_broker_that_stopped)
+{
+    FakeBroker broker;
+    SenderConfig config;
+    config.async = true;
+    config.drain_timeout = 0.5;
+    config.overflow_policy = SenderConfig::DROP_OLDEST;
+    const boost::posix_time::ptime start =
+        boost::posix_time::microsec_clock::universal_time();
+    {
+        Sender sender(connect(broker), "notifications", config);
+        // Never thawed, so the socket fills up and publishing blocks.
+        broker.set_frozen(true);
+        for (int i = 0; i < 10000; i ++) {
+            sender.send("{ 'event':'status' }");
+        }
+        BOOST_CHECK(!sender.has_failed());
+    }
+    const boost::posix_time::time_duration waited =
+        boost::posix_time::microsec_clock::universal_time() - start;
+    BOOST_CHECK(waited < boost::posix_time::seconds(5));
+}
+
+BOOST_AUTO_TEST_CASE(deadlines_come_from_the_context_timestamp)
+{
+    FakeBroker broker;
+    AmqpConnectionPtr connection = connect(broker);
+    ReceiverConfig config;
+    config.time_budget = 60;
+    config.method_time_budgets["list_users"] = 5;
+    Receiver receiver(connection, TOPIC, "nova", config);
+
+    AmqpConnectionPtr client = connect(broker);
+    declare_reply_queue(client, "reply_4");
+    declare_reply_queue(client, "reply_5");
+    publish(client, "{ 'method':'list_users', '_msg_id':'reply_4', "
+                    "'_context_timestamp':'2011-05-12T19:07:32.500000' }");
+    publish(client, "{ 'method':'list_databases', '_msg_id':'reply_5', "
+                    "'_context_timestamp':'2011-05-12T19:07:32.500000' }");
+    // Nobody waits on a cast.
+    publish(client, "{ 'method':'prepare', "
+                    "'_context_timestamp':'2011-05-12T19:07:32.500000' }");
+
+    GuestInput input = receiver.next_message();
+    BOOST_REQUIRE(!!input.deadline);
+    BOOST_CHECK_CLOSE(input.deadline.get(), 1305227257.5, 0.0000001);
+    receiver.finish_message(input, null_result());
+
+    input = receiver.next_message();
+    BOOST_REQUIRE(!!input.deadline);
+    BOOST_CHECK_CLOSE(input.deadline.get(), 1305227312.5, 0.0000001);
+    receiver.finish_message(input, null_result());
+
+    input = receiver.next_message();
+    BOOST_CHECK(!input.deadline);
+    receiver.finish_message(input, null_result());
+}
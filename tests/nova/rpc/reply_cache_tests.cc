@@ -0,0 +1,146 @@
+#define BOOST_TEST_MODULE reply_cache_tests
+#include <boost/test/unit_test.hpp>
+
+#include <boost/format.hpp>
+#include <fstream>
+#include "nova/rpc/reply_cache.h"
+#include <stdio.h>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using boost::format;
+using nova::rpc::ReplyCache;
+using std::string;
+
+
+/**---------------------------------------------------------------------------
+ *- Helpers
+ *---------------------------------------------------------------------------*/
+
+/** Gives each test a file of its own, removed afterwards. */
+struct CacheFile {
+    const string path;
+
+    CacheFile()
+    : path(str(format("/tmp/reply_cache_tests_%d") % getpid())) {
+        remove(path.c_str());
+    }
+
+    ~CacheFile() {
+        remove(path.c_str());
+        remove((path + ".tmp").c_str());
+    }
+
+    size_t line_count() const {
+        std::ifstream file(path.c_str());
+        string line;
+        size_t count = 0;
+        while(std::getline(file, line)) {
+            count ++;
+        }
+        return count;
+    }
+};
+
+string msg_id(int number) {
+    return str(format("msg_%d") % number);
+}
+
+
+/**---------------------------------------------------------------------------
+ *- Tests
+ *---------------------------------------------------------------------------*/
+
+BOOST_AUTO_TEST_CASE(oldest_replies_are_forgotten_first)
+{
+    ReplyCache cache(2);
+    cache.put("a", "{ \"result\":1 }");
+    cache.put("b", "{ \"result\":2 }");
+    BOOST_REQUIRE(!!cache.get("a"));
+    BOOST_CHECK_EQUAL(cache.get("a").get(), "{ \"result\":1 }");
+
+    cache.put("c", "{ \"result\":3 }");
+    BOOST_CHECK_EQUAL(cache.size(), 2u);
+    BOOST_CHECK(!cache.get("a"));
+    BOOST_CHECK(!!cache.get("b"));
+    BOOST_CHECK(!!cache.get("c"));
+}
+
+BOOST_AUTO_TEST_CASE(first_reply_wins)
+{
+    ReplyCache cache(2);
+    cache.put("a", "first");
+    cache.put("a", "second");
+    BOOST_CHECK_EQUAL(cache.size(), 1u);
+    BOOST_CHECK_EQUAL(cache.get("a").get(), "first");
+}
+
+BOOST_AUTO_TEST_CASE(zero_capacity_remembers_nothing)
+{
+    ReplyCache cache(0);
+    cache.put("a", "first");
+    BOOST_CHECK(!cache.get("a"));
+}
+
+BOOST_AUTO_TEST_CASE(replies_are_read_back_from_the_file)
+{
+    CacheFile file;
+    {
+        ReplyCache cache(3, file.path);
+        for (int i = 0; i < 4; i ++) {
+            cache.put(msg_id(i), str(format("{ \"result\":%d }") % i));
+        }
+    }
+    ReplyCache cache(3, file.path);
+    BOOST_CHECK_EQUAL(cache.size(), 3u);
+    BOOST_CHECK(!cache.get(msg_id(0)));
+    BOOST_REQUIRE(!!cache.get(msg_id(3)));
+    BOOST_CHECK_EQUAL(cache.get(msg_id(3)).get(), "{ \"result\":3 }");
+}
+
+BOOST_AUTO_TEST_CASE(file_is_compacted)
+{
+    CacheFile file;
+    ReplyCache cache(2, file.path);
+    for (int i = 0; i < 20; i ++) {
+        cache.put(msg_id(i), "{}");
+        BOOST_CHECK(file.line_count() <= 4u);
+    }
+    ReplyCache reloaded(2, file.path);
+    BOOST_CHECK_EQUAL(reloaded.size(), 2u);
+    BOOST_CHECK(!!reloaded.get(msg_id(19)));
+}
+
+BOOST_AUTO_TEST_CASE(partial_lines_are_skipped)
+{
+    CacheFile file;
+    {
+        std::ofstream out(file.path.c_str());
+        out << "a\t{}\n" << "cut_sh";
+    }
+    ReplyCache cache(2, file.path);
+    BOOST_CHECK_EQUAL(cache.size(), 1u);
+    BOOST_CHECK(!!cache.get("a"));
+}
+
+BOOST_AUTO_TEST_CASE(only_the_owner_may_read_the_file)
+{
+    CacheFile file;
+    {
+        std::ofstream out(file.path.c_str());
+        out << "a\t{}\n";
+    }
+    chmod(file.path.c_str(), 0644);
+    ReplyCache cache(1, file.path);
+    cache.put("b", "{}");
+    struct stat info;
+    BOOST_REQUIRE_EQUAL(stat(file.path.c_str(), &info), 0);
+    BOOST_CHECK_EQUAL(info.st_mode & 0777, 0600u);
+
+    // Compacting writes a new file, which must be closed up as well.
+    cache.put("c", "{}");
+    BOOST_REQUIRE_EQUAL(stat(file.path.c_str(), &info), 0);
+    BOOST_CHECK_EQUAL(info.st_mode & 0777, 0600u);
+    BOOST_CHECK_EQUAL(file.line_count(), 1u);
+}
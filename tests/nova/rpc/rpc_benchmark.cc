@@ -0,0 +1,107 @@
+/* Times the receive / reply path against the in-process fake broker.
+ *
+ * Usage: rpc_benchmark [message count] [prefetch count]
+ *
+ * First sends messages one at a time, waiting on each reply, to get the
+ * round trip latency. Then publishes all of them up front and times how
+ * fast the receiver gets through them. */
+#include "fake_broker.h"
+#include <algorithm>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include "nova/rpc/amqp.h"
+#include "nova/rpc/receiver.h"
+#include <iostream>
+#include <stdlib.h>
+#include <vector>
+
+using namespace boost::posix_time;
+using nova::JsonData;
+using namespace nova::guest;
+using namespace nova::rpc;
+using std::vector;
+
+namespace {
+
+    const char * const REPLY_QUEUE = "benchmark_reply";
+    const char * const TOPIC = "guest.benchmark";
+
+    double seconds_since(const ptime & start) {
+        return (microsec_clock::universal_time() - start)
+               .total_microseconds() / 1000000.0;
+    }
+
+    void handle_one(Receiver & receiver) {
+        GuestInput input = receiver.next_message();
+        GuestOutput output;
+        output.failure = boost::none;
+        output.result = JsonData::from_null();
+        receiver.finish_message(input, output);
+    }
+
+    /* Each reply comes as the result followed by an empty message. */
+    void read_reply(AmqpChannelPtr replies) {
+        replies->get_message(REPLY_QUEUE);
+        replies->get_message(REPLY_QUEUE);
+    }
+
+}
+
+int main(int argc, const char * argv[]) {
+    const int count = argc > 1 ? atoi(argv[1]) : 1000;
+    ReceiverConfig config;
+    config.prefetch_count = argc > 2 ? atoi(argv[2]) : 10;
+    config.publisher_confirms = true;
+    const char * const message = "{ 'method':'list_users', "
+                                 "'_msg_id':'benchmark_reply' }";
+    try {
+        FakeBroker broker;
+        AmqpConnectionPtr connection = AmqpConnection::create(
+            "127.0.0.1", broker.get_port(), "guest", "guest", 131072);
+        Receiver receiver(connection, TOPIC, "nova", config);
+
+        AmqpConnectionPtr client = AmqpConnection::create(
+            "127.0.0.1", broker.get_port(), "guest", "guest", 131072);
+        client->attempt_declare_exchange(REPLY_QUEUE, "direct");
+        client->attempt_declare_queue(REPLY_QUEUE);
+        client->new_channel()->bind_queue_to_exchange(REPLY_QUEUE,
+            REPLY_QUEUE, REPLY_QUEUE);
+        AmqpChannelPtr requests = client->new_channel();
+        AmqpChannelPtr replies = client->new_channel();
+
+        vector<double> latencies;
+        for (int i = 0; i < count; i ++) {
+            ptime start = microsec_clock::universal_time();
+            requests->publish("nova", TOPIC, message);
+            handle_one(receiver);
+            read_reply(replies);
+            latencies.push_back(seconds_since(start));
+        }
+        std::sort(latencies.begin(), latencies.end());
+        std::cout << "Round trip latency over " << count << " messages:"
+                  << std::endl
+                  << "    p50 " << latencies[count / 2] * 1000000 << " us"
+                  << std::endl
+                  << "    p99 " << latencies[count * 99 / 100] * 1000000
+                  << " us" << std::endl;
+
+        for (int i = 0; i < count; i ++) {
+            requests->publish("nova", TOPIC, message);
+        }
+        ptime start = microsec_clock::universal_time();
+        for (int i = 0; i < count; i ++) {
+            handle_one(receiver);
+        }
+        double elapsed = seconds_since(start);
+        std::cout << "Received and replied to " << count << " queued messages "
+                  << "in " << elapsed << " s (" << count / elapsed
+                  << " per second) with a prefetch count of "
+                  << config.prefetch_count << "." << std::endl;
+        for (int i = 0; i < count; i ++) {
+            read_reply(replies);
+        }
+    } catch(const std::exception & e) {
+        std::cerr << "Error : " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
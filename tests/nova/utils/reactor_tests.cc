@@ -0,0 +1,75 @@
+#define BOOST_TEST_MODULE reactor_tests
+#include <boost/test/unit_test.hpp>
+
+#include <boost/bind.hpp>
+#include "nova/utils/reactor.h"
+#include <signal.h>
+#include <unistd.h>
+
+using namespace nova::utils;
+
+
+/**---------------------------------------------------------------------------
+ *- Helpers
+ *---------------------------------------------------------------------------*/
+
+void increment(int * count) {
+    (*count) ++;
+}
+
+void increment_and_stop(int * count, Reactor * reactor) {
+    (*count) ++;
+    reactor->stop();
+}
+
+
+/**---------------------------------------------------------------------------
+ *- Reactor Tests
+ *---------------------------------------------------------------------------*/
+
+BOOST_AUTO_TEST_CASE(readers_are_called_when_there_is_data)
+{
+    int fds[2];
+    BOOST_REQUIRE_EQUAL(pipe(fds), 0);
+    Reactor reactor;
+    int count = 0;
+    reactor.add_reader(fds[0], boost::bind(increment, &count));
+
+    BOOST_CHECK_EQUAL(reactor.run_once(0.01), 0);
+    BOOST_CHECK_EQUAL(count, 0);
+
+    BOOST_REQUIRE_EQUAL(write(fds[1], "!", 1), 1);
+    BOOST_CHECK_EQUAL(reactor.run_once(1.0), 1);
+    BOOST_CHECK_EQUAL(count, 1);
+
+    reactor.remove_reader(fds[0]);
+    BOOST_CHECK_EQUAL(reactor.run_once(0.01), 0);
+    BOOST_CHECK_EQUAL(count, 1);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+BOOST_AUTO_TEST_CASE(timers_repeat_until_removed)
+{
+    Reactor reactor;
+    int count = 0;
+    int id = reactor.add_timer(0.0, 0.01, boost::bind(increment, &count));
+    while(count < 3) {
+        reactor.run_once(1.0);
+    }
+    reactor.remove_timer(id);
+    int final_count = count;
+    BOOST_CHECK_EQUAL(reactor.run_once(0.05), 0);
+    BOOST_CHECK_EQUAL(count, final_count);
+}
+
+BOOST_AUTO_TEST_CASE(signals_are_handled_as_events)
+{
+    Reactor reactor;
+    int count = 0;
+    reactor.add_signal_handler(SIGUSR1,
+        boost::bind(increment_and_stop, &count, &reactor));
+    BOOST_REQUIRE_EQUAL(raise(SIGUSR1), 0);
+    reactor.run();
+    BOOST_CHECK_EQUAL(count, 1);
+}
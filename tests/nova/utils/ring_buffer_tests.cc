@@ -0,0 +1,93 @@
+#define BOOST_TEST_MODULE ring_buffer_tests
+#include <boost/test/unit_test.hpp>
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include "nova/utils/ring_buffer.h"
+#include <string>
+#include <vector>
+
+using nova::utils::RingBuffer;
+using std::string;
+
+
+/**---------------------------------------------------------------------------
+ *- Helpers
+ *---------------------------------------------------------------------------*/
+
+const int PER_THREAD = 20000;
+const int THREADS = 4;
+
+void pop_until_done(RingBuffer<int> * buffer, volatile int * popped,
+                    long * sum) {
+    int value;
+    while (__sync_fetch_and_add(popped, 0) < PER_THREAD * THREADS) {
+        if (buffer->try_pop(value)) {
+            __sync_fetch_and_add(popped, 1);
+            __sync_fetch_and_add(sum, (long) value);
+        } else {
+            boost::this_thread::yield();
+        }
+    }
+}
+
+void push_all(RingBuffer<int> * buffer) {
+    for (int i = 1; i <= PER_THREAD; i ++) {
+        while (!buffer->try_push(i)) {
+            boost::this_thread::yield();
+        }
+    }
+}
+
+
+/**---------------------------------------------------------------------------
+ *- Tests
+ *---------------------------------------------------------------------------*/
+
+BOOST_AUTO_TEST_CASE(capacity_is_rounded_up_to_a_power_of_two)
+{
+    BOOST_CHECK_EQUAL(RingBuffer<int>(1).capacity(), 2u);
+    BOOST_CHECK_EQUAL(RingBuffer<int>(8).capacity(), 8u);
+    BOOST_CHECK_EQUAL(RingBuffer<int>(1000).capacity(), 1024u);
+}
+
+BOOST_AUTO_TEST_CASE(values_come_out_in_order)
+{
+    RingBuffer<string> buffer(4);
+    string value;
+    BOOST_CHECK(!buffer.try_pop(value));
+    BOOST_CHECK(buffer.empty());
+    for (int lap = 0; lap < 3; lap ++) {
+        BOOST_CHECK(buffer.try_push("a"));
+        BOOST_CHECK(buffer.try_push("b"));
+        BOOST_CHECK(buffer.try_push("c"));
+        BOOST_CHECK(buffer.try_push("d"));
+        BOOST_CHECK(!buffer.try_push("e"));
+        BOOST_CHECK(!buffer.empty());
+        BOOST_REQUIRE(buffer.try_pop(value));
+        BOOST_CHECK_EQUAL(value, "a");
+        BOOST_REQUIRE(buffer.try_pop(value));
+        BOOST_CHECK_EQUAL(value, "b");
+        BOOST_REQUIRE(buffer.try_pop(value));
+        BOOST_CHECK_EQUAL(value, "c");
+        BOOST_REQUIRE(buffer.try_pop(value));
+        BOOST_CHECK_EQUAL(value, "d");
+        BOOST_CHECK(!buffer.try_pop(value));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(nothing_is_lost_between_threads)
+{
+    RingBuffer<int> buffer(64);
+    volatile int popped = 0;
+    long sum = 0;
+    boost::thread_group threads;
+    for (int i = 0; i < THREADS; i ++) {
+        threads.create_thread(boost::bind(push_all, &buffer));
+        threads.create_thread(boost::bind(pop_until_done, &buffer, &popped,
+                                          &sum));
+    }
+    threads.join_all();
+    BOOST_CHECK_EQUAL(popped, PER_THREAD * THREADS);
+    BOOST_CHECK_EQUAL(sum, (long) PER_THREAD * (PER_THREAD + 1) / 2 * THREADS);
+}
@@ -0,0 +1,103 @@
+/* Times each text scanner against the others, and JSON string escaping
+ * against json-c, which json_string used to go through. Run it on the
+ * machine the guest runs on; the numbers mean little anywhere else. */
+#include <boost/foreach.hpp>
+#include <json/json.h>
+#include "nova/json.h"
+#include "nova/utils/text.h"
+#include <stdio.h>
+#include <string>
+#include <sys/time.h>
+
+using nova::JsonWriter;
+using nova::utils::available_text_scanners;
+using nova::utils::TextScanner;
+using std::string;
+
+namespace {
+
+    double now() {
+        struct timeval tv;
+        gettimeofday(&tv, 0);
+        return tv.tv_sec + tv.tv_usec / 1000000.0;
+    }
+
+    /* Something like the output of a command sent back to Nova. */
+    string make_text(size_t length) {
+        const string piece = "Setting up mysql-server-5.1 (5.1.41-3ubuntu12) "
+                             "... caf\xc3\xa9 \"done\"\n";
+        string text;
+        while (text.size() < length) {
+            text += piece;
+        }
+        text.resize(length);
+        return text;
+    }
+
+    void report(const char * what, const char * how, size_t bytes,
+                double seconds) {
+        printf("%-16s %-8s %10.1f MB/s\n", what, how,
+               bytes / seconds / (1024 * 1024));
+    }
+
+    // Keeps the compiler from dropping results nobody reads.
+    volatile size_t sink;
+
+    void time_scanners(const string & text, int rounds) {
+        BOOST_FOREACH(const TextScanner & scanner,
+                      available_text_scanners()) {
+            double start = now();
+            for (int i = 0; i < rounds; i ++) {
+                // Walks from escape to escape as write_string does.
+                size_t at = 0;
+                while (at < text.size()) {
+                    at += scanner.find_json_escape(text.data() + at,
+                                                   text.size() - at) + 1;
+                }
+                sink = at;
+            }
+            report("find_json_escape", scanner.name, text.size() * rounds,
+                   now() - start);
+
+            start = now();
+            for (int i = 0; i < rounds; i ++) {
+                sink = scanner.is_valid_utf8(text.data(), text.size());
+            }
+            report("is_valid_utf8", scanner.name, text.size() * rounds,
+                   now() - start);
+        }
+    }
+
+    void time_escaping(const string & text, int rounds) {
+        double start = now();
+        for (int i = 0; i < rounds; i ++) {
+            json_object * obj = json_object_new_string(text.c_str());
+            sink = strlen(json_object_to_json_string(obj));
+            json_object_put(obj);
+        }
+        report("escape", "json-c", text.size() * rounds, now() - start);
+
+        string out;
+        start = now();
+        for (int i = 0; i < rounds; i ++) {
+            out.clear();
+            JsonWriter::write_string(out, text.data(), text.size());
+            sink = out.size();
+        }
+        report("escape", nova::utils::text_scanner().name,
+               text.size() * rounds, now() - start);
+    }
+
+}
+
+int main(int argc, char* argv[]) {
+    const size_t sizes[] = { 64, 1024, 64 * 1024 };
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i ++) {
+        const string text = make_text(sizes[i]);
+        const int rounds = (int) (256 * 1024 * 1024 / sizes[i]) / 8;
+        printf("\n%d byte strings:\n", (int) sizes[i]);
+        time_scanners(text, rounds);
+        time_escaping(text, rounds);
+    }
+    return 0;
+}
@@ -0,0 +1,127 @@
+#define BOOST_TEST_MODULE text_tests
+#include <boost/test/unit_test.hpp>
+
+#include <boost/foreach.hpp>
+#include "nova/utils/text.h"
+#include <stdlib.h>
+#include <string>
+#include <string.h>
+
+using nova::utils::available_text_scanners;
+using nova::utils::TextScanner;
+using std::string;
+
+
+/**---------------------------------------------------------------------------
+ *- Helpers
+ *---------------------------------------------------------------------------*/
+
+size_t find_escape(const TextScanner & scanner, const string & text) {
+    return scanner.find_json_escape(text.data(), text.size());
+}
+
+bool valid(const TextScanner & scanner, const string & text) {
+    return scanner.is_valid_utf8(text.data(), text.size());
+}
+
+// Long enough that every vector width takes a few blocks.
+const string PLAIN(100, 'a');
+
+
+/**---------------------------------------------------------------------------
+ *- Tests
+ *---------------------------------------------------------------------------*/
+
+BOOST_AUTO_TEST_CASE(scalar_is_always_available)
+{
+    BOOST_REQUIRE(!available_text_scanners().empty());
+    BOOST_CHECK_EQUAL(available_text_scanners()[0].name, "scalar");
+    BOOST_CHECK_EQUAL(nova::utils::text_scanner().name,
+                      available_text_scanners().back().name);
+}
+
+BOOST_AUTO_TEST_CASE(escapes_are_found_at_every_position)
+{
+    const char specials[] = { '"', '\\', '\0', '\n', 0x1F };
+    BOOST_FOREACH(const TextScanner & scanner, available_text_scanners()) {
+        BOOST_TEST_MESSAGE(scanner.name);
+        BOOST_CHECK_EQUAL(find_escape(scanner, ""), 0u);
+        BOOST_CHECK_EQUAL(find_escape(scanner, PLAIN), PLAIN.size());
+        // Bytes past 0x7F aren't escaped, though they're negative chars.
+        BOOST_CHECK_EQUAL(find_escape(scanner, PLAIN + "\x80\xff\x20\x7f"),
+                          PLAIN.size() + 4);
+        for (size_t at = 0; at < PLAIN.size(); at ++) {
+            for (size_t i = 0; i < sizeof(specials); i ++) {
+                string text = PLAIN;
+                text[at] = specials[i];
+                text[PLAIN.size() - 1] = '"';
+                BOOST_CHECK_EQUAL(find_escape(scanner, text), at);
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(well_formed_utf8_is_accepted)
+{
+    const char * good[] = {
+        "", "plain ascii", "\xc3\xa9", "\xe2\x82\xac", "\xf0\x9f\x98\x80",
+        "\xed\x9f\xbf", "\xee\x80\x80", "\xf4\x8f\xbf\xbf", 0 };
+    BOOST_FOREACH(const TextScanner & scanner, available_text_scanners()) {
+        for (int i = 0; good[i] != 0; i ++) {
+            BOOST_CHECK(valid(scanner, good[i]));
+            BOOST_CHECK(valid(scanner, PLAIN + good[i] + PLAIN));
+            BOOST_CHECK(valid(scanner, PLAIN.substr(0, 31) + good[i]));
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(malformed_utf8_is_refused)
+{
+    const char * bad[] = {
+        "\x80",                 // Continuation with no lead
+        "\xc3",                 // Cut short
+        "\xe2\x82",             // Cut short
+        "\xc0\xaf",             // Overlong
+        "\xc1\xbf",             // Overlong
+        "\xe0\x9f\xbf",         // Overlong
+        "\xf0\x8f\xbf\xbf",     // Overlong
+        "\xed\xa0\x80",         // Surrogate
+        "\xf4\x90\x80\x80",     // Past U+10FFFF
+        "\xf5\x80\x80\x80",     // Never a lead
+        "\xff",
+        "\xc3\x28",             // Bad continuation
+        0 };
+    BOOST_FOREACH(const TextScanner & scanner, available_text_scanners()) {
+        BOOST_TEST_MESSAGE(scanner.name);
+        for (int i = 0; bad[i] != 0; i ++) {
+            BOOST_CHECK(!valid(scanner, bad[i]));
+            BOOST_CHECK(!valid(scanner, PLAIN + bad[i]));
+            BOOST_CHECK(!valid(scanner, PLAIN + bad[i] + PLAIN));
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(every_scanner_agrees_with_scalar)
+{
+    const TextScanner & scalar = available_text_scanners()[0];
+    srand(42);
+    const char pieces[][5] = { "a", "\"", "\\", "\n", "\xc3\xa9",
+                               "\xe2\x82\xac", "\xf0\x9f\x98\x80", "\x80",
+                               "\xed\xa0\x80", " " };
+    const int piece_count = sizeof(pieces) / sizeof(pieces[0]);
+    for (int round = 0; round < 2000; round ++) {
+        string text;
+        const int length = rand() % 80;
+        for (int i = 0; i < length; i ++) {
+            // Mostly plain text, as real messages are.
+            const int piece = rand() % 4 == 0 ? rand() % piece_count : 0;
+            text += pieces[piece];
+        }
+        BOOST_FOREACH(const TextScanner & scanner,
+                      available_text_scanners()) {
+            BOOST_CHECK_EQUAL(find_escape(scanner, text),
+                              find_escape(scalar, text));
+            BOOST_CHECK_EQUAL(valid(scanner, text), valid(scalar, text));
+        }
+    }
+}
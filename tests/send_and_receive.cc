@@ -8,6 +8,7 @@
 #include "nova/rpc/receiver.h"
 #include "nova/rpc/sender.h"
 #include "nova/db/mysql.h"
+#include <set>
 #include <string>
 #include <stdlib.h>
 
@@ -85,7 +86,7 @@ BOOST_AUTO_TEST_CASE(SendingAMessage)
     {
         GuestInput input = receiver.next_message();
 
-        BOOST_CHECK_EQUAL(input.args->to_string(), "{ }");
+        BOOST_CHECK_EQUAL(input.parse_args()->to_string(), "{ }");
         BOOST_CHECK_EQUAL("list_users", input.method_name);
 
         GuestOutput output;
@@ -93,7 +94,103 @@ BOOST_AUTO_TEST_CASE(SendingAMessage)
         output.result = JsonData::from_string("ok");
 
         CHECK_POINT();
-        receiver.finish_message(output);
+        receiver.finish_message(input, output);
         CHECK_POINT();
     }
 }
+
+BOOST_AUTO_TEST_CASE(ReceivingSeveralPrefetchedMessages)
+{
+    Log log;
+    FlagValues flags(get_flags());
+    AmqpConnectionPtr connection = AmqpConnection::create(
+        flags.rabbit_host(), flags.rabbit_port(), flags.rabbit_userid(),
+        flags.rabbit_password(), flags.rabbit_client_memory());
+    ReceiverConfig config;
+    config.prefetch_count = 4;
+    config.publisher_confirms = true;
+    Receiver receiver(connection, TOPIC, "nova", config);
+    Sender sender(connection, TOPIC);
+
+    const char * const METHODS[] = { "list_users", "list_databases",
+                                     "is_root_enabled" };
+    for (int i = 0; i < 3; i ++) {
+        std::string msg = "{ 'method':'";
+        msg += METHODS[i];
+        msg += "' }";
+        sender.send(msg.c_str());
+    }
+    CHECK_POINT();
+    // Messages beyond the first are handed out of the local buffer but must
+    // still arrive in order.
+    for (int i = 0; i < 3; i ++) {
+        GuestInput input = receiver.next_message();
+        BOOST_CHECK_EQUAL(METHODS[i], input.method_name);
+
+        GuestOutput output;
+        output.failure = boost::none;
+        output.result = JsonData::from_null();
+        receiver.finish_message(input, output);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(ReceivingFromSharedAndFanoutQueues)
+{
+    FlagValues flags(get_flags());
+    AmqpConnectionPtr connection = AmqpConnection::create(
+        flags.rabbit_host(), flags.rabbit_port(), flags.rabbit_userid(),
+        flags.rabbit_password(), flags.rabbit_client_memory());
+    ReceiverConfig config;
+    config.fanout_exchange = "guest_fanout";
+    config.shared_topic = TOPIC;
+    Receiver receiver(connection, "guest.host_a", "nova", config);
+
+    // One publish to each of the three queues.
+    AmqpChannelPtr channel = connection->acquire_channel();
+    channel->publish("nova", "guest.host_a", "{ 'method':'list_users' }");
+    channel->publish("nova", TOPIC, "{ 'method':'list_databases' }");
+    channel->publish("guest_fanout", "", "{ 'method':'is_root_enabled' }");
+    connection->release_channel(channel);
+
+    std::set<std::string> methods;
+    for (int i = 0; i < 3; i ++) {
+        GuestInput input = receiver.next_message();
+        methods.insert(input.method_name);
+
+        GuestOutput output;
+        output.failure = boost::none;
+        output.result = JsonData::from_null();
+        receiver.finish_message(input, output);
+    }
+    BOOST_CHECK_EQUAL(methods.size(), 3u);
+    BOOST_CHECK(methods.count("list_users") == 1);
+    BOOST_CHECK(methods.count("list_databases") == 1);
+    BOOST_CHECK(methods.count("is_root_enabled") == 1);
+}
+
+BOOST_AUTO_TEST_CASE(ReconnectingWithACachedTopology)
+{
+    FlagValues flags(get_flags());
+    AmqpTopology topology;
+    for (int i = 0; i < 2; i ++) {
+        // The second time around the topology is replayed.
+        AmqpConnectionPtr connection = AmqpConnection::create(
+            flags.rabbit_host(), flags.rabbit_port(), flags.rabbit_userid(),
+            flags.rabbit_password(), flags.rabbit_client_memory());
+        ReceiverConfig config;
+        config.fanout_exchange = "guest_fanout";
+        Receiver receiver(connection, TOPIC, "nova", config, &topology);
+        BOOST_REQUIRE(!topology.empty());
+
+        AmqpChannelPtr channel = connection->acquire_channel();
+        channel->publish("guest_fanout", "", "{ 'method':'list_users' }");
+        connection->release_channel(channel);
+
+        GuestInput input = receiver.next_message();
+        BOOST_CHECK_EQUAL(input.method_name, "list_users");
+        GuestOutput output;
+        output.failure = boost::none;
+        output.result = JsonData::from_null();
+        receiver.finish_message(input, output);
+    }
+}